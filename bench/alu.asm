@@ -0,0 +1,14 @@
+# тесная цепочка ALU-операций без обращений к памяти; a0 — число итераций
+    li t0, 0x12345
+    li t1, 0x9E37
+loop:
+    add t2, t0, t1
+    xor t0, t2, t1
+    slli t3, t0, 3
+    srli t4, t0, 7
+    or t1, t3, t4
+    sub t2, t2, t1
+    and t5, t2, t0
+    addi a0, a0, -1
+    bnez a0, loop
+    mv a1, t5
@@ -0,0 +1,25 @@
+# ветвления по псевдослучайным битам (xorshift32): плохо предсказываемые переходы; a0 — число итераций
+    li t0, 2463534242
+loop:
+    slli t1, t0, 13
+    xor t0, t0, t1
+    srli t1, t0, 17
+    xor t0, t0, t1
+    slli t1, t0, 5
+    xor t0, t0, t1
+    andi t2, t0, 1
+    beqz t2, even
+    addi s0, s0, 1
+    j next
+even:
+    addi s1, s1, 1
+next:
+    andi t2, t0, 6
+    bnez t2, skip
+    addi s2, s2, 1
+skip:
+    blt t0, zero, negative
+    addi s3, s3, 1
+negative:
+    addi a0, a0, -1
+    bnez a0, loop
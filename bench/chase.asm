@@ -0,0 +1,33 @@
+# погоня за указателями по кольцу из 16K узлов с шагом 5471: каждая загрузка зависит от предыдущей;
+# a0 — число итераций по 8 переходов
+    .data
+nodes:
+    .space 65536
+    .text
+    la s0, nodes
+    li s1, 16383
+    li s2, 5471
+    li t1, 0
+build:
+    add t2, t1, s2
+    and t2, t2, s1
+    slli t2, t2, 2
+    add t2, t2, s0
+    slli t3, t1, 2
+    add t3, t3, s0
+    sw t2, 0(t3)
+    addi t1, t1, 1
+    bgeu s1, t1, build
+    mv t0, s0
+loop:
+    lw t0, 0(t0)
+    lw t0, 0(t0)
+    lw t0, 0(t0)
+    lw t0, 0(t0)
+    lw t0, 0(t0)
+    lw t0, 0(t0)
+    lw t0, 0(t0)
+    lw t0, 0(t0)
+    addi a0, a0, -1
+    bnez a0, loop
+    mv a1, t0
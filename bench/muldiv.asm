@@ -0,0 +1,16 @@
+# умножения и деления вперемешку; a0 — число итераций
+    li t0, 7
+    li t1, 1000003
+loop:
+    mul t2, t0, t1
+    mulh t3, t0, t1
+    mulhu t4, t2, t1
+    div t5, t2, t1
+    rem t6, t2, t1
+    divu s0, t4, t1
+    add t0, t0, t5
+    add t0, t0, t6
+    add t0, t0, s0
+    addi a0, a0, -1
+    bnez a0, loop
+    mv a1, t0
@@ -0,0 +1,28 @@
+# потоковый проход по массиву 64 КиБ: чтение, сумма, запись обратно; a0 — число проходов
+    .data
+buf:
+    .space 65536
+    .text
+    la s0, buf
+    li s1, 16384
+    mv t0, s0
+    li t1, 0
+fill:
+    sw t1, 0(t0)
+    addi t1, t1, 1
+    addi t0, t0, 4
+    blt t1, s1, fill
+pass:
+    mv t0, s0
+    li t1, 0
+sum:
+    lw t2, 0(t0)
+    add s2, s2, t2
+    addi t2, t2, 1
+    sw t2, 0(t0)
+    addi t1, t1, 1
+    addi t0, t0, 4
+    blt t1, s1, sum
+    addi a0, a0, -1
+    bnez a0, pass
+    mv a1, s2
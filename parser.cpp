@@ -2,15 +2,54 @@
 #include<bits/stdc++.h>
 */
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <deque>
+#include <exception>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <ostream>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <tuple>
+#include <unordered_map>
 #include <variant>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define RV_POSIX 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#define RV_PERF 1
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RV_TSC 1
+#include <x86intrin.h>
+#endif
 
 #pragma GCC optimize("O3")
 
@@ -22,6 +61,7 @@ constexpr Opcode OPC_15 = 0b0001111;
 constexpr Opcode OPC_19 = 0b0010011;
 constexpr Opcode OPC_23 = 0b0010111;
 constexpr Opcode OPC_35 = 0b0100011;
+constexpr Opcode OPC_47 = 0b0101111;
 constexpr Opcode OPC_51 = 0b0110011;
 constexpr Opcode OPC_55 = 0b0110111;
 constexpr Opcode OPC_99 = 0b1100011;
@@ -29,6 +69,18 @@ constexpr Opcode OPC_103 = 0b1100111;
 constexpr Opcode OPC_111 = 0b1101111;
 constexpr Opcode OPC_115 = 0b1110011;
 
+// счётчики Zicntr: доступны гостю только на чтение (старшие биты номера 11)
+constexpr uint16_t CSR_CYCLE = 0xC00;
+constexpr uint16_t CSR_TIME = 0xC01;
+constexpr uint16_t CSR_INSTRET = 0xC02;
+constexpr uint16_t CSR_CYCLEH = 0xC80;
+constexpr uint16_t CSR_TIMEH = 0xC81;
+constexpr uint16_t CSR_INSTRETH = 0xC82;
+
+constexpr pair<const char *, uint16_t> csrNames[] = {{"cycle", CSR_CYCLE},   {"time", CSR_TIME},
+                                                     {"instret", CSR_INSTRET}, {"cycleh", CSR_CYCLEH},
+                                                     {"timeh", CSR_TIMEH},   {"instreth", CSR_INSTRETH}};
+
 using Funct3 = uint8_t;
 constexpr Funct3 F0 = 0b000;
 constexpr Funct3 F1 = 0b001;
@@ -45,6 +97,8 @@ constexpr Funct7 F1_7 = 0b0000001;
 constexpr Funct7 F32_7 = 0b0100000;
 
 string currentPolicy = "LRU";
+string currentEngine = "switch";
+constexpr const char *ENGINES[] = {"switch", "threaded", "block", "jit"};
 
 struct R_Type {
     uint8_t rd;
@@ -101,6 +155,7 @@ struct Instruction {
     string name;
     string type_name;
     Opcode opcode;
+    size_t line = 0; // строка исходника, 0 — неизвестна
     variant<R_Type, I_Type, S_Type, B_Type, U_Type, J_Type, Fence_Type, System_Type> type;
 
     Instruction(string name, Opcode opcode, R_Type r) {
@@ -137,7 +192,9 @@ struct Instruction {
 };
 
 
-map<string, int> registers = {{"zero", 0}, {"ra", 1},   {"sp", 2},   {"gp", 3},   {"tp", 4},   {"t0", 5},   {"t1", 6},
+// имена регистров: статическая таблица без конструирования при старте,
+// поисковая таблица строится лениво при первом разборе
+constexpr pair<const char *, int> registers[] = {{"zero", 0}, {"ra", 1},   {"sp", 2},   {"gp", 3},   {"tp", 4},   {"t0", 5},   {"t1", 6},
                               {"t2", 7},   {"s0", 8},   {"fp", 8},   {"s1", 9},   {"a0", 10},  {"a1", 11},  {"a2", 12},
                               {"a3", 13},  {"a4", 14},  {"a5", 15},  {"a6", 16},  {"a7", 17},  {"s2", 18},  {"s3", 19},
                               {"s4", 20},  {"s5", 21},  {"s6", 22},  {"s7", 23},  {"s8", 24},  {"s9", 25},  {"s10", 26},
@@ -150,45 +207,186 @@ map<string, int> registers = {{"zero", 0}, {"ra", 1},   {"sp", 2},   {"gp", 3},
                               {"r20", 20}, {"r21", 21}, {"r22", 22}, {"r23", 23}, {"r24", 24}, {"r25", 25}, {"r26", 26},
                               {"r27", 27}, {"r28", 28}, {"r29", 29}, {"r30", 30}, {"r31", 31}};
 
-string trim(string s) {
-    // убирает пробелы в начале и в конце слова
-    size_t begin = 0;
-    while (begin < s.size() && isspace(s[begin])) {
-        begin++;
+// файл, отображённый в память целиком; без mmap читается обычным образом
+struct MappedFile {
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+    vector<uint8_t> buffer;
+#ifdef RV_POSIX
+    void *mapping = nullptr;
+#endif
+
+    explicit MappedFile(const string &path) {
+#ifdef RV_POSIX
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw runtime_error("cannot open " + path);
+        }
+        struct stat st {};
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            size = static_cast<size_t>(st.st_size);
+            mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED) {
+                mapping = nullptr;
+                close(fd);
+                throw runtime_error("cannot mmap " + path);
+            }
+            data = static_cast<const uint8_t *>(mapping);
+        }
+        close(fd);
+#else
+        ifstream in(path, ios::binary);
+        if (!in) {
+            throw runtime_error("cannot open " + path);
+        }
+        buffer.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+        data = buffer.data();
+        size = buffer.size();
+#endif
+    }
+
+    ~MappedFile() {
+#ifdef RV_POSIX
+        if (mapping != nullptr) {
+            munmap(mapping, size);
+        }
+#endif
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    uint16_t get16(size_t offset) const { return static_cast<uint16_t>(data[offset] | (data[offset + 1] << 8)); }
+
+    uint32_t get32(size_t offset) const { return get16(offset) | (static_cast<uint32_t>(get16(offset + 2)) << 16); }
+};
+
+// мнемоника или имя регистра, упакованные по 6 бит на символ: до 10 символов из [a-z0-9.],
+// 0 — не упаковывается. constexpr, чтобы сравнивать через switch без строк
+constexpr uint64_t packMnemonic(string_view s) {
+    if (s.empty() || s.size() > 10) {
+        return 0;
     }
-    int end = s.size() - 1;
-    while (end > begin && isspace(s[end])) {
-        end--;
+    uint64_t key = 0;
+    for (char c: s) {
+        uint64_t code = 0;
+        if (c >= 'a' && c <= 'z') {
+            code = static_cast<uint64_t>(c - 'a' + 1);
+        } else if (c >= '0' && c <= '9') {
+            code = static_cast<uint64_t>(c - '0' + 27);
+        } else if (c == '.') {
+            code = 37;
+        } else {
+            return 0;
+        }
+        key = (key << 6) | code;
     }
-    return s.substr(begin, end - begin + 1);
+    return key;
 }
 
+unsigned parseJobs = 0; // 0 — по числу ядер
+
+constexpr uint32_t TEXT_BASE = 0;          // progCount первой инструкции
+constexpr uint32_t DATA_BASE = 0x10000000; // адрес начала .data
+
+enum Section : uint8_t { SEC_TEXT, SEC_DATA };
+
+// метка или ссылка на метку: смещение локально для куска и сдвигается при склейке
+struct SymbolRef {
+    string_view name;
+    Section section;
+    size_t offset; // индекс инструкции в .text или номер байта в .data
+    size_t line;
+};
+
+// результат разбора одного куска исходника
+struct AsmChunk {
+    Section section = SEC_TEXT;
+    size_t line = 0;
+    deque<Instruction> text;
+    vector<uint8_t> data;
+    vector<SymbolRef> labels;
+    vector<SymbolRef> fixups; // в .text — цель перехода (pc-relative), в .data — .word с адресом
+};
+
+// собранная программа: код и содержимое .data с адреса DATA_BASE
+struct Assembly {
+    deque<Instruction> text;
+    vector<uint8_t> data;
+    bool textAddressTaken = false; // адрес метки из .text попал в регистр или .data через la/.word
+};
+
 struct Parser {
+    static constexpr size_t MAX_TOKENS = 64;
+    static constexpr size_t PARALLEL_PARSE_BYTES = 1 << 20;
+
     string filename;
     deque<Instruction> instructions;
 
     explicit Parser(string filename) { this->filename = filename; }
 
-    static int get_register(string reg) {
-        if (reg[0] == 'x') {
-            return stoi(reg.substr(1));
+    static int64_t parse_number(string_view s, int base, string_view what) {
+        int64_t value = 0;
+        auto res = from_chars(s.data(), s.data() + s.size(), value, base);
+        if (s.empty() || res.ec != errc() || res.ptr != s.data() + s.size()) {
+            throw invalid_argument("bad " + string(what) + " '" + string(s) + "'");
+        }
+        return value;
+    }
+
+    static int get_register(string_view reg) {
+        if (reg.size() > 1 && reg[0] == 'x') {
+            int64_t n = parse_number(reg.substr(1), 10, "register");
+            if (n < 0 || n > 31) {
+                throw invalid_argument("bad register '" + string(reg) + "'");
+            }
+            return static_cast<int>(n);
+        }
+        // таблица строится один раз из registers, дальше поиск без строк;
+        // при повторе имени (r11) действует первая запись
+        static const unordered_map<uint64_t, int> table = [] {
+            unordered_map<uint64_t, int> t;
+            for (const auto &entry: registers) {
+                t.emplace(packMnemonic(entry.first), entry.second);
+            }
+            return t;
+        }();
+        auto it = table.find(packMnemonic(reg));
+        if (it == table.end()) {
+            throw invalid_argument("unknown register '" + string(reg) + "'");
         }
-        return registers[reg];
+        return it->second;
     }
 
-    static int parse_imm(string immStr) {
-        string s = immStr;
+    static int parse_imm(string_view immStr) {
+        string_view s = immStr;
         bool sign = false;
         if (!s.empty() && s[0] == '-') {
             sign = true;
-            s = s.substr(1);
+            s.remove_prefix(1);
+        }
+        int base = 10;
+        if (s.size() > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+            base = 16;
+            s.remove_prefix(2);
+        }
+        int64_t ans = parse_number(s, base, "immediate");
+        if (ans > 0xFFFFFFFFLL) {
+            throw invalid_argument("immediate out of range '" + string(immStr) + "'");
+        }
+        return static_cast<int>(static_cast<uint32_t>((sign) ? -ans : ans));
+    }
+
+    // непосредственное значение должно помещаться в поле формата — иначе движки и кодировщик
+    // поняли бы одну и ту же строку по-разному
+    static int32_t checkImm(string_view str, int32_t imm, int32_t lo, int32_t hi, int32_t align = 1) {
+        if (imm < lo || imm > hi || imm % align != 0) {
+            throw invalid_argument("immediate out of range '" + string(str) + "'");
         }
-        int ans = (s.size() > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) ? stoi(s.substr(2), nullptr, 16)
-                                                                                : stoi(s);
-        return ((sign) ? -ans : ans);
+        return imm;
     }
 
-    static uint8_t makeArg(string str) {
+    static uint8_t makeArg(string_view str) {
         bool isNum = ((str.size() > 0) ? true : false);
         for (size_t i = 0; i < str.size(); i++) {
             if (str[i] > '9' || str[i] < '0') {
@@ -196,7 +394,7 @@ struct Parser {
             }
         }
         if (isNum) {
-            return static_cast<uint8_t>(stoi(str));
+            return static_cast<uint8_t>(parse_number(str, 10, "fence argument"));
         } else {
             uint8_t ans = 0;
             for (char chr: str) {
@@ -217,769 +415,6612 @@ struct Parser {
         }
     }
 
-    static Instruction makeInstruction(string command, deque<string> details) {
-        if (command == "add" || command == "sub" || command == "sll" || command == "slt" || command == "sltu" ||
-            command == "xor" || command == "srl" || command == "sra" || command == "or" || command == "and" ||
-            command == "mul" || command == "mulh" || command == "mulhsu" || command == "mulhu" || command == "div" ||
-            command == "divu" || command == "rem" || command == "remu") {
-            return makeOP(command, details);
-        }
-        if (command == "addi" || command == "slti" || command == "sltiu" || command == "xori" || command == "ori" ||
-            command == "andi" || command == "slli" || command == "srli" || command == "srai") {
-            return makeOP_IMM(command, details);
-        }
-        if (command == "beq" || command == "bne" || command == "blt" || command == "bge" || command == "bltu" ||
-            command == "bgeu") {
-            return makeBRANCH(command, details);
+    static void expectArgs(string_view command, size_t argc, size_t expected) {
+        if (argc != expected) {
+            throw invalid_argument(string(command) + " expects " + to_string(expected) + " operands, got " +
+                                   to_string(argc));
         }
-        if (command == "lb" || command == "lh" || command == "lw" || command == "lbu" || command == "lhu") {
-            return makeLOAD(command, details);
+    }
+
+    // один switch по упакованной мнемонике вместо цепочки сравнений строк
+    static Instruction makeInstruction(string_view command, const string_view *details, size_t argc, AsmChunk &out) {
+        if (command.substr(0, 3) == "amo" || command.substr(0, 3) == "lr." || command.substr(0, 3) == "sc.") {
+            return makeAMO(command, details, argc);
         }
-        if (command == "jal") {
-            return makeJAL(command, details);
+        switch (packMnemonic(command)) {
+            case packMnemonic("add"):
+                return makeOP(command, details, argc, F0, F0_7);
+            case packMnemonic("sub"):
+                return makeOP(command, details, argc, F0, F32_7);
+            case packMnemonic("sll"):
+                return makeOP(command, details, argc, F1, F0_7);
+            case packMnemonic("slt"):
+                return makeOP(command, details, argc, F2, F0_7);
+            case packMnemonic("sltu"):
+                return makeOP(command, details, argc, F3, F0_7);
+            case packMnemonic("xor"):
+                return makeOP(command, details, argc, F4, F0_7);
+            case packMnemonic("srl"):
+                return makeOP(command, details, argc, F5, F0_7);
+            case packMnemonic("sra"):
+                return makeOP(command, details, argc, F5, F32_7);
+            case packMnemonic("or"):
+                return makeOP(command, details, argc, F6, F0_7);
+            case packMnemonic("and"):
+                return makeOP(command, details, argc, F7, F0_7);
+            case packMnemonic("mul"):
+                return makeOP(command, details, argc, F0, F1_7);
+            case packMnemonic("mulh"):
+                return makeOP(command, details, argc, F1, F1_7);
+            case packMnemonic("mulhsu"):
+                return makeOP(command, details, argc, F2, F1_7);
+            case packMnemonic("mulhu"):
+                return makeOP(command, details, argc, F3, F1_7);
+            case packMnemonic("div"):
+                return makeOP(command, details, argc, F4, F1_7);
+            case packMnemonic("divu"):
+                return makeOP(command, details, argc, F5, F1_7);
+            case packMnemonic("rem"):
+                return makeOP(command, details, argc, F6, F1_7);
+            case packMnemonic("remu"):
+                return makeOP(command, details, argc, F7, F1_7);
+
+            case packMnemonic("addi"):
+                return makeOP_IMM(command, details, argc, F0);
+            case packMnemonic("slti"):
+                return makeOP_IMM(command, details, argc, F2);
+            case packMnemonic("sltiu"):
+                return makeOP_IMM(command, details, argc, F3);
+            case packMnemonic("xori"):
+                return makeOP_IMM(command, details, argc, F4);
+            case packMnemonic("ori"):
+                return makeOP_IMM(command, details, argc, F6);
+            case packMnemonic("andi"):
+                return makeOP_IMM(command, details, argc, F7);
+            case packMnemonic("slli"):
+                return makeOP_IMM(command, details, argc, F1);
+            case packMnemonic("srli"):
+                return makeOP_IMM(command, details, argc, F5);
+            case packMnemonic("srai"):
+                return makeOP_IMM(command, details, argc, F5, 1024);
+
+            case packMnemonic("beq"):
+                return makeBRANCH(command, details, argc, out, F0);
+            case packMnemonic("bne"):
+                return makeBRANCH(command, details, argc, out, F1);
+            case packMnemonic("blt"):
+                return makeBRANCH(command, details, argc, out, F4);
+            case packMnemonic("bge"):
+                return makeBRANCH(command, details, argc, out, F5);
+            case packMnemonic("bltu"):
+                return makeBRANCH(command, details, argc, out, F6);
+            case packMnemonic("bgeu"):
+                return makeBRANCH(command, details, argc, out, F7);
+
+            case packMnemonic("lb"):
+                return makeLOAD(command, details, argc, F0);
+            case packMnemonic("lh"):
+                return makeLOAD(command, details, argc, F1);
+            case packMnemonic("lw"):
+                return makeLOAD(command, details, argc, F2);
+            case packMnemonic("lbu"):
+                return makeLOAD(command, details, argc, F4);
+            case packMnemonic("lhu"):
+                return makeLOAD(command, details, argc, F5);
+
+            case packMnemonic("sb"):
+                return makeSTORE(command, details, argc, F0);
+            case packMnemonic("sh"):
+                return makeSTORE(command, details, argc, F1);
+            case packMnemonic("sw"):
+                return makeSTORE(command, details, argc, F2);
+
+            case packMnemonic("jal"):
+                return makeJAL(command, details, argc, out);
+            case packMnemonic("jalr"):
+                return makeJALR(command, details, argc);
+            case packMnemonic("lui"):
+                return makeLUI(command, details, argc);
+            case packMnemonic("auipc"):
+                return makeAUIPC(command, details, argc);
+            case packMnemonic("fence"):
+                return makeFENCE(command, details, argc);
+            case packMnemonic("ecall"):
+            case packMnemonic("ebreak"):
+            case packMnemonic("pause"):
+            case packMnemonic("fence.tso"):
+            case packMnemonic("nop"):
+                expectArgs(command, argc, 0);
+                return makeSYSTEM(command);
+
+            case packMnemonic("csrrw"):
+                return makeCSR(command, details, argc, F1);
+            case packMnemonic("csrrs"):
+                return makeCSR(command, details, argc, F2);
+            case packMnemonic("csrrc"):
+                return makeCSR(command, details, argc, F3);
+            case packMnemonic("csrrwi"):
+                return makeCSR(command, details, argc, F5);
+            case packMnemonic("csrrsi"):
+                return makeCSR(command, details, argc, F6);
+            case packMnemonic("csrrci"):
+                return makeCSR(command, details, argc, F7);
+
+            // псевдоинструкции, которые разворачиваются в одну базовую
+            case packMnemonic("csrr"): {
+                expectArgs(command, argc, 2);
+                string_view args[3] = {details[0], details[1], "x0"};
+                return makeCSR("csrrs", args, 3, F2);
+            }
+            case packMnemonic("csrw"):
+            case packMnemonic("csrs"):
+            case packMnemonic("csrc"):
+            case packMnemonic("csrwi"):
+            case packMnemonic("csrsi"):
+            case packMnemonic("csrci"): {
+                expectArgs(command, argc, 2);
+                string_view args[3] = {"x0", details[0], details[1]};
+                bool immediate = command.back() == 'i';
+                Funct3 f3 = (command[3] == 'w') ? F1 : ((command[3] == 's') ? F2 : F3);
+                return makeCSR(string("csrr") + command[3] + (immediate ? "i" : ""), args, 3,
+                               static_cast<Funct3>(f3 | (immediate ? 4 : 0)));
+            }
+            case packMnemonic("rdcycle"):
+            case packMnemonic("rdtime"):
+            case packMnemonic("rdinstret"):
+            case packMnemonic("rdcycleh"):
+            case packMnemonic("rdtimeh"):
+            case packMnemonic("rdinstreth"): {
+                expectArgs(command, argc, 1);
+                string_view args[3] = {details[0], command.substr(2), "x0"};
+                return makeCSR("csrrs", args, 3, F2);
+            }
+            case packMnemonic("mv"): {
+                expectArgs(command, argc, 2);
+                string_view args[3] = {details[0], details[1], "0"};
+                return makeOP_IMM("addi", args, 3, F0);
+            }
+            case packMnemonic("not"): {
+                expectArgs(command, argc, 2);
+                string_view args[3] = {details[0], details[1], "-1"};
+                return makeOP_IMM("xori", args, 3, F4);
+            }
+            case packMnemonic("neg"): {
+                expectArgs(command, argc, 2);
+                string_view args[3] = {details[0], "x0", details[1]};
+                return makeOP("sub", args, 3, F0, F32_7);
+            }
+            case packMnemonic("j"):
+            case packMnemonic("call"): {
+                expectArgs(command, argc, 1);
+                string_view args[2] = {(command == "j") ? "x0" : "x1", details[0]};
+                return makeJAL("jal", args, 2, out);
+            }
+            case packMnemonic("ret"): {
+                expectArgs(command, argc, 0);
+                string_view args[3] = {"x0", "x1", "0"};
+                return makeJALR("jalr", args, 3);
+            }
+            case packMnemonic("beqz"):
+            case packMnemonic("bnez"): {
+                expectArgs(command, argc, 2);
+                string_view args[3] = {details[0], "x0", details[1]};
+                return makeBRANCH((command == "beqz") ? "beq" : "bne", args, 3, out, (command == "beqz") ? F0 : F1);
+            }
+            default:
+                throw invalid_argument("unknown instruction '" + string(command) + "'");
         }
-        if (command == "jalr") {
-            return makeJALR(command, details);
+    }
+
+
+    // li и la: константа или адрес кладутся в регистр одной-двумя инструкциями
+    static bool makeConstant(string_view command, const string_view *details, size_t argc, AsmChunk &out) {
+        if (command != "li" && command != "la") {
+            return false;
         }
-        if (command == "sb" || command == "sh" || command == "sw") {
-            return makeSTORE(command, details);
+        expectArgs(command, argc, 2);
+        uint8_t rd = static_cast<uint8_t>(get_register(details[0]));
+        if (command == "la" && isSymbol(details[1])) {
+            // адрес станет известен только при склейке, поэтому всегда пара lui + addi
+            out.fixups.push_back({details[1], SEC_TEXT, out.text.size(), out.line});
+            out.text.push_back(Instruction("lui", OPC_55, U_Type{rd, 0}));
+            out.fixups.push_back({details[1], SEC_TEXT, out.text.size(), out.line});
+            out.text.push_back(Instruction("addi", OPC_19, I_Type{rd, F0, rd, 0}));
+            return true;
         }
-        if (command == "lui") {
-            return makeLUI(command, details);
+        pushConstant(rd, parse_imm(details[1]), out);
+        return true;
+    }
+
+    static int32_t lo12(uint32_t value) { return static_cast<int32_t>(((value & 0xFFF) ^ 0x800)) - 0x800; }
+
+    static int32_t hi20(uint32_t value) { return static_cast<int32_t>(((value - static_cast<uint32_t>(lo12(value))) >> 12)); }
+
+    // кратчайшая последовательность: addi, lui или lui + addi
+    static void pushConstant(uint8_t rd, int32_t value, AsmChunk &out) {
+        if (value >= -2048 && value <= 2047) {
+            out.text.push_back(Instruction("addi", OPC_19, I_Type{rd, F0, 0, value}));
+            return;
         }
-        if (command == "auipc") {
-            return makeAUIPC(command, details);
+        uint32_t bits = static_cast<uint32_t>(value);
+        out.text.push_back(Instruction("lui", OPC_55, U_Type{rd, hi20(bits)}));
+        if (lo12(bits) != 0) {
+            out.text.push_back(Instruction("addi", OPC_19, I_Type{rd, F0, rd, lo12(bits)}));
         }
-        if (command == "fence") {
-            return makeFENCE(command, details);
+    }
+
+    // lr.w rd, (rs1); sc.w и amo*.w rd, rs2, (rs1); суффиксы .aq, .rl, .aqrl
+    static Instruction makeAMO(string_view command, const string_view *details, size_t argc) {
+        string_view base = command;
+        uint8_t ordering = 0;
+        for (auto suffix: {make_pair(string_view(".aqrl"), 3), make_pair(string_view(".aq"), 2),
+                           make_pair(string_view(".rl"), 1)}) {
+            if (base.size() > suffix.first.size() &&
+                base.substr(base.size() - suffix.first.size()) == suffix.first) {
+                base.remove_suffix(suffix.first.size());
+                ordering = static_cast<uint8_t>(suffix.second);
+                break;
+            }
         }
-        if (command == "ecall" || command == "ebreak" || command == "pause" || command == "fence.tso" ||
-            command == "nop") {
-            return makeSYSTEM(command);
+        uint8_t funct5 = 0;
+        switch (packMnemonic(base)) {
+            case packMnemonic("lr.w"):
+                funct5 = 0b00010;
+                break;
+            case packMnemonic("sc.w"):
+                funct5 = 0b00011;
+                break;
+            case packMnemonic("amoswap.w"):
+                funct5 = 0b00001;
+                break;
+            case packMnemonic("amoadd.w"):
+                funct5 = 0b00000;
+                break;
+            case packMnemonic("amoxor.w"):
+                funct5 = 0b00100;
+                break;
+            case packMnemonic("amoand.w"):
+                funct5 = 0b01100;
+                break;
+            case packMnemonic("amoor.w"):
+                funct5 = 0b01000;
+                break;
+            case packMnemonic("amomin.w"):
+                funct5 = 0b10000;
+                break;
+            case packMnemonic("amomax.w"):
+                funct5 = 0b10100;
+                break;
+            case packMnemonic("amominu.w"):
+                funct5 = 0b11000;
+                break;
+            case packMnemonic("amomaxu.w"):
+                funct5 = 0b11100;
+                break;
+            default:
+                throw invalid_argument("unknown instruction '" + string(command) + "'");
         }
+        bool isLr = (funct5 == 0b00010);
+        expectArgs(command, argc, isLr ? 2 : 3);
+        uint8_t rd = static_cast<uint8_t>(get_register(details[0]));
+        uint8_t rs2 = isLr ? 0 : static_cast<uint8_t>(get_register(details[1]));
+        uint8_t rs1 = static_cast<uint8_t>(get_register(details[argc - 1]));
+        R_Type r{rd, F2, rs1, rs2, static_cast<Funct7>((funct5 << 2) | ordering)};
+        return Instruction(string(command), OPC_47, r);
     }
 
-
-    static Instruction makeOP(string command, deque<string> details) {
+    static Instruction makeOP(string_view command, const string_view *details, size_t argc, Funct3 f3, Funct7 f7) {
+        expectArgs(command, argc, 3);
         uint8_t rd = static_cast<uint8_t>(get_register(details[0]));
         uint8_t rs1 = static_cast<uint8_t>(get_register(details[1]));
         uint8_t rs2 = static_cast<uint8_t>(get_register(details[2]));
-        Funct3 f3;
-        Funct7 f7;
-
-        if (command == "add") {
-            f3 = F0;
-            f7 = F0_7;
-        }
-        if (command == "sub") {
-            f3 = F0;
-            f7 = F32_7;
-        }
-        if (command == "sll") {
-            f3 = F1;
-            f7 = F0_7;
-        }
-        if (command == "slt") {
-            f3 = F2;
-            f7 = F0_7;
-        }
-        if (command == "sltu") {
-            f3 = F3;
-            f7 = F0_7;
-        }
-        if (command == "xor") {
-            f3 = F4;
-            f7 = F0_7;
-        }
-        if (command == "srl") {
-            f3 = F5;
-            f7 = F0_7;
-        }
-        if (command == "sra") {
-            f3 = F5;
-            f7 = F32_7;
-        }
-        if (command == "or") {
-            f3 = F6;
-            f7 = F0_7;
-        }
-        if (command == "and") {
-            f3 = F7;
-            f7 = F0_7;
-        }
-        if (command == "mul") {
-            f3 = F0;
-            f7 = F1_7;
-        }
-        if (command == "mulh") {
-            f3 = F1;
-            f7 = F1_7;
-        }
-        if (command == "mulhsu") {
-            f3 = F2;
-            f7 = F1_7;
-        }
-        if (command == "mulhu") {
-            f3 = F3;
-            f7 = F1_7;
-        }
-        if (command == "div") {
-            f3 = F4;
-            f7 = F1_7;
-        }
-        if (command == "divu") {
-            f3 = F5;
-            f7 = F1_7;
-        }
-        if (command == "rem") {
-            f3 = F6;
-            f7 = F1_7;
-        }
-        if (command == "remu") {
-            f3 = F7;
-            f7 = F1_7;
-        }
         R_Type r{rd, f3, rs1, rs2, f7};
-        return Instruction(command, OPC_51, r);
+        return Instruction(string(command), OPC_51, r);
     }
 
-    static Instruction makeOP_IMM(string command, deque<string> details) {
+    // у srai funct7 = 0100000 передаётся через imm (+1024)
+    static Instruction makeOP_IMM(string_view command, const string_view *details, size_t argc, Funct3 f3,
+                                  int32_t bias = 0) {
+        expectArgs(command, argc, 3);
         uint8_t rd = static_cast<uint8_t>(get_register(details[0]));
         uint8_t rs1 = static_cast<uint8_t>(get_register(details[1]));
         int32_t imm = parse_imm(details[2]);
-        Funct3 f3;
-
-        if (command == "addi") {
-            f3 = F0;
-        }
-        if (command == "slti") {
-            f3 = F2;
-        }
-        if (command == "sltiu") {
-            f3 = F3;
-        }
-        if (command == "xori") {
-            f3 = F4;
-        }
-        if (command == "ori") {
-            f3 = F6;
-        }
-        if (command == "andi") {
-            f3 = F7;
-        }
-        if (command == "slli") {
-            f3 = F1;
-        }
-        if (command == "srli") {
-            f3 = F5;
+        if (f3 == F1 || f3 == F5) {
+            checkImm(details[2], imm, 0, 31);
+        } else {
+            checkImm(details[2], imm, -2048, 2047);
         }
-        if (command == "srai") {
-            f3 = F5;
-            imm += 1024;
+        I_Type i = {rd, f3, rs1, imm + bias};
+        return Instruction(string(command), OPC_19, i);
+    }
+
+    static bool isSymbol(string_view s) {
+        return !s.empty() && (isalpha(static_cast<unsigned char>(s[0])) || s[0] == '_' || s[0] == '.');
+    }
+
+    // смещение перехода: число или метка, которая разрешится при склейке
+    static int32_t parse_target(string_view s, AsmChunk &out, int32_t lo, int32_t hi) {
+        if (!isSymbol(s)) {
+            return checkImm(s, parse_imm(s), lo, hi, 2);
         }
-        I_Type i = {rd, f3, rs1, imm};
-        return Instruction(command, OPC_19, i);
+        out.fixups.push_back({s, SEC_TEXT, out.text.size(), out.line});
+        return 0;
     }
 
-    static Instruction makeBRANCH(string command, deque<string> details) {
+    static Instruction makeBRANCH(string_view command, const string_view *details, size_t argc, AsmChunk &out,
+                                  Funct3 f3) {
+        expectArgs(command, argc, 3);
         uint8_t rs1 = static_cast<uint8_t>(get_register(details[0]));
         uint8_t rs2 = static_cast<uint8_t>(get_register(details[1]));
-        int32_t imm = parse_imm(details[2]);
-        Funct3 f3;
-
-        if (command == "beq") {
-            f3 = F0;
-        }
-        if (command == "bne") {
-            f3 = F1;
-        }
-        if (command == "blt") {
-            f3 = F4;
-        }
-        if (command == "bge") {
-            f3 = F5;
-        }
-        if (command == "bltu") {
-            f3 = F6;
-        }
-        if (command == "bgeu") {
-            f3 = F7;
-        }
+        int32_t imm = parse_target(details[2], out, -4096, 4094);
         B_Type b = {f3, rs1, rs2, imm};
-        return Instruction(command, OPC_99, b);
+        return Instruction(string(command), OPC_99, b);
     }
 
-    static Instruction makeLOAD(string command, deque<string> details) {
+    static Instruction makeLOAD(string_view command, const string_view *details, size_t argc, Funct3 f3) {
+        expectArgs(command, argc, 3);
         uint8_t rd = static_cast<uint8_t>(get_register(details[0]));
-        int32_t imm = parse_imm(details[1]);
+        int32_t imm = checkImm(details[1], parse_imm(details[1]), -2048, 2047);
         uint8_t rs1 = static_cast<uint8_t>(get_register(details[2]));
-        Funct3 f3;
-
-        if (command == "lb") {
-            f3 = F0;
-        }
-        if (command == "lh") {
-            f3 = F1;
-        }
-        if (command == "lw") {
-            f3 = F2;
-        }
-        if (command == "lbu") {
-            f3 = F4;
-        }
-        if (command == "lhu") {
-            f3 = F5;
-        }
         I_Type i = {rd, f3, rs1, imm};
-        return Instruction(command, OPC_3, i);
+        return Instruction(string(command), OPC_3, i);
     }
 
-    static Instruction makeSTORE(string command, deque<string> details) {
+    static Instruction makeSTORE(string_view command, const string_view *details, size_t argc, Funct3 f3) {
+        expectArgs(command, argc, 3);
         uint8_t rs2 = static_cast<uint8_t>(get_register(details[0]));
-        int32_t imm = parse_imm(details[1]);
+        int32_t imm = checkImm(details[1], parse_imm(details[1]), -2048, 2047);
         uint8_t rs1 = static_cast<uint8_t>(get_register(details[2]));
-        Funct3 f3;
-
-        if (command == "sb") {
-            f3 = F0;
-        }
-        if (command == "sh") {
-            f3 = F1;
-        }
-        if (command == "sw") {
-            f3 = F2;
-        }
         S_Type s{f3, rs1, rs2, imm};
-        return Instruction(command, OPC_35, s);
+        return Instruction(string(command), OPC_35, s);
     }
 
-    static Instruction makeLUI(string command, deque<string> details) {
+    static Instruction makeLUI(string_view command, const string_view *details, size_t argc) {
+        expectArgs(command, argc, 2);
         uint8_t rd = static_cast<uint8_t>(get_register(details[0]));
-        int32_t imm = parse_imm(details[1]);
+        int32_t imm = checkImm(details[1], parse_imm(details[1]), -(1 << 19), (1 << 20) - 1);
         U_Type u = {rd, imm};
-        return Instruction(command, OPC_55, u);
+        return Instruction(string(command), OPC_55, u);
     }
 
-    static Instruction makeAUIPC(string command, deque<string> details) {
+    static Instruction makeAUIPC(string_view command, const string_view *details, size_t argc) {
+        expectArgs(command, argc, 2);
         uint8_t rd = static_cast<uint8_t>(get_register(details[0]));
-        int32_t imm = parse_imm(details[1]);
+        int32_t imm = checkImm(details[1], parse_imm(details[1]), -(1 << 19), (1 << 20) - 1);
         U_Type u = {rd, imm};
-        return Instruction(command, OPC_23, u);
+        return Instruction(string(command), OPC_23, u);
     }
 
-    static Instruction makeJAL(string command, deque<string> details) {
+    static Instruction makeJAL(string_view command, const string_view *details, size_t argc, AsmChunk &out) {
+        expectArgs(command, argc, 2);
         uint8_t rd = static_cast<uint8_t>(get_register(details[0]));
-        int32_t imm = parse_imm(details[1]);
+        int32_t imm = parse_target(details[1], out, -(1 << 20), (1 << 20) - 2);
         J_Type j = {rd, imm};
-        return Instruction(command, OPC_111, j);
+        return Instruction(string(command), OPC_111, j);
     }
 
-    static Instruction makeJALR(string command, deque<string> details) {
+    static Instruction makeJALR(string_view command, const string_view *details, size_t argc) {
+        expectArgs(command, argc, 3);
         uint8_t rd = static_cast<uint8_t>(get_register(details[0]));
         uint8_t rs1 = static_cast<uint8_t>(get_register(details[1]));
-        int32_t imm = parse_imm(details[2]);
+        int32_t imm = checkImm(details[2], parse_imm(details[2]), -2048, 2047);
         I_Type it = {rd, F0, rs1, imm};
-        return Instruction(command, OPC_103, it);
+        return Instruction(string(command), OPC_103, it);
     }
 
-    static Instruction makeFENCE(string command, deque<string> details) {
+    static Instruction makeFENCE(string_view command, const string_view *details, size_t argc) {
+        expectArgs(command, argc, 2);
         uint8_t pred_val = makeArg(details[0]);
         uint8_t succ_val = makeArg(details[1]);
         Fence_Type ft{pred_val, succ_val};
-        return Instruction(command, OPC_15, ft);
+        return Instruction(string(command), OPC_15, ft);
+    }
+
+    // номер CSR: имя счётчика или число 0..4095
+    static int32_t parse_csr(string_view str) {
+        for (const auto &entry: csrNames) {
+            if (str == entry.first) {
+                return entry.second;
+            }
+        }
+        int32_t csr = parse_imm(str);
+        if (csr < 0 || csr > 0xFFF) {
+            throw invalid_argument("bad csr '" + string(str) + "'");
+        }
+        return csr;
     }
 
-    static Instruction makeSYSTEM(string command) {
-        System_Type sys_type(command);
-        return Instruction(command, OPC_15, sys_type);
+    // csrrw rd, csr, rs1 и формы с непосредственным uimm (0..31) на месте rs1; номер CSR — в imm
+    static Instruction makeCSR(string_view command, const string_view *details, size_t argc, Funct3 f3) {
+        expectArgs(command, argc, 3);
+        uint8_t rd = static_cast<uint8_t>(get_register(details[0]));
+        int32_t csr = parse_csr(details[1]);
+        uint8_t rs1;
+        if (f3 & 4) {
+            int32_t uimm = parse_imm(details[2]);
+            if (uimm < 0 || uimm > 31) {
+                throw invalid_argument("csr immediate out of range '" + string(details[2]) + "'");
+            }
+            rs1 = static_cast<uint8_t>(uimm);
+        } else {
+            rs1 = static_cast<uint8_t>(get_register(details[2]));
+        }
+        I_Type i = {rd, f3, rs1, csr};
+        return Instruction(string(command), OPC_115, i);
     }
 
-    deque<Instruction> parse() {
-        ifstream in(filename);
-        string str;
-        deque<Instruction> instructions;
-        while (getline(in, str)) {
-            if (str.size() == 0) {
+    static Instruction makeSYSTEM(string_view command) {
+        System_Type sys_type{string(command)};
+        return Instruction(string(command), OPC_15, sys_type);
+    }
+
+    // делит строку на лексемы по пробелам, запятым и скобкам (так работает и `lw rd, imm(rs1)`);
+    // всё после '#' — комментарий. Лексемы указывают прямо в буфер файла
+    static size_t tokenize(string_view line, string_view *tokens) {
+        size_t count = 0;
+        size_t i = 0;
+        while (i < line.size()) {
+            char c = line[i];
+            if (c == '#') {
+                break;
+            }
+            if (c == ' ' || c == ',' || c == '\t' || c == '\r' || c == '(' || c == ')') {
+                i++;
                 continue;
             }
-            deque<string> arguments;
-            string command;
-            for (char c: str) {
-                if (c == ' ' || c == ',') {
-                    if (!command.empty()) {
-                        arguments.push_back(trim(command));
-                        command.clear();
-                    }
-                } else {
-                    command.push_back(c);
-                }
+            size_t start = i;
+            while (i < line.size() && line[i] != ' ' && line[i] != ',' && line[i] != '\t' && line[i] != '\r' &&
+                   line[i] != '(' && line[i] != ')' && line[i] != '#') {
+                i++;
             }
-            if (!command.empty()) {
-                arguments.push_back(trim(command));
+            if (count == MAX_TOKENS) {
+                throw invalid_argument("too many operands");
             }
-            command = arguments[0];
-            arguments.pop_front();
-            instructions.push_back(makeInstruction(command, arguments));
+            tokens[count++] = line.substr(start, i - start);
         }
-        return instructions;
+        return count;
     }
-};
-
-
-struct CPU {
-    uint32_t progCount = 0;
-    deque<uint32_t> registers;
 
-
-    explicit CPU() {
-        registers.resize(32);
-        fill(registers.begin(), registers.end(), 0);
+    static void putData(AsmChunk &out, int64_t value, int64_t lo, int64_t hi, size_t bytes, string_view str) {
+        if (value < lo || value > hi) {
+            throw invalid_argument("value '" + string(str) + "' does not fit " + to_string(bytes) + " bytes");
+        }
+        for (size_t i = 0; i < bytes; i++) {
+            out.data.push_back(static_cast<uint8_t>(static_cast<uint64_t>(value) >> (8 * i)));
+        }
     }
 
-
-    void runCommand(const Instruction &instr) {
-
-        Opcode opcode = instr.opcode;
-
-        auto type = instr.type;
-
-        switch (opcode) {
-            case OPC_3: {
-                I_Type i = get<I_Type>(type);
-                if (i.rd != 0) {
-                    registers[i.rd] = 0;
+    static void makeDirective(string_view directive, const string_view *details, size_t argc, AsmChunk &out) {
+        uint64_t key = packMnemonic(directive);
+        if (key == packMnemonic(".text") || key == packMnemonic(".data")) {
+            expectArgs(directive, argc, 0);
+            out.section = (key == packMnemonic(".text")) ? SEC_TEXT : SEC_DATA;
+            return;
+        }
+        if (out.section != SEC_DATA) {
+            throw invalid_argument(string(directive) + " outside .data");
+        }
+        switch (key) {
+            case packMnemonic(".word"):
+                for (size_t k = 0; k < argc; k++) {
+                    if (isSymbol(details[k])) {
+                        out.fixups.push_back({details[k], SEC_DATA, out.data.size(), out.line});
+                        out.data.insert(out.data.end(), 4, 0);
+                    } else {
+                        putData(out, static_cast<uint32_t>(parse_imm(details[k])), 0, 0xFFFFFFFFLL, 4, details[k]);
+                    }
+                }
+                break;
+            case packMnemonic(".half"):
+                for (size_t k = 0; k < argc; k++) {
+                    putData(out, parse_imm(details[k]), -0x8000, 0xFFFF, 2, details[k]);
+                }
+                break;
+            case packMnemonic(".byte"):
+                for (size_t k = 0; k < argc; k++) {
+                    putData(out, parse_imm(details[k]), -0x80, 0xFF, 1, details[k]);
+                }
+                break;
+            case packMnemonic(".space"): {
+                expectArgs(directive, argc, 1);
+                int64_t bytes = parse_number(details[0], 10, "size");
+                if (bytes < 0) {
+                    throw invalid_argument("bad size '" + string(details[0]) + "'");
                 }
-                progCount = static_cast<int32_t>(static_cast<int32_t>(progCount) + 4);
+                out.data.insert(out.data.end(), static_cast<size_t>(bytes), 0);
                 break;
             }
+            default:
+                throw invalid_argument("unknown directive '" + string(directive) + "'");
+        }
+    }
 
-            case OPC_19: {
-                I_Type i = get<I_Type>(type);
-                int32_t rs1_value = static_cast<int32_t>(registers[i.rs1]);
-
-                switch (i.funct3) {
-                    case F0: // ADDI
-                    {
-                        if (i.rd != 0) {
-                            registers[i.rd] = static_cast<uint32_t>(rs1_value + i.imm);
-                        }
-                        break;
-                    }
+    static invalid_argument located(const string &name, size_t line, const string &msg) {
+        return invalid_argument(name + ":" + to_string(line) + ": " + msg);
+    }
 
-                    case F2: // SLTI
-                    {
-                        if (i.rd != 0) {
-                            registers[i.rd] = (rs1_value < i.imm) ? 1U : 0U;
-                        }
-                        break;
+    // строка: [метка:]... [инструкция | директива]
+    static void parseBuffer(string_view text, const string &name, size_t firstLine, AsmChunk &out) {
+        string_view tokens[MAX_TOKENS];
+        out.line = firstLine;
+        size_t pos = 0;
+        while (pos < text.size()) {
+            size_t end = text.find('\n', pos);
+            if (end == string_view::npos) {
+                end = text.size();
+            }
+            string_view line = text.substr(pos, end - pos);
+            pos = end + 1;
+            out.line++;
+            try {
+                size_t count = tokenize(line, tokens);
+                size_t first = 0;
+                while (first < count && tokens[first].size() > 1 && tokens[first].back() == ':') {
+                    string_view label = tokens[first].substr(0, tokens[first].size() - 1);
+                    if (!isSymbol(label)) {
+                        throw invalid_argument("bad label '" + string(label) + "'");
                     }
-
-                    case F3: // SLTIU
-                    {
-                        if (i.rd != 0) {
-                            registers[i.rd] =
-                                    (static_cast<uint32_t>(registers[i.rs1]) < static_cast<uint32_t>(i.imm)) ? 1U : 0U;
-                        }
-                        break;
+                    size_t offset = (out.section == SEC_TEXT) ? out.text.size() : out.data.size();
+                    out.labels.push_back({label, out.section, offset, out.line});
+                    first++;
+                }
+                if (first == count) {
+                    continue;
+                }
+                if (tokens[first][0] == '.') {
+                    makeDirective(tokens[first], tokens + first + 1, count - first - 1, out);
+                } else if (out.section != SEC_TEXT) {
+                    throw invalid_argument("instruction '" + string(tokens[first]) + "' outside .text");
+                } else {
+                    size_t before = out.text.size();
+                    if (!makeConstant(tokens[first], tokens + first + 1, count - first - 1, out)) {
+                        out.text.push_back(makeInstruction(tokens[first], tokens + first + 1, count - first - 1, out));
                     }
-
-                    case F4: // XORI
-                    {
-                        if (i.rd != 0) {
-                            registers[i.rd] = registers[i.rs1] ^ static_cast<uint32_t>(i.imm);
-                        }
-                        break;
+                    // псевдоинструкция может развернуться в несколько, все получают её строку
+                    for (size_t k = before; k < out.text.size(); k++) {
+                        out.text[k].line = out.line;
                     }
+                }
+            } catch (const invalid_argument &e) {
+                throw located(name, out.line, e.what());
+            }
+        }
+    }
 
-                    case F6: // ORI
-                    {
-                        if (i.rd != 0) {
-                            registers[i.rd] = registers[i.rs1] | static_cast<uint32_t>(i.imm);
-                        }
-                        break;
-                    }
+    // секция, действующая в конце куска; кусок без .text/.data её не меняет
+    static Section sectionAfter(string_view text, Section section) {
+        if (text.find(".text") == string_view::npos && text.find(".data") == string_view::npos) {
+            return section;
+        }
+        string_view tokens[MAX_TOKENS];
+        size_t pos = 0;
+        while (pos < text.size()) {
+            size_t end = text.find('\n', pos);
+            if (end == string_view::npos) {
+                end = text.size();
+            }
+            size_t count = 0;
+            try {
+                count = tokenize(text.substr(pos, end - pos), tokens);
+            } catch (const invalid_argument &) {
+                // ошибку с номером строки сообщит разбор
+            }
+            pos = end + 1;
+            size_t first = 0;
+            while (first < count && tokens[first].back() == ':') {
+                first++;
+            }
+            if (first < count && tokens[first] == ".text") {
+                section = SEC_TEXT;
+            } else if (first < count && tokens[first] == ".data") {
+                section = SEC_DATA;
+            }
+        }
+        return section;
+    }
 
-                    case F7: // ANDI
-                    {
-                        if (i.rd != 0) {
-                            registers[i.rd] = registers[i.rs1] & static_cast<uint32_t>(i.imm);
-                        }
-                        break;
-                    }
+    // второй проход: адреса меток по всем кускам, затем переходы и .word
+    static Assembly link(vector<AsmChunk> &chunks, const string &name) {
+        size_t labelCount = 0;
+        for (const AsmChunk &chunk: chunks) {
+            labelCount += chunk.labels.size();
+        }
+        unordered_map<string_view, uint32_t> symbols;
+        symbols.reserve(labelCount);
 
-                    case F1: // SLLI
-                    {
-                        uint32_t shift = static_cast<uint32_t>((i.imm & 31));
-                        uint32_t funct7 = static_cast<uint32_t>(((i.imm >> 5) & 127));
+        vector<size_t> textBase(chunks.size());
+        vector<size_t> dataBase(chunks.size());
+        size_t textSize = 0;
+        size_t dataSize = 0;
+        for (size_t k = 0; k < chunks.size(); k++) {
+            textBase[k] = textSize;
+            dataBase[k] = dataSize;
+            textSize += chunks[k].text.size();
+            dataSize += chunks[k].data.size();
+            for (const SymbolRef &label: chunks[k].labels) {
+                uint32_t addr = (label.section == SEC_TEXT)
+                                        ? TEXT_BASE + static_cast<uint32_t>(4 * (textBase[k] + label.offset))
+                                        : DATA_BASE + static_cast<uint32_t>(dataBase[k] + label.offset);
+                if (!symbols.emplace(label.name, addr).second) {
+                    throw located(name, label.line, "duplicate label '" + string(label.name) + "'");
+                }
+            }
+        }
+        if (dataSize > 0xFFFFFFFFULL - DATA_BASE) {
+            throw invalid_argument(".data does not fit the address space");
+        }
 
-                        if (funct7 == 0) {
-                            if (i.rd != 0) {
-                                registers[i.rd] = registers[i.rs1] << shift;
-                            }
-                        }
-                        break;
+        Assembly program;
+        program.data.reserve(dataSize);
+        for (size_t k = 0; k < chunks.size(); k++) {
+            AsmChunk &chunk = chunks[k];
+            for (const SymbolRef &ref: chunk.fixups) {
+                auto it = symbols.find(ref.name);
+                if (it == symbols.end()) {
+                    throw located(name, ref.line, "undefined symbol '" + string(ref.name) + "'");
+                }
+                bool absolute = (ref.section == SEC_DATA || chunk.text[ref.offset].opcode == OPC_55 ||
+                                 chunk.text[ref.offset].opcode == OPC_19);
+                if (absolute && it->second - TEXT_BASE <= 4 * textSize) {
+                    program.textAddressTaken = true;
+                }
+                if (ref.section == SEC_DATA) {
+                    for (size_t i = 0; i < 4; i++) {
+                        chunk.data[ref.offset + i] = static_cast<uint8_t>(it->second >> (8 * i));
                     }
-
-                    case F5: {
-                        uint32_t shift = static_cast<uint32_t>((i.imm & 31));
-                        uint32_t funct7 = static_cast<uint32_t>(((i.imm >> 5) & 127));
-
-                        if (funct7 == 0) {
-                            // SRLI
-                            if (i.rd != 0) {
-                                registers[i.rd] = registers[i.rs1] >> shift;
-                            }
-                        } else if (funct7 == 32) {
-                            // SRAI
-                            if (i.rd != 0) {
-                                int32_t val = static_cast<int32_t>(registers[i.rs1]);
-                                registers[i.rd] = static_cast<uint32_t>((val >> static_cast<int32_t>(shift)));
-                            }
-                        }
+                    continue;
+                }
+                Instruction &instr = chunk.text[ref.offset];
+                uint32_t pc = TEXT_BASE + static_cast<uint32_t>(4 * (textBase[k] + ref.offset));
+                int32_t offset = static_cast<int32_t>(it->second - pc);
+                if ((instr.opcode == OPC_99 && (offset < -4096 || offset > 4094)) ||
+                    (instr.opcode == OPC_111 && (offset < -(1 << 20) || offset > (1 << 20) - 2))) {
+                    throw located(name, ref.line, "target '" + string(ref.name) + "' out of range");
+                }
+                switch (instr.opcode) {
+                    case OPC_99:
+                        get<B_Type>(instr.type).imm = offset;
+                        break;
+                    case OPC_111:
+                        get<J_Type>(instr.type).imm = offset;
+                        break;
+                    case OPC_55: // la: старшие 20 бит абсолютного адреса
+                        get<U_Type>(instr.type).imm = hi20(it->second);
+                        break;
+                    default: // la: младшие 12 бит
+                        get<I_Type>(instr.type).imm = lo12(it->second);
                         break;
-                    }
                 }
-                progCount = static_cast<int32_t>(static_cast<int32_t>(progCount) + 4);
-                break;
             }
+            if (k == 0) {
+                program.text = move(chunk.text);
+            } else {
+                move(chunk.text.begin(), chunk.text.end(), back_inserter(program.text));
+            }
+            program.data.insert(program.data.end(), chunk.data.begin(), chunk.data.end());
+            chunk = AsmChunk();
+        }
+        return program;
+    }
 
-            case OPC_23: // AUIPC
-            {
-                U_Type u = get<U_Type>(type);
-                int32_t pc_signed = static_cast<int32_t>(progCount);
+    // большие файлы режутся на куски по границам строк, куски разбираются пулом потоков;
+    // метки разрешаются уже после склейки в link
+    static vector<AsmChunk> parseParallel(string_view text, const string &name, unsigned jobs) {
+        size_t chunkCount = static_cast<size_t>(jobs) * 4;
+        vector<string_view> pieces;
+        size_t pos = 0;
+        for (size_t k = 0; k < chunkCount && pos < text.size(); k++) {
+            size_t end = (k + 1 == chunkCount) ? text.size() : max(pos, text.size() * (k + 1) / chunkCount);
+            end = text.find('\n', end);
+            end = (end == string_view::npos) ? text.size() : end + 1;
+            pieces.push_back(text.substr(pos, end - pos));
+            pos = end;
+        }
 
-                if (u.rd != 0) {
-                    registers[u.rd] = static_cast<uint32_t>(pc_signed + (u.imm << 12));
+        vector<size_t> firstLine(pieces.size(), 0);
+        vector<Section> lastSection(pieces.size(), SEC_TEXT);
+        vector<uint8_t> hasSection(pieces.size(), 0);
+        vector<AsmChunk> chunks(pieces.size());
+        vector<exception_ptr> errors(pieces.size());
+        atomic<size_t> next{0};
+        auto worker = [&](bool countLines) {
+            for (size_t k = next++; k < pieces.size(); k = next++) {
+                try {
+                    if (countLines) {
+                        firstLine[k] = static_cast<size_t>(count(pieces[k].begin(), pieces[k].end(), '\n'));
+                        // SEC_TEXT и SEC_DATA дают разный ответ, только если в куске есть директива секции
+                        lastSection[k] = sectionAfter(pieces[k], SEC_DATA);
+                        hasSection[k] = (sectionAfter(pieces[k], SEC_TEXT) == lastSection[k]);
+                    } else {
+                        parseBuffer(pieces[k], name, firstLine[k], chunks[k]);
+                    }
+                } catch (...) {
+                    errors[k] = current_exception();
                 }
-                progCount = static_cast<int32_t>(static_cast<int32_t>(progCount) + 4);
-                break;
             }
-            case OPC_35: {
-                progCount = static_cast<int32_t>(static_cast<int32_t>(progCount) + 4);
-            }
-            case OPC_51: {
-                R_Type r = get<R_Type>(type);
-                int32_t srs1 = static_cast<int32_t>(registers[r.rs1]);
-                int32_t srs2 = static_cast<int32_t>(registers[r.rs2]);
-
-                switch (r.funct3) {
-                    case F0: {
-                        switch (r.funct7) {
-                            case F0_7: // ADD
-                            {
-                                if (r.rd != 0) {
-                                    registers[r.rd] = static_cast<uint32_t>(srs1 + srs2);
-                                }
-                                break;
-                            }
-
-                            case F32_7: // SUB
-                            {
-                                if (r.rd != 0) {
-                                    registers[r.rd] = static_cast<uint32_t>(srs1 - srs2);
-                                }
-                                break;
-                            }
-
-                            case F1_7: // MUL
-                            {
-                                if (r.rd != 0) {
-                                    int64_t prod = static_cast<int64_t>(srs1) * static_cast<int64_t>(srs2);
-                                    registers[r.rd] = static_cast<uint32_t>(prod);
-                                }
-                                break;
-                            }
-                        }
-
-                        break;
+        };
+        // первый проход считает строки и секции в кусках: ошибки получают абсолютный номер строки,
+        // а каждый кусок начинается в той секции, где закончился предыдущий
+        for (bool countLines: {true, false}) {
+            next = 0;
+            vector<thread> pool;
+            for (unsigned t = 1; t < jobs; t++) {
+                pool.emplace_back(worker, countLines);
+            }
+            worker(countLines);
+            for (thread &t: pool) {
+                t.join();
+            }
+            if (countLines) {
+                size_t lines = 0;
+                Section section = SEC_TEXT;
+                for (size_t k = 0; k < pieces.size(); k++) {
+                    size_t inChunk = firstLine[k];
+                    firstLine[k] = lines;
+                    lines += inChunk;
+                    chunks[k].section = section;
+                    if (hasSection[k]) {
+                        section = lastSection[k];
                     }
-
-                    case F1:
-                        switch (r.funct7) {
-                            case F0_7: // SLL
-                            {
-                                if (r.rd != 0) {
-                                    uint32_t shift = registers[r.rs2] & 31;
-                                    registers[r.rd] = registers[r.rs1] << shift;
-                                }
-                                break;
+                }
+            }
+        }
+        for (const exception_ptr &e: errors) {
+            if (e) {
+                rethrow_exception(e);
+            }
+        }
+        return chunks;
+    }
+
+    Assembly parse() {
+        MappedFile file(filename);
+        string_view text(reinterpret_cast<const char *>(file.data), file.size);
+        unsigned jobs = (parseJobs != 0) ? parseJobs : max(1U, thread::hardware_concurrency());
+        vector<AsmChunk> chunks;
+        if (jobs > 1 && text.size() >= PARALLEL_PARSE_BYTES) {
+            chunks = parseParallel(text, filename, jobs);
+        } else {
+            chunks.resize(1);
+            parseBuffer(text, filename, 0, chunks[0]);
+        }
+        return link(chunks, filename);
+    }
+};
+
+
+// необязательный проход по собранной программе: убирает инструкции без эффекта
+// и склеивает цепочки addi, смещения переходов пересчитываются под новую раскладку
+struct PeepholeStats {
+    bool applied = false;
+    string skipped; // почему проход не выполнялся
+    uint64_t zeroWrites = 0;
+    uint64_t moves = 0;
+    uint64_t folded = 0;
+};
+
+struct Peephole {
+    static bool isAddi(const Instruction &instr) {
+        return instr.opcode == OPC_19 && get<I_Type>(instr.type).funct3 == F0;
+    }
+
+    // результат пишется в x0 и кроме этого ничего не происходит
+    static bool writesZeroOnly(const Instruction &instr) {
+        switch (instr.opcode) {
+            case OPC_51:
+                return get<R_Type>(instr.type).rd == 0;
+            case OPC_19:
+                return get<I_Type>(instr.type).rd == 0;
+            case OPC_23:
+            case OPC_55:
+                return get<U_Type>(instr.type).rd == 0;
+            default:
+                return holds_alternative<System_Type>(instr.type) && get<System_Type>(instr.type).sys_call == "nop";
+        }
+    }
+
+    // rd = rd op 0 для операций, у которых 0 — нейтральный элемент
+    static bool isIdentityMove(const Instruction &instr) {
+        if (instr.opcode == OPC_19) {
+            const I_Type &i = get<I_Type>(instr.type);
+            bool neutral = (i.funct3 == F5) ? (i.imm & ~1024) == 0
+                                            : (i.funct3 == F0 || i.funct3 == F1 || i.funct3 == F4 || i.funct3 == F6) &&
+                                                      i.imm == 0;
+            return neutral && i.rd == i.rs1;
+        }
+        if (instr.opcode == OPC_51) {
+            const R_Type &r = get<R_Type>(instr.type);
+            bool neutral = (r.funct7 == F0_7 && r.funct3 != F2 && r.funct3 != F3 && r.funct3 != F7) ||
+                           (r.funct7 == F32_7 && (r.funct3 == F0 || r.funct3 == F5));
+            return neutral && r.rs2 == 0 && r.rd == r.rs1;
+        }
+        return false;
+    }
+
+    // индекс цели перехода или -1, если цель не попадает на инструкцию программы
+    static int64_t targetOf(const Instruction &instr, size_t index, size_t count) {
+        int32_t imm = (instr.opcode == OPC_99) ? get<B_Type>(instr.type).imm : get<J_Type>(instr.type).imm;
+        int64_t target = static_cast<int64_t>(index) + imm / 4;
+        return (imm % 4 != 0 || target < 0 || target > static_cast<int64_t>(count)) ? -1 : target;
+    }
+
+    // адреса кода, вычисленные в регистрах, после сдвига инструкций стали бы неверны, поэтому при
+    // auipc, jalr не через ra и взятых адресах меток .text программа остаётся как есть
+    static string reasonToSkip(const Assembly &program) {
+        if (program.textAddressTaken) {
+            return "address of a .text label is taken";
+        }
+        size_t count = program.text.size();
+        for (size_t i = 0; i < count; i++) {
+            const Instruction &instr = program.text[i];
+            if (instr.opcode == OPC_23) {
+                return "auipc at pc " + to_string(TEXT_BASE + 4 * i);
+            }
+            if (instr.opcode == OPC_103 && get<I_Type>(instr.type).rs1 != 1) {
+                return "computed jalr at pc " + to_string(TEXT_BASE + 4 * i);
+            }
+            if ((instr.opcode == OPC_99 || instr.opcode == OPC_111) && targetOf(instr, i, count) < 0) {
+                return "jump outside the program at pc " + to_string(TEXT_BASE + 4 * i);
+            }
+        }
+        return "";
+    }
+
+    static PeepholeStats run(Assembly &program) {
+        PeepholeStats stats;
+        stats.skipped = reasonToSkip(program);
+        if (!stats.skipped.empty()) {
+            return stats;
+        }
+        deque<Instruction> &text = program.text;
+        size_t count = text.size();
+        vector<uint8_t> isTarget(count + 1, 0);
+        for (size_t i = 0; i < count; i++) {
+            if (text[i].opcode == OPC_99 || text[i].opcode == OPC_111) {
+                isTarget[static_cast<size_t>(targetOf(text[i], i, count))] = 1;
+            }
+        }
+
+        // newIndex[i] — куда попадает старая инструкция i; для удалённой — следующая оставшаяся
+        vector<size_t> newIndex(count + 1, 0);
+        vector<int64_t> oldTarget(count, -1);
+        deque<Instruction> kept;
+        bool canFold = false; // последняя оставшаяся инструкция — addi, к которой можно прибавить следующую
+        for (size_t i = 0; i < count; i++) {
+            newIndex[i] = kept.size();
+            Instruction &instr = text[i];
+            if (isTarget[i]) {
+                canFold = false;
+            }
+            if (writesZeroOnly(instr)) {
+                stats.zeroWrites++;
+                continue;
+            }
+            if (isIdentityMove(instr)) {
+                stats.moves++;
+                continue;
+            }
+            if (canFold && isAddi(instr)) {
+                I_Type &prev = get<I_Type>(kept.back().type);
+                const I_Type &cur = get<I_Type>(instr.type);
+                int64_t sum = static_cast<int64_t>(prev.imm) + cur.imm;
+                if (cur.rs1 == cur.rd && cur.rd == prev.rd && sum >= -2048 && sum <= 2047) {
+                    prev.imm = static_cast<int32_t>(sum);
+                    stats.folded++;
+                    continue;
+                }
+            }
+            if (instr.opcode == OPC_99 || instr.opcode == OPC_111) {
+                oldTarget[kept.size()] = targetOf(instr, i, count);
+            }
+            canFold = isAddi(instr);
+            kept.push_back(move(instr));
+        }
+        newIndex[count] = kept.size();
+
+        for (size_t k = 0; k < kept.size(); k++) {
+            if (oldTarget[k] < 0) {
+                continue;
+            }
+            int32_t offset = static_cast<int32_t>(4 * (static_cast<int64_t>(newIndex[oldTarget[k]]) - k));
+            if (kept[k].opcode == OPC_99) {
+                get<B_Type>(kept[k].type).imm = offset;
+            } else {
+                get<J_Type>(kept[k].type).imm = offset;
+            }
+        }
+        text = move(kept);
+        stats.applied = true;
+        return stats;
+    }
+};
+
+void printPeepholeStats(const PeepholeStats &stats) {
+    if (!stats.applied) {
+        cerr << "peephole: skipped (" << stats.skipped << ")" << endl;
+        return;
+    }
+    cerr << "peephole: removed " << stats.zeroWrites + stats.moves + stats.folded << " instructions (" << stats.zeroWrites
+         << " writes to x0, " << stats.moves << " moves, " << stats.folded << " folded addi)" << endl;
+}
+
+
+// машинные коды RV32: кодирование разобранной программы и запись образов
+
+struct Encoder {
+    static void checkRange(const Instruction &instr, int64_t imm, int64_t lo, int64_t hi, int64_t align = 1) {
+        if (imm < lo || imm > hi || imm % align != 0) {
+            throw invalid_argument("immediate " + to_string(imm) + " does not fit " + instr.name);
+        }
+    }
+
+    static uint32_t encodeR(const R_Type &r, Opcode opcode) {
+        return (static_cast<uint32_t>(r.funct7) << 25) | (static_cast<uint32_t>(r.rs2) << 20) |
+               (static_cast<uint32_t>(r.rs1) << 15) | (static_cast<uint32_t>(r.funct3) << 12) |
+               (static_cast<uint32_t>(r.rd) << 7) | opcode;
+    }
+
+    static uint32_t encodeI(const I_Type &i, Opcode opcode) {
+        return ((static_cast<uint32_t>(i.imm) & 0xFFF) << 20) | (static_cast<uint32_t>(i.rs1) << 15) |
+               (static_cast<uint32_t>(i.funct3) << 12) | (static_cast<uint32_t>(i.rd) << 7) | opcode;
+    }
+
+    static uint32_t encodeS(const S_Type &s, Opcode opcode) {
+        uint32_t imm = static_cast<uint32_t>(s.imm);
+        return (((imm >> 5) & 0x7F) << 25) | (static_cast<uint32_t>(s.rs2) << 20) |
+               (static_cast<uint32_t>(s.rs1) << 15) | (static_cast<uint32_t>(s.funct3) << 12) | ((imm & 0x1F) << 7) |
+               opcode;
+    }
+
+    static uint32_t encodeB(const B_Type &b, Opcode opcode) {
+        uint32_t imm = static_cast<uint32_t>(b.imm);
+        return (((imm >> 12) & 1) << 31) | (((imm >> 5) & 0x3F) << 25) | (static_cast<uint32_t>(b.rs2) << 20) |
+               (static_cast<uint32_t>(b.rs1) << 15) | (static_cast<uint32_t>(b.funct3) << 12) |
+               (((imm >> 1) & 0xF) << 8) | (((imm >> 11) & 1) << 7) | opcode;
+    }
+
+    static uint32_t encodeU(const U_Type &u, Opcode opcode) {
+        return ((static_cast<uint32_t>(u.imm) & 0xFFFFF) << 12) | (static_cast<uint32_t>(u.rd) << 7) | opcode;
+    }
+
+    static uint32_t encodeJ(const J_Type &j, Opcode opcode) {
+        uint32_t imm = static_cast<uint32_t>(j.imm);
+        return (((imm >> 20) & 1) << 31) | (((imm >> 1) & 0x3FF) << 21) | (((imm >> 11) & 1) << 20) |
+               (((imm >> 12) & 0xFF) << 12) | (static_cast<uint32_t>(j.rd) << 7) | opcode;
+    }
+
+    static uint32_t encodeSystem(const Instruction &instr, const System_Type &s) {
+        if (s.sys_call == "ecall") {
+            return 0x00000073;
+        }
+        if (s.sys_call == "ebreak") {
+            return 0x00100073;
+        }
+        if (s.sys_call == "pause") {
+            return 0x0100000F;
+        }
+        if (s.sys_call == "fence.tso") {
+            return 0x8330000F;
+        }
+        if (s.sys_call == "nop") {
+            return 0x00000013; // addi x0, x0, 0
+        }
+        throw invalid_argument("cannot encode " + instr.name);
+    }
+
+    static uint32_t encode(const Instruction &instr) {
+        switch (instr.opcode) {
+            case OPC_47:
+            case OPC_51:
+                return encodeR(get<R_Type>(instr.type), instr.opcode);
+            case OPC_3:
+            case OPC_19:
+            case OPC_103: {
+                const I_Type &i = get<I_Type>(instr.type);
+                if (instr.opcode == OPC_19 && (i.funct3 == F1 || i.funct3 == F5)) {
+                    // сдвиг: shamt 0..31, у srai funct7 уже сидит в imm (imm + 1024)
+                    int32_t bias = (i.funct3 == F5) ? (i.imm & 1024) : 0;
+                    checkRange(instr, i.imm - bias, 0, 31);
+                } else {
+                    checkRange(instr, i.imm, -2048, 2047);
+                }
+                return encodeI(i, instr.opcode);
+            }
+            case OPC_35: {
+                const S_Type &s = get<S_Type>(instr.type);
+                checkRange(instr, s.imm, -2048, 2047);
+                return encodeS(s, instr.opcode);
+            }
+            case OPC_99: {
+                const B_Type &b = get<B_Type>(instr.type);
+                checkRange(instr, b.imm, -4096, 4094, 2);
+                return encodeB(b, instr.opcode);
+            }
+            case OPC_23:
+            case OPC_55: {
+                const U_Type &u = get<U_Type>(instr.type);
+                checkRange(instr, u.imm, -(1 << 19), (1 << 20) - 1);
+                return encodeU(u, instr.opcode);
+            }
+            case OPC_111: {
+                const J_Type &j = get<J_Type>(instr.type);
+                checkRange(instr, j.imm, -(1 << 20), (1 << 20) - 2, 2);
+                return encodeJ(j, instr.opcode);
+            }
+            case OPC_115: {
+                const I_Type &i = get<I_Type>(instr.type);
+                checkRange(instr, i.imm, 0, 4095);
+                return encodeI(i, instr.opcode);
+            }
+            default:
+                if (holds_alternative<Fence_Type>(instr.type)) {
+                    const Fence_Type &f = get<Fence_Type>(instr.type);
+                    return (static_cast<uint32_t>(f.pred & 0xF) << 24) | (static_cast<uint32_t>(f.succ & 0xF) << 20) |
+                           OPC_15;
+                }
+                return encodeSystem(instr, get<System_Type>(instr.type));
+        }
+    }
+
+    static vector<uint32_t> encode(const deque<Instruction> &instructions) {
+        vector<uint32_t> words;
+        words.reserve(instructions.size());
+        for (const Instruction &instr: instructions) {
+            words.push_back(encode(instr));
+        }
+        return words;
+    }
+};
+
+void put16(vector<uint8_t> &out, uint16_t value) {
+    out.push_back(static_cast<uint8_t>(value));
+    out.push_back(static_cast<uint8_t>(value >> 8));
+}
+
+void put32(vector<uint8_t> &out, uint32_t value) {
+    put16(out, static_cast<uint16_t>(value));
+    put16(out, static_cast<uint16_t>(value >> 16));
+}
+
+void writeFile(const string &path, const vector<uint8_t> &bytes) {
+    ofstream out(path, ios::binary);
+    out.write(reinterpret_cast<const char *>(bytes.data()), static_cast<streamsize>(bytes.size()));
+    if (!out) {
+        throw runtime_error("cannot write " + path);
+    }
+}
+
+// плоский образ: слова инструкций подряд, little-endian, начиная с TEXT_BASE
+void writeFlatBinary(const string &path, const vector<uint32_t> &words) {
+    vector<uint8_t> bytes;
+    bytes.reserve(words.size() * 4);
+    for (uint32_t w: words) {
+        put32(bytes, w);
+    }
+    writeFile(path, bytes);
+}
+
+// минимальный ELF32: PT_LOAD с кодом, при наличии данных — второй PT_LOAD с .data,
+// и секции для objdump
+constexpr uint32_t ELF_TEXT_OFFSET = 0x1000;
+
+void writeElf32(const string &path, const vector<uint32_t> &words, const vector<uint8_t> &data = {}) {
+    const char shstrtab[] = "\0.text\0.shstrtab\0.data";
+    bool hasData = !data.empty();
+    uint32_t textSize = static_cast<uint32_t>(words.size() * 4);
+    uint32_t dataSize = static_cast<uint32_t>(data.size());
+    uint32_t dataOffset = (ELF_TEXT_OFFSET + textSize + 0xFFF) & ~0xFFFU;
+    uint32_t shstrtabOffset = hasData ? dataOffset + dataSize : ELF_TEXT_OFFSET + textSize;
+    uint32_t shoff = (shstrtabOffset + sizeof(shstrtab) + 3) & ~3U;
+
+    vector<uint8_t> out;
+    // e_ident: ELFCLASS32, ELFDATA2LSB, EV_CURRENT
+    out.insert(out.end(), {0x7F, 'E', 'L', 'F', 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0});
+    put16(out, 2);                   // e_type: ET_EXEC
+    put16(out, 243);                 // e_machine: EM_RISCV
+    put32(out, 1);                   // e_version
+    put32(out, TEXT_BASE);           // e_entry
+    put32(out, 52);                  // e_phoff
+    put32(out, shoff);               // e_shoff
+    put32(out, 0);                   // e_flags
+    put16(out, 52);                  // e_ehsize
+    put16(out, 32);                  // e_phentsize
+    put16(out, hasData ? 2 : 1);     // e_phnum
+    put16(out, 40);                  // e_shentsize
+    put16(out, hasData ? 4 : 3);     // e_shnum
+    put16(out, 2);                   // e_shstrndx
+
+    put32(out, 1);               // p_type: PT_LOAD
+    put32(out, ELF_TEXT_OFFSET); // p_offset
+    put32(out, TEXT_BASE);       // p_vaddr
+    put32(out, TEXT_BASE);       // p_paddr
+    put32(out, textSize);        // p_filesz
+    put32(out, textSize);        // p_memsz
+    put32(out, 5);               // p_flags: R + X
+    put32(out, 0x1000);          // p_align
+    if (hasData) {
+        for (uint32_t v: {1U, dataOffset, DATA_BASE, DATA_BASE, dataSize, dataSize, 6U, 0x1000U}) {
+            put32(out, v); // PT_LOAD, R + W
+        }
+    }
+
+    out.resize(ELF_TEXT_OFFSET, 0);
+    for (uint32_t w: words) {
+        put32(out, w);
+    }
+    if (hasData) {
+        out.resize(dataOffset, 0);
+        out.insert(out.end(), data.begin(), data.end());
+    }
+    out.insert(out.end(), shstrtab, shstrtab + sizeof(shstrtab));
+    out.resize(shoff, 0);
+
+    out.resize(out.size() + 40, 0); // SHT_NULL
+    // .text: SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR
+    for (uint32_t v: {1U, 1U, 6U, TEXT_BASE, ELF_TEXT_OFFSET, textSize, 0U, 0U, 4U, 0U}) {
+        put32(out, v);
+    }
+    // .shstrtab: SHT_STRTAB
+    for (uint32_t v: {7U, 3U, 0U, 0U, shstrtabOffset, static_cast<uint32_t>(sizeof(shstrtab)), 0U, 0U, 1U, 0U}) {
+        put32(out, v);
+    }
+    // .data: SHT_PROGBITS, SHF_WRITE | SHF_ALLOC
+    if (hasData) {
+        for (uint32_t v: {17U, 1U, 3U, DATA_BASE, dataOffset, dataSize, 0U, 0U, 1U, 0U}) {
+            put32(out, v);
+        }
+    }
+    writeFile(path, out);
+}
+
+
+enum Handler : uint8_t {
+    H_NOP,
+    H_LB,
+    H_LH,
+    H_LW,
+    H_LBU,
+    H_LHU,
+    H_SB,
+    H_SH,
+    H_SW,
+    H_ADDI,
+    H_SLTI,
+    H_SLTIU,
+    H_XORI,
+    H_ORI,
+    H_ANDI,
+    H_SLLI,
+    H_SRLI,
+    H_SRAI,
+    H_ADD,
+    H_SUB,
+    H_SLL,
+    H_SLT,
+    H_SLTU,
+    H_XOR,
+    H_SRL,
+    H_SRA,
+    H_OR,
+    H_AND,
+    H_MUL,
+    H_MULH,
+    H_MULHSU,
+    H_MULHU,
+    H_DIV,
+    H_DIVU,
+    H_REM,
+    H_REMU,
+    H_LUI,
+    H_AUIPC,
+    H_BEQ,
+    H_BNE,
+    H_BLT,
+    H_BGE,
+    H_BLTU,
+    H_BGEU,
+    H_JAL,
+    H_JALR,
+    H_LR_W,
+    H_SC_W,
+    H_AMOSWAP_W,
+    H_AMOADD_W,
+    H_AMOXOR_W,
+    H_AMOAND_W,
+    H_AMOOR_W,
+    H_AMOMIN_W,
+    H_AMOMAX_W,
+    H_AMOMINU_W,
+    H_AMOMAXU_W,
+    H_FENCE,
+    H_CSR,
+    H_COUNT
+};
+
+// имена обработчиков в порядке enum Handler: для таблиц задержек и отчётов
+constexpr const char *HANDLER_NAMES[] = {
+        "nop",      "lb",       "lh",        "lw",        "lbu",       "lhu",      "sb",       "sh",
+        "sw",       "addi",     "slti",      "sltiu",     "xori",      "ori",      "andi",     "slli",
+        "srli",     "srai",     "add",       "sub",       "sll",       "slt",      "sltu",     "xor",
+        "srl",      "sra",      "or",        "and",       "mul",       "mulh",     "mulhsu",   "mulhu",
+        "div",      "divu",     "rem",       "remu",      "lui",       "auipc",    "beq",      "bne",
+        "blt",      "bge",      "bltu",      "bgeu",      "jal",       "jalr",     "lr.w",     "sc.w",
+        "amoswap.w", "amoadd.w", "amoxor.w", "amoand.w", "amoor.w",  "amomin.w", "amomax.w", "amominu.w",
+        "amomaxu.w", "fence",    "csr"};
+static_assert(sizeof(HANDLER_NAMES) / sizeof(HANDLER_NAMES[0]) == H_COUNT, "HANDLER_NAMES out of sync with Handler");
+
+// компактная форма инструкции для исполнения: без variant и без строк
+struct DecodedInstruction {
+    Handler handler;
+    uint8_t rd;
+    uint8_t rs1;
+    uint8_t rs2;
+    int32_t imm;
+};
+
+struct Decoder {
+    static DecodedInstruction make(Handler handler, uint8_t rd, uint8_t rs1, uint8_t rs2, int32_t imm) {
+        DecodedInstruction d{handler, rd, rs1, rs2, imm};
+        return d;
+    }
+
+    static DecodedInstruction lowerOP(const R_Type &r) {
+        static const Handler base[8] = {H_ADD, H_SLL, H_SLT, H_SLTU, H_XOR, H_SRL, H_OR, H_AND};
+        static const Handler muldiv[8] = {H_MUL, H_MULH, H_MULHSU, H_MULHU, H_DIV, H_DIVU, H_REM, H_REMU};
+        Handler h = H_NOP;
+        if (r.funct7 == F0_7) {
+            h = base[r.funct3 & 7];
+        } else if (r.funct7 == F1_7) {
+            h = muldiv[r.funct3 & 7];
+        } else if (r.funct7 == F32_7) {
+            if (r.funct3 == F0) {
+                h = H_SUB;
+            } else if (r.funct3 == F5) {
+                h = H_SRA;
+            }
+        }
+        if (r.rd == 0) {
+            h = H_NOP;
+        }
+        return make(h, r.rd, r.rs1, r.rs2, 0);
+    }
+
+    static DecodedInstruction lowerOP_IMM(const I_Type &i) {
+        Handler h = H_NOP;
+        int32_t imm = i.imm;
+        uint32_t shift = static_cast<uint32_t>(i.imm & 31);
+        uint32_t funct7 = static_cast<uint32_t>((i.imm >> 5) & 127);
+        switch (i.funct3) {
+            case F0:
+                h = H_ADDI;
+                break;
+            case F2:
+                h = H_SLTI;
+                break;
+            case F3:
+                h = H_SLTIU;
+                break;
+            case F4:
+                h = H_XORI;
+                break;
+            case F6:
+                h = H_ORI;
+                break;
+            case F7:
+                h = H_ANDI;
+                break;
+            case F1:
+                h = (funct7 == 0) ? H_SLLI : H_NOP;
+                imm = static_cast<int32_t>(shift);
+                break;
+            case F5:
+                h = (funct7 == 0) ? H_SRLI : ((funct7 == 32) ? H_SRAI : H_NOP);
+                imm = static_cast<int32_t>(shift);
+                break;
+        }
+        if (i.rd == 0) {
+            h = H_NOP;
+        }
+        return make(h, i.rd, i.rs1, 0, imm);
+    }
+
+    static DecodedInstruction lowerLOAD(const I_Type &i) {
+        static const Handler loads[8] = {H_LB, H_LH, H_LW, H_NOP, H_LBU, H_LHU, H_NOP, H_NOP};
+        return make(loads[i.funct3 & 7], i.rd, i.rs1, 0, i.imm);
+    }
+
+    static DecodedInstruction lowerSTORE(const S_Type &s) {
+        static const Handler stores[8] = {H_SB, H_SH, H_SW, H_NOP, H_NOP, H_NOP, H_NOP, H_NOP};
+        return make(stores[s.funct3 & 7], 0, s.rs1, s.rs2, s.imm);
+    }
+
+    static DecodedInstruction lowerBRANCH(const B_Type &b) {
+        static const Handler branches[8] = {H_BEQ, H_BNE, H_NOP, H_NOP, H_BLT, H_BGE, H_BLTU, H_BGEU};
+        return make(branches[b.funct3 & 7], 0, b.rs1, b.rs2, b.imm);
+    }
+
+    static DecodedInstruction lowerU(const U_Type &u, Handler h) {
+        return make(u.rd == 0 ? H_NOP : h, u.rd, 0, 0, static_cast<int32_t>(static_cast<uint32_t>(u.imm) << 12));
+    }
+
+    static DecodedInstruction lowerJALR(const I_Type &i) { return make(H_JALR, i.rd, i.rs1, 0, i.imm); }
+
+    static DecodedInstruction lowerJAL(const J_Type &j) { return make(H_JAL, j.rd, 0, 0, j.imm); }
+
+    // биты aq/rl не различаются: все атомарные операции исполняются с seq_cst
+    static DecodedInstruction lowerAMO(const R_Type &r) {
+        Handler h = H_COUNT;
+        switch (r.funct7 >> 2) {
+            case 0b00010:
+                h = H_LR_W;
+                break;
+            case 0b00011:
+                h = H_SC_W;
+                break;
+            case 0b00001:
+                h = H_AMOSWAP_W;
+                break;
+            case 0b00000:
+                h = H_AMOADD_W;
+                break;
+            case 0b00100:
+                h = H_AMOXOR_W;
+                break;
+            case 0b01100:
+                h = H_AMOAND_W;
+                break;
+            case 0b01000:
+                h = H_AMOOR_W;
+                break;
+            case 0b10000:
+                h = H_AMOMIN_W;
+                break;
+            case 0b10100:
+                h = H_AMOMAX_W;
+                break;
+            case 0b11000:
+                h = H_AMOMINU_W;
+                break;
+            case 0b11100:
+                h = H_AMOMAXU_W;
+                break;
+        }
+        if (h == H_COUNT || r.funct3 != F2) {
+            throw invalid_argument("unsupported atomic operation");
+        }
+        return make(h, r.rd, r.rs1, r.rs2, 0);
+    }
+
+    // fence с пустыми pred или succ (pause) ничего не упорядочивает
+    static DecodedInstruction lowerFENCE(uint8_t pred, uint8_t succ) {
+        return make((pred != 0 && succ != 0) ? H_FENCE : H_NOP, 0, 0, 0, 0);
+    }
+
+    // все доступные CSR — счётчики только для чтения, поэтому запись отвергается уже при декодировании
+    // (illegal instruction), а исполняется одно чтение: rd = csr, номер CSR в imm
+    static DecodedInstruction lowerCSR(const I_Type &i) {
+        if (i.funct3 == F0 || i.funct3 == F4) {
+            throw invalid_argument("unsupported system instruction");
+        }
+        uint16_t csr = static_cast<uint16_t>(i.imm & 0xFFF);
+        bool known = false;
+        for (const auto &entry: csrNames) {
+            known = known || entry.second == csr;
+        }
+        ostringstream name;
+        name << "csr 0x" << hex << csr;
+        if (!known) {
+            throw invalid_argument("unsupported " + name.str());
+        }
+        // csrrs/csrrc с x0 или нулевым uimm не пишут
+        bool writes = (i.funct3 & 3) == F1 || i.rs1 != 0;
+        if (writes) {
+            throw invalid_argument("write to read-only " + name.str());
+        }
+        return make((i.rd == 0) ? H_NOP : H_CSR, i.rd, 0, 0, csr);
+    }
+
+    static DecodedInstruction lower(const Instruction &instr) {
+        switch (instr.opcode) {
+            case OPC_3:
+                return lowerLOAD(get<I_Type>(instr.type));
+            case OPC_19:
+                return lowerOP_IMM(get<I_Type>(instr.type));
+            case OPC_23:
+                return lowerU(get<U_Type>(instr.type), H_AUIPC);
+            case OPC_35:
+                return lowerSTORE(get<S_Type>(instr.type));
+            case OPC_51:
+                return lowerOP(get<R_Type>(instr.type));
+            case OPC_55:
+                return lowerU(get<U_Type>(instr.type), H_LUI);
+            case OPC_99:
+                return lowerBRANCH(get<B_Type>(instr.type));
+            case OPC_103:
+                return lowerJALR(get<I_Type>(instr.type));
+            case OPC_111:
+                return lowerJAL(get<J_Type>(instr.type));
+            case OPC_47:
+                return lowerAMO(get<R_Type>(instr.type));
+            case OPC_115:
+                return lowerCSR(get<I_Type>(instr.type));
+            default:
+                // из OPC_15 исполняются только fence и fence.tso
+                if (holds_alternative<Fence_Type>(instr.type)) {
+                    const Fence_Type &f = get<Fence_Type>(instr.type);
+                    return lowerFENCE(f.pred, f.succ);
+                }
+                if (get<System_Type>(instr.type).sys_call == "fence.tso") {
+                    return make(H_FENCE, 0, 0, 0, 0);
+                }
+                return make(H_NOP, 0, 0, 0, 0);
+        }
+    }
+
+    static int32_t signExtend(uint32_t value, int bits) {
+        return static_cast<int32_t>(value << (32 - bits)) >> (32 - bits);
+    }
+
+    // машинное слово сразу в компактную форму, минуя Instruction
+    static DecodedInstruction decodeWord(uint32_t w) {
+        Opcode opcode = w & 0x7F;
+        uint8_t rd = (w >> 7) & 31;
+        Funct3 f3 = (w >> 12) & 7;
+        uint8_t rs1 = (w >> 15) & 31;
+        uint8_t rs2 = (w >> 20) & 31;
+        Funct7 f7 = static_cast<Funct7>(w >> 25);
+        int32_t immI = signExtend(w >> 20, 12);
+
+        switch (opcode) {
+            case OPC_3:
+                return lowerLOAD({rd, f3, rs1, immI});
+            case OPC_19:
+                return lowerOP_IMM({rd, f3, rs1, immI});
+            case OPC_23:
+                return lowerU({rd, static_cast<int32_t>(w >> 12)}, H_AUIPC);
+            case OPC_35:
+                return lowerSTORE({f3, rs1, rs2, signExtend(((w >> 25) << 5) | ((w >> 7) & 31), 12)});
+            case OPC_51:
+                return lowerOP({rd, f3, rs1, rs2, f7});
+            case OPC_55:
+                return lowerU({rd, static_cast<int32_t>(w >> 12)}, H_LUI);
+            case OPC_99: {
+                uint32_t imm = (((w >> 31) & 1) << 12) | (((w >> 7) & 1) << 11) | (((w >> 25) & 0x3F) << 5) |
+                               (((w >> 8) & 0xF) << 1);
+                return lowerBRANCH({f3, rs1, rs2, signExtend(imm, 13)});
+            }
+            case OPC_103:
+                return lowerJALR({rd, F0, rs1, immI});
+            case OPC_111: {
+                uint32_t imm = (((w >> 31) & 1) << 20) | (((w >> 12) & 0xFF) << 12) | (((w >> 20) & 1) << 11) |
+                               (((w >> 21) & 0x3FF) << 1);
+                return lowerJAL({rd, signExtend(imm, 21)});
+            }
+            case OPC_47:
+                return lowerAMO({rd, f3, rs1, rs2, f7});
+            case OPC_15:
+                // fence.i (funct3 = 1) для нас пустой: код не меняется во время работы
+                return (f3 == F0) ? lowerFENCE((w >> 24) & 15, (w >> 20) & 15) : make(H_NOP, 0, 0, 0, 0);
+            case OPC_115:
+                // ecall и ebreak (funct3 = 0) не исполняются, как и в разобранном исходнике
+                return (f3 == F0) ? make(H_NOP, 0, 0, 0, 0)
+                                  : lowerCSR({rd, f3, rs1, static_cast<int32_t>(w >> 20)});
+            default: {
+                ostringstream msg;
+                msg << "illegal instruction word 0x" << hex << w;
+                throw invalid_argument(msg.str());
+            }
+        }
+    }
+
+    static vector<DecodedInstruction> lower(const deque<Instruction> &instructions) {
+        vector<DecodedInstruction> program;
+        program.reserve(instructions.size());
+        for (const Instruction &instr: instructions) {
+            program.push_back(lower(instr));
+        }
+        return program;
+    }
+};
+
+
+struct MemoryLayout {
+    uint32_t base = 0;
+    uint64_t size = 1ULL << 32;
+    uint32_t stackTop = 0; // 0 — sp не инициализируется
+};
+
+MemoryLayout memoryLayout;
+
+uint64_t parse_size(const string &str) {
+    // 4096, 0x1000, 64K, 16M, 1G
+    size_t pos = 0;
+    uint64_t value = stoull(str, &pos, 0);
+    if (pos < str.size()) {
+        switch (toupper(str[pos])) {
+            case 'K':
+                value <<= 10;
+                break;
+            case 'M':
+                value <<= 20;
+                break;
+            case 'G':
+                value <<= 30;
+                break;
+            default:
+                throw invalid_argument("bad size: " + str);
+        }
+    }
+    return value;
+}
+
+// адресное пространство гостя: двухуровневая таблица страниц по 4 КиБ,
+// страница выделяется только при первой записи, чтение нетронутой страницы даёт нули
+struct Memory {
+    static constexpr uint32_t PAGE_BITS = 12;
+    static constexpr uint32_t PAGE_SIZE = 1U << PAGE_BITS;
+    static constexpr uint32_t PAGE_MASK = PAGE_SIZE - 1;
+    static constexpr uint32_t TABLE_BITS = 10;
+    static constexpr uint32_t TABLE_SIZE = 1U << TABLE_BITS;
+
+    // таблицы и страницы ставятся через CAS: память могут делить несколько хартов на разных потоках
+    using Table = atomic<uint8_t *>;
+
+    uint32_t base;
+    uint64_t size;
+    array<atomic<Table *>, TABLE_SIZE> directory{};
+    atomic<uint64_t> pagesTouched{0};
+    // страницы, взятые из отображённой контрольной точки: по одной не освобождаются
+    uint8_t *mapped = nullptr;
+    size_t mappedSize = 0;
+    // резервирования lr.w: у каждой гранулы-слова (по хешу адреса) счётчик записей в неё.
+    // Любая запись и AMO увеличивают счётчик, sc.w удаётся, только если он не изменился с lr.w.
+    // Пока ни один харт ничего не зарезервировал, записи счётчики не трогают
+    static constexpr uint32_t GRANULE_BITS = 10;
+    array<atomic<uint32_t>, 1U << GRANULE_BITS> granuleWrites{};
+    atomic<uint32_t> reservations{0};
+
+    explicit Memory(const MemoryLayout &layout = memoryLayout) : base(layout.base), size(layout.size) {}
+
+    ~Memory() {
+        for (atomic<Table *> &slot: directory) {
+            Table *table = slot.load(memory_order_relaxed);
+            if (table == nullptr) {
+                continue;
+            }
+            for (uint32_t i = 0; i < TABLE_SIZE; i++) {
+                uint8_t *page = table[i].load(memory_order_relaxed);
+                if (!isMapped(page)) {
+                    free(page);
+                }
+            }
+            delete[] table;
+        }
+#ifdef RV_POSIX
+        if (mapped != nullptr) {
+            munmap(mapped, mappedSize);
+        }
+#endif
+    }
+
+    bool isMapped(const uint8_t *page) const {
+        return mapped != nullptr && page >= mapped && page < mapped + mappedSize;
+    }
+
+    // поставить готовую страницу (из контрольной точки); вызывается до старта, без конкурентов
+    void installPage(uint32_t addr, uint8_t *page) {
+        uint8_t *old = entryFor(addr).exchange(page);
+        if (old == nullptr) {
+            pagesTouched++;
+        } else if (!isMapped(old)) {
+            free(old);
+        }
+    }
+
+    // все выделенные страницы в порядке адресов
+    template <typename F>
+    void forEachPage(F f) const {
+        for (uint32_t t = 0; t < TABLE_SIZE; t++) {
+            const Table *table = directory[t].load(memory_order_acquire);
+            for (uint32_t i = 0; table != nullptr && i < TABLE_SIZE; i++) {
+                const uint8_t *page = table[i].load(memory_order_acquire);
+                if (page != nullptr) {
+                    f(((t << TABLE_BITS) | i) << PAGE_BITS, page);
+                }
+            }
+        }
+    }
+
+    Memory(const Memory &) = delete;
+    Memory &operator=(const Memory &) = delete;
+
+    // обнулить память для следующей программы, не отдавая выделенные страницы
+    void clear() {
+        for (atomic<Table *> &slot: directory) {
+            Table *table = slot.load(memory_order_relaxed);
+            if (table == nullptr) {
+                continue;
+            }
+            for (uint32_t i = 0; i < TABLE_SIZE; i++) {
+                uint8_t *page = table[i].load(memory_order_relaxed);
+                if (page != nullptr) {
+                    memset(page, 0, PAGE_SIZE);
+                }
+            }
+        }
+    }
+
+    static const uint8_t *zeroPage() {
+        static const uint8_t zeros[PAGE_SIZE] = {};
+        return zeros;
+    }
+
+    void check(uint32_t addr, uint32_t bytes) const {
+        uint64_t offset = static_cast<uint64_t>(addr) - base;
+        if (addr < base || offset + bytes > size) {
+            ostringstream msg;
+            msg << "memory access fault at 0x" << hex << addr << " (" << dec << bytes << " bytes)";
+            throw out_of_range(msg.str());
+        }
+    }
+
+    const uint8_t *pageForRead(uint32_t addr) const {
+        const Table *table = directory[addr >> (PAGE_BITS + TABLE_BITS)].load(memory_order_acquire);
+        if (table == nullptr) {
+            return zeroPage();
+        }
+        uint8_t *page = table[(addr >> PAGE_BITS) & (TABLE_SIZE - 1)].load(memory_order_acquire);
+        return (page == nullptr) ? zeroPage() : page;
+    }
+
+    Table &entryFor(uint32_t addr) {
+        atomic<Table *> &slot = directory[addr >> (PAGE_BITS + TABLE_BITS)];
+        Table *table = slot.load(memory_order_acquire);
+        if (table == nullptr) {
+            Table *fresh = new Table[TABLE_SIZE]();
+            if (slot.compare_exchange_strong(table, fresh, memory_order_acq_rel, memory_order_acquire)) {
+                table = fresh;
+            } else {
+                delete[] fresh; // другой харт успел первым
+            }
+        }
+        return table[(addr >> PAGE_BITS) & (TABLE_SIZE - 1)];
+    }
+
+    uint8_t *pageForWrite(uint32_t addr) {
+        Table &entry = entryFor(addr);
+        uint8_t *page = entry.load(memory_order_acquire);
+        if (page == nullptr) {
+            uint8_t *fresh = static_cast<uint8_t *>(calloc(PAGE_SIZE, 1));
+            if (fresh == nullptr) {
+                throw bad_alloc();
+            }
+            if (entry.compare_exchange_strong(page, fresh, memory_order_acq_rel, memory_order_acquire)) {
+                page = fresh;
+                pagesTouched.fetch_add(1, memory_order_relaxed);
+            } else {
+                free(fresh);
+            }
+        }
+        return page;
+    }
+
+    uint32_t loadSlow(uint32_t addr, uint32_t bytes) const {
+        uint32_t value = 0;
+        for (uint32_t i = 0; i < bytes; i++) {
+            uint32_t a = addr + i;
+            value |= static_cast<uint32_t>(pageForRead(a)[a & PAGE_MASK]) << (8 * i);
+        }
+        return value;
+    }
+
+    void storeSlow(uint32_t addr, uint32_t value, uint32_t bytes) {
+        for (uint32_t i = 0; i < bytes; i++) {
+            uint32_t a = addr + i;
+            pageForWrite(a)[a & PAGE_MASK] = static_cast<uint8_t>(value >> (8 * i));
+        }
+    }
+
+    // выровненный доступ целиком лежит в одной странице
+    template <typename T>
+    T load(uint32_t addr) const {
+        check(addr, sizeof(T));
+        if ((addr & (sizeof(T) - 1)) != 0) {
+            return static_cast<T>(loadSlow(addr, sizeof(T)));
+        }
+        T value;
+        memcpy(&value, pageForRead(addr) + (addr & PAGE_MASK), sizeof(T));
+        return value;
+    }
+
+    template <typename T>
+    void store(uint32_t addr, T value) {
+        check(addr, sizeof(T));
+        if ((addr & (sizeof(T) - 1)) != 0) {
+            storeSlow(addr, static_cast<uint32_t>(value), sizeof(T));
+        } else {
+            memcpy(pageForWrite(addr) + (addr & PAGE_MASK), &value, sizeof(T));
+        }
+        if (reservations.load(memory_order_relaxed) != 0) {
+            invalidate(addr, sizeof(T));
+        }
+    }
+
+    atomic<uint32_t> &granule(uint32_t addr) { return granuleWrites[(addr >> 2) & ((1U << GRANULE_BITS) - 1)]; }
+
+    // невыровненная запись может задеть два слова
+    void invalidate(uint32_t addr, uint32_t bytes) {
+        granule(addr)++;
+        if (((addr + bytes - 1) >> 2) != (addr >> 2)) {
+            granule(addr + bytes - 1)++;
+        }
+    }
+
+    uint32_t lw(uint32_t addr) const { return load<uint32_t>(addr); }
+    uint32_t lh(uint32_t addr) const { return static_cast<uint32_t>(static_cast<int32_t>(load<int16_t>(addr))); }
+    uint32_t lhu(uint32_t addr) const { return load<uint16_t>(addr); }
+    uint32_t lb(uint32_t addr) const { return static_cast<uint32_t>(static_cast<int32_t>(load<int8_t>(addr))); }
+    uint32_t lbu(uint32_t addr) const { return load<uint8_t>(addr); }
+    void sw(uint32_t addr, uint32_t value) { store<uint32_t>(addr, value); }
+    void sh(uint32_t addr, uint32_t value) { store<uint16_t>(addr, static_cast<uint16_t>(value)); }
+    void sb(uint32_t addr, uint32_t value) { store<uint8_t>(addr, static_cast<uint8_t>(value)); }
+
+    // расширение A: слово должно быть выровнено, операции атомарны относительно других хартов
+    uint32_t *atomicWord(uint32_t addr) {
+        check(addr, 4);
+        if ((addr & 3) != 0) {
+            ostringstream msg;
+            msg << "misaligned atomic access at 0x" << hex << addr;
+            throw out_of_range(msg.str());
+        }
+        return reinterpret_cast<uint32_t *>(pageForWrite(addr) + (addr & PAGE_MASK));
+    }
+
+#if !defined(__GNUC__)
+    static mutex &atomicMutex() {
+        static mutex m;
+        return m;
+    }
+#endif
+
+    uint32_t atomicLoad(uint32_t addr) {
+        uint32_t *word = atomicWord(addr);
+#if defined(__GNUC__)
+        return __atomic_load_n(word, __ATOMIC_SEQ_CST);
+#else
+        lock_guard<mutex> lock(atomicMutex());
+        return *word;
+#endif
+    }
+
+    bool compareExchange(uint32_t addr, uint32_t expected, uint32_t desired) {
+        uint32_t *word = atomicWord(addr);
+#if defined(__GNUC__)
+        return __atomic_compare_exchange_n(word, &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+#else
+        lock_guard<mutex> lock(atomicMutex());
+        if (*word != expected) {
+            return false;
+        }
+        *word = desired;
+        return true;
+#endif
+    }
+
+    // amo*.w: новое значение считается из старого, возвращается старое
+    template <typename Op>
+    uint32_t atomicUpdate(uint32_t addr, Op op) {
+        uint32_t old = atomicLoad(addr);
+        while (!compareExchange(addr, old, op(old))) {
+            old = atomicLoad(addr);
+        }
+        if (reservations.load(memory_order_relaxed) != 0) {
+            invalidate(addr, 4);
+        }
+        return old;
+    }
+};
+
+
+// политики вытеснения для кэша: состояние хранится на (set, way)
+struct ReplacementPolicy {
+    uint32_t sets;
+    uint32_t ways;
+
+    ReplacementPolicy(uint32_t sets, uint32_t ways) : sets(sets), ways(ways) {}
+
+    virtual ~ReplacementPolicy() = default;
+
+    virtual void touch(uint32_t set, uint32_t way) = 0; // попадание
+    virtual void fill(uint32_t set, uint32_t way) = 0;  // в way загружена новая строка
+    virtual uint32_t victim(uint32_t set) = 0;          // все way заняты: кого вытеснить
+};
+
+struct LruPolicy : ReplacementPolicy {
+    uint64_t clock = 0;
+    vector<uint64_t> stamps;
+
+    LruPolicy(uint32_t sets, uint32_t ways) : ReplacementPolicy(sets, ways), stamps(static_cast<size_t>(sets) * ways) {}
+
+    void touch(uint32_t set, uint32_t way) override { stamps[set * ways + way] = ++clock; }
+
+    void fill(uint32_t set, uint32_t way) override { stamps[set * ways + way] = ++clock; }
+
+    uint32_t victim(uint32_t set) override {
+        const uint64_t *s = &stamps[set * ways];
+        return static_cast<uint32_t>(min_element(s, s + ways) - s);
+    }
+};
+
+struct FifoPolicy : LruPolicy {
+    FifoPolicy(uint32_t sets, uint32_t ways) : LruPolicy(sets, ways) {}
+
+    void touch(uint32_t, uint32_t) override {}
+};
+
+// дерево из ways - 1 битов на сет, бит указывает в сторону менее недавно использованной половины
+struct TreePlruPolicy : ReplacementPolicy {
+    vector<uint8_t> bits;
+
+    TreePlruPolicy(uint32_t sets, uint32_t ways) : ReplacementPolicy(sets, ways), bits(static_cast<size_t>(sets) * ways) {
+        if ((ways & (ways - 1)) != 0) {
+            throw invalid_argument("tree-PLRU needs a power-of-two associativity");
+        }
+    }
+
+    void touch(uint32_t set, uint32_t way) override {
+        uint8_t *tree = &bits[set * ways];
+        uint32_t node = 1;
+        for (uint32_t span = ways / 2; span > 0; span /= 2) {
+            bool right = (way & span) != 0;
+            tree[node] = right ? 0 : 1;
+            node = 2 * node + (right ? 1 : 0);
+        }
+    }
+
+    void fill(uint32_t set, uint32_t way) override { touch(set, way); }
+
+    uint32_t victim(uint32_t set) override {
+        const uint8_t *tree = &bits[set * ways];
+        uint32_t node = 1;
+        uint32_t way = 0;
+        for (uint32_t span = ways / 2; span > 0; span /= 2) {
+            bool right = tree[node] != 0;
+            way |= right ? span : 0;
+            node = 2 * node + (right ? 1 : 0);
+        }
+        return way;
+    }
+};
+
+struct RandomPolicy : ReplacementPolicy {
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+
+    RandomPolicy(uint32_t sets, uint32_t ways) : ReplacementPolicy(sets, ways) {}
+
+    void touch(uint32_t, uint32_t) override {}
+
+    void fill(uint32_t, uint32_t) override {}
+
+    uint32_t victim(uint32_t) override {
+        // xorshift64: воспроизводимо от запуска к запуску
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return static_cast<uint32_t>(state % ways);
+    }
+};
+
+unique_ptr<ReplacementPolicy> makePolicy(const string &name, uint32_t sets, uint32_t ways) {
+    if (name == "LRU") {
+        return make_unique<LruPolicy>(sets, ways);
+    }
+    if (name == "PLRU") {
+        return make_unique<TreePlruPolicy>(sets, ways);
+    }
+    if (name == "FIFO") {
+        return make_unique<FifoPolicy>(sets, ways);
+    }
+    if (name == "RANDOM") {
+        return make_unique<RandomPolicy>(sets, ways);
+    }
+    throw invalid_argument("unknown replacement policy: " + name);
+}
+
+struct CacheConfig {
+    uint64_t size = 32 << 10;
+    uint32_t lineSize = 64;
+    uint32_t ways = 8;
+    string policy = currentPolicy;
+
+    // SIZE:LINE:WAYS[:POLICY], например 32K:64:8:PLRU
+    static CacheConfig parse(const string &spec) {
+        CacheConfig cfg;
+        vector<string> parts;
+        stringstream in(spec);
+        string part;
+        while (getline(in, part, ':')) {
+            parts.push_back(part);
+        }
+        if (parts.size() < 3 || parts.size() > 4) {
+            throw invalid_argument("bad cache spec: " + spec + " (expected SIZE:LINE:WAYS[:POLICY])");
+        }
+        cfg.size = parse_size(parts[0]);
+        cfg.lineSize = static_cast<uint32_t>(parse_size(parts[1]));
+        cfg.ways = static_cast<uint32_t>(stoul(parts[2]));
+        if (parts.size() == 4) {
+            cfg.policy = parts[3];
+        }
+        return cfg;
+    }
+
+    string describe() const {
+        ostringstream out;
+        if (size % 1024 == 0) {
+            out << size / 1024 << "K";
+        } else {
+            out << size;
+        }
+        out << "/" << lineSize << "B/" << ways << "-way";
+        return out.str();
+    }
+};
+
+struct Cache {
+    string name;
+    CacheConfig cfg;
+    uint32_t sets;
+    uint32_t lineBits = 0;
+    uint32_t setBits = 0;
+    vector<uint32_t> tags;
+    vector<uint8_t> valid;
+    unique_ptr<ReplacementPolicy> policy;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+
+    Cache(string name, const CacheConfig &cfg) : name(std::move(name)), cfg(cfg) {
+        uint64_t lines = cfg.size / cfg.lineSize;
+        if (cfg.lineSize == 0 || (cfg.lineSize & (cfg.lineSize - 1)) != 0 || cfg.ways == 0 || lines % cfg.ways != 0) {
+            throw invalid_argument("bad cache geometry: " + cfg.describe());
+        }
+        sets = static_cast<uint32_t>(lines / cfg.ways);
+        if (sets == 0 || (sets & (sets - 1)) != 0) {
+            throw invalid_argument("cache set count must be a power of two: " + cfg.describe());
+        }
+        while ((1U << lineBits) < cfg.lineSize) {
+            lineBits++;
+        }
+        while ((1U << setBits) < sets) {
+            setBits++;
+        }
+        tags.assign(static_cast<size_t>(sets) * cfg.ways, 0);
+        valid.assign(static_cast<size_t>(sets) * cfg.ways, 0);
+        policy = makePolicy(cfg.policy, sets, cfg.ways);
+    }
+
+    bool accessLine(uint32_t line) {
+        uint32_t set = line & (sets - 1);
+        uint32_t tag = line >> setBits;
+        size_t base = static_cast<size_t>(set) * cfg.ways;
+        uint32_t freeWay = cfg.ways;
+        for (uint32_t w = 0; w < cfg.ways; w++) {
+            if (!valid[base + w]) {
+                freeWay = min(freeWay, w);
+            } else if (tags[base + w] == tag) {
+                hits++;
+                policy->touch(set, w);
+                return true;
+            }
+        }
+        misses++;
+        uint32_t way = (freeWay < cfg.ways) ? freeWay : policy->victim(set);
+        tags[base + way] = tag;
+        valid[base + way] = 1;
+        policy->fill(set, way);
+        return false;
+    }
+
+    // доступ, пересекающий границу строки, считается по каждой строке отдельно
+    void access(uint32_t addr, uint32_t bytes) {
+        // в 64 битах: обращение у конца адресного пространства не заворачивает счёт строк
+        uint64_t first = addr >> lineBits;
+        uint64_t last = (static_cast<uint64_t>(addr) + bytes - 1) >> lineBits;
+        for (uint64_t line = first; line <= last; line++) {
+            accessLine(static_cast<uint32_t>(line));
+        }
+    }
+
+    double missRatio() const {
+        uint64_t total = hits + misses;
+        return (total > 0) ? static_cast<double>(misses) / static_cast<double>(total) : 0.0;
+    }
+};
+
+// расстояния по стеку LRU (алгоритм Маттсона): за один проход даёт долю промахов
+// полностью ассоциативного LRU-кэша любого размера. Дерево Фенвика хранит единицу
+// на момент последнего обращения к каждой строке, расстояние — число единиц после него.
+struct StackDistance {
+    uint32_t lineBits = 0;
+    uint64_t now = 0;
+    vector<uint32_t> fenwick{0};
+    unordered_map<uint32_t, uint64_t> lastAccess;
+    vector<uint64_t> histogram; // histogram[0] — расстояние 0, histogram[k] — расстояние в [2^(k-1), 2^k)
+    uint64_t coldMisses = 0;
+    uint64_t accesses = 0;
+
+    explicit StackDistance(uint32_t lineSize) {
+        if (lineSize == 0 || (lineSize & (lineSize - 1)) != 0) {
+            throw invalid_argument("stack-distance line size must be a power of two");
+        }
+        while ((1U << lineBits) < lineSize) {
+            lineBits++;
+        }
+    }
+
+    void add(uint64_t pos, int32_t delta) {
+        for (; pos < fenwick.size(); pos += pos & (~pos + 1)) {
+            fenwick[pos] += static_cast<uint32_t>(delta);
+        }
+    }
+
+    uint64_t prefix(uint64_t pos) const {
+        uint64_t sum = 0;
+        for (; pos > 0; pos -= pos & (~pos + 1)) {
+            sum += fenwick[pos];
+        }
+        return sum;
+    }
+
+    // когда время доходит до конца дерева, моменты последних обращений перенумеровываются подряд
+    void compact() {
+        vector<pair<uint64_t, uint32_t>> order;
+        order.reserve(lastAccess.size());
+        for (const auto &entry: lastAccess) {
+            order.push_back({entry.second, entry.first});
+        }
+        sort(order.begin(), order.end());
+        size_t capacity = max<size_t>(1024, 2 * order.size() + 1);
+        fenwick.assign(capacity + 1, 0);
+        now = 0;
+        for (const auto &entry: order) {
+            lastAccess[entry.second] = ++now;
+            add(now, 1);
+        }
+    }
+
+    void access(uint32_t addr) {
+        uint32_t line = addr >> lineBits;
+        if (now + 1 >= fenwick.size()) {
+            compact();
+        }
+        accesses++;
+        uint64_t t = ++now;
+        auto it = lastAccess.find(line);
+        if (it == lastAccess.end()) {
+            coldMisses++;
+            lastAccess.emplace(line, t);
+        } else {
+            uint64_t distance = prefix(t - 1) - prefix(it->second);
+            size_t bucket = 0;
+            while ((1ULL << bucket) <= distance) {
+                bucket++;
+            }
+            if (histogram.size() <= bucket) {
+                histogram.resize(bucket + 1, 0);
+            }
+            histogram[bucket]++;
+            add(it->second, -1);
+            it->second = t;
+        }
+        add(t, 1);
+    }
+
+    // промах в кэше на lines строк — это холодный промах или расстояние >= lines;
+    // для lines, равного степени двойки, счёт по корзинам точный
+    double missRatio(uint64_t lines) const {
+        if (accesses == 0) {
+            return 0.0;
+        }
+        uint64_t misses = coldMisses;
+        for (size_t k = 1; k < histogram.size(); k++) {
+            if ((1ULL << (k - 1)) >= lines) {
+                misses += histogram[k];
+            }
+        }
+        return static_cast<double>(misses) / static_cast<double>(accesses);
+    }
+};
+
+// все модели кэшей получают один и тот же поток обращений за один прогон программы
+struct CacheHierarchy {
+    vector<unique_ptr<Cache>> icaches;
+    vector<unique_ptr<Cache>> dcaches;
+    unique_ptr<StackDistance> istack;
+    unique_ptr<StackDistance> dstack;
+
+    bool empty() const { return icaches.empty() && dcaches.empty() && !istack && !dstack; }
+
+    void fetch(uint32_t pc) {
+        for (auto &c: icaches) {
+            c->access(pc, 4);
+        }
+        if (istack) {
+            istack->access(pc);
+        }
+    }
+
+    void data(uint32_t addr, uint32_t bytes) {
+        for (auto &c: dcaches) {
+            c->access(addr, bytes);
+        }
+        if (dstack) {
+            dstack->access(addr);
+        }
+    }
+
+    void report() const {
+        if (!icaches.empty() || !dcaches.empty()) {
+            cerr << left << setw(8) << "cache" << setw(8) << "policy" << setw(18) << "geometry" << setw(14)
+                 << "accesses" << setw(14) << "hits" << setw(14) << "misses"
+                 << "miss%" << endl;
+            for (const auto *list: {&icaches, &dcaches}) {
+                for (const auto &c: *list) {
+                    cerr << left << setw(8) << c->name << setw(8) << c->cfg.policy << setw(18) << c->cfg.describe()
+                         << setw(14) << c->hits + c->misses << setw(14) << c->hits << setw(14) << c->misses << fixed
+                         << setprecision(3) << 100.0 * c->missRatio() << endl;
+                }
+            }
+        }
+        if (istack || dstack) {
+            const StackDistance *any = istack ? istack.get() : dstack.get();
+            uint64_t lines = 1;
+            uint64_t distinct = max(istack ? istack->lastAccess.size() : 0, dstack ? dstack->lastAccess.size() : 0);
+            cerr << "LRU stack distance, fully associative, " << (1U << any->lineBits) << "B lines" << endl;
+            cerr << left << setw(12) << "size" << setw(10) << "lines" << setw(16) << "icache miss%"
+                 << "dcache miss%" << endl;
+            for (;; lines *= 2) {
+                CacheConfig cfg;
+                cfg.size = lines << any->lineBits;
+                string size = cfg.describe();
+                cerr << left << setw(12) << size.substr(0, size.find('/')) << setw(10) << lines << fixed
+                     << setprecision(3) << setw(16);
+                if (istack) {
+                    cerr << 100.0 * istack->missRatio(lines);
+                } else {
+                    cerr << "-";
+                }
+                if (dstack) {
+                    cerr << 100.0 * dstack->missRatio(lines);
+                } else {
+                    cerr << "-";
+                }
+                cerr << endl;
+                if (lines >= distinct || lines >= (1ULL << 24)) {
+                    break;
+                }
+            }
+        }
+    }
+};
+
+
+// модель классического 5-стадийного конвейера IF ID EX MEM WB с полным обходом: такты теряются
+// только на многотактовом EX, load-use и сбросе конвейера после переходов (предсказание — не взят)
+struct PipelineConfig {
+    array<uint32_t, H_COUNT> exCycles{}; // тактов в EX на инструкцию
+    uint32_t loadUse = 1;                // пузырь между загрузкой и её потребителем
+    uint32_t branchPenalty = 2;          // взятый условный переход и jalr решаются в EX
+    uint32_t jumpPenalty = 1;            // цель jal известна уже в ID
+
+    PipelineConfig() {
+        exCycles.fill(1);
+        for (Handler h: {H_MUL, H_MULH, H_MULHSU, H_MULHU}) {
+            exCycles[h] = 3;
+        }
+        for (Handler h: {H_DIV, H_DIVU, H_REM, H_REMU}) {
+            exCycles[h] = 20;
+        }
+    }
+
+    // "mul=4,div=32,load-use=2,branch=3,jump=1,mulh=5": mul и div задают всю группу,
+    // остальные ключи — имена отдельных инструкций; применяются слева направо
+    static PipelineConfig parse(const string &spec) {
+        PipelineConfig cfg;
+        stringstream ss(spec);
+        string item;
+        while (getline(ss, item, ',')) {
+            size_t eq = item.find('=');
+            if (eq == string::npos) {
+                throw invalid_argument("bad latency '" + item + "', expected name=cycles");
+            }
+            string key = item.substr(0, eq);
+            uint32_t value = static_cast<uint32_t>(stoul(item.substr(eq + 1)));
+            if (key == "load-use") {
+                cfg.loadUse = value;
+            } else if (key == "branch") {
+                cfg.branchPenalty = value;
+            } else if (key == "jump") {
+                cfg.jumpPenalty = value;
+            } else if (key == "mul" || key == "div") {
+                Handler first = (key == "mul") ? H_MUL : H_DIV;
+                for (int h = first; h < first + 4; h++) {
+                    cfg.exCycles[h] = max(1U, value);
+                }
+            } else {
+                auto it = find_if(begin(HANDLER_NAMES), end(HANDLER_NAMES),
+                                  [&](const char *name) { return key == name; });
+                if (it == end(HANDLER_NAMES)) {
+                    throw invalid_argument("unknown latency key '" + key + "'");
+                }
+                cfg.exCycles[it - begin(HANDLER_NAMES)] = max(1U, value);
+            }
+        }
+        return cfg;
+    }
+};
+
+struct PipelineModel {
+    static constexpr uint32_t DEPTH = 5;
+
+    PipelineConfig cfg;
+    uint64_t instructions = 0;
+    uint64_t cycles = 0; // без заполнения конвейера
+    uint64_t execStalls = 0;
+    uint64_t loadUseStalls = 0;
+    uint64_t branchStalls = 0;
+    uint64_t jumpStalls = 0;
+    uint64_t branches = 0;
+    uint64_t taken = 0;
+    uint8_t pendingLoad = 0; // rd предыдущей инструкции, если её результат готов только после MEM
+
+    explicit PipelineModel(const PipelineConfig &cfg) : cfg(cfg) {}
+
+    static bool readsRs1(Handler h) { return h != H_NOP && h != H_LUI && h != H_AUIPC && h != H_JAL && h != H_FENCE; }
+
+    static bool readsRs2(Handler h) {
+        return (h >= H_SB && h <= H_SW) || (h >= H_ADD && h <= H_REMU) || (h >= H_BEQ && h <= H_BGEU) ||
+               (h >= H_SC_W && h <= H_AMOMAXU_W);
+    }
+
+    static bool loadsFromMemory(Handler h) { return (h >= H_LB && h <= H_LHU) || (h >= H_LR_W && h <= H_AMOMAXU_W); }
+
+    void retire(const DecodedInstruction &d, uint32_t pc, uint32_t nextPc) {
+        Handler h = d.handler;
+        instructions++;
+        cycles++;
+        if (pendingLoad != 0 && ((readsRs1(h) && d.rs1 == pendingLoad) || (readsRs2(h) && d.rs2 == pendingLoad))) {
+            cycles += cfg.loadUse;
+            loadUseStalls += cfg.loadUse;
+        }
+        uint32_t extra = cfg.exCycles[h] - 1;
+        cycles += extra;
+        execStalls += extra;
+        if (h >= H_BEQ && h <= H_BGEU) {
+            branches++;
+            if (nextPc != pc + 4) {
+                taken++;
+                cycles += cfg.branchPenalty;
+                branchStalls += cfg.branchPenalty;
+            }
+        } else if (h == H_JAL) {
+            cycles += cfg.jumpPenalty;
+            jumpStalls += cfg.jumpPenalty;
+        } else if (h == H_JALR) {
+            cycles += cfg.branchPenalty;
+            branchStalls += cfg.branchPenalty;
+        }
+        pendingLoad = loadsFromMemory(h) ? d.rd : 0;
+    }
+
+    uint64_t totalCycles() const { return (instructions == 0) ? 0 : cycles + DEPTH - 1; }
+
+    void report() const {
+        uint64_t total = totalCycles();
+        auto share = [total](uint64_t part) { return (total == 0) ? 0.0 : 100.0 * static_cast<double>(part) / total; };
+        cerr << "pipeline: 5-stage in-order, load-use " << cfg.loadUse << ", branch " << cfg.branchPenalty << ", jump "
+             << cfg.jumpPenalty << ", mul " << cfg.exCycles[H_MUL] << ", div " << cfg.exCycles[H_DIV] << endl;
+        cerr << "cycles: " << total << ", instructions: " << instructions << ", CPI: " << fixed << setprecision(3)
+             << ((instructions == 0) ? 0.0 : static_cast<double>(total) / instructions) << endl;
+        cerr << left << setw(12) << "stall" << setw(14) << "cycles"
+             << "share%" << endl;
+        for (auto row: {make_pair("fill", static_cast<uint64_t>((instructions == 0) ? 0 : DEPTH - 1)),
+                        make_pair("load-use", loadUseStalls), make_pair("execute", execStalls),
+                        make_pair("branch", branchStalls), make_pair("jump", jumpStalls)}) {
+            cerr << left << setw(12) << row.first << setw(14) << row.second << setprecision(2) << share(row.second)
+                 << endl;
+        }
+        cerr << "branches: " << branches << ", taken " << taken << " (mispredicted as not-taken)" << endl;
+    }
+};
+
+
+// предсказатели условных переходов: predict вызывается до исполнения, update — с фактическим исходом
+struct BranchPredictor {
+    virtual ~BranchPredictor() = default;
+
+    virtual string describe() const = 0;
+    virtual bool predict(uint32_t pc, uint32_t target) = 0;
+    virtual void update(uint32_t pc, bool taken) = 0; // всегда сразу после predict для той же ветки
+};
+
+// статический: назад — взят (цикл), вперёд — не взят
+struct BtfnPredictor : BranchPredictor {
+    string describe() const override { return "btfn"; }
+
+    bool predict(uint32_t pc, uint32_t target) override { return target <= pc; }
+
+    void update(uint32_t, bool) override {}
+};
+
+inline void trainCounter(uint8_t &counter, bool taken) {
+    if (taken && counter < 3) {
+        counter++;
+    } else if (!taken && counter > 0) {
+        counter--;
+    }
+}
+
+// таблица 2-битных насыщающихся счётчиков по pc
+struct BimodalPredictor : BranchPredictor {
+    uint32_t bits;
+    vector<uint8_t> counters;
+
+    explicit BimodalPredictor(uint32_t bits) : bits(bits), counters(1U << bits, 1) {}
+
+    string describe() const override { return "bimodal:" + to_string(bits); }
+
+    uint32_t index(uint32_t pc) const { return (pc >> 2) & ((1U << bits) - 1); }
+
+    bool predict(uint32_t pc, uint32_t) override { return counters[index(pc)] >= 2; }
+
+    void update(uint32_t pc, bool taken) override { trainCounter(counters[index(pc)], taken); }
+};
+
+// счётчики по pc xor глобальная история
+struct GsharePredictor : BranchPredictor {
+    uint32_t bits;
+    uint32_t history = 0;
+    vector<uint8_t> counters;
+
+    explicit GsharePredictor(uint32_t bits) : bits(bits), counters(1U << bits, 1) {}
+
+    string describe() const override { return "gshare:" + to_string(bits); }
+
+    uint32_t index(uint32_t pc) const { return ((pc >> 2) ^ history) & ((1U << bits) - 1); }
+
+    bool predict(uint32_t pc, uint32_t) override { return counters[index(pc)] >= 2; }
+
+    void update(uint32_t pc, bool taken) override {
+        trainCounter(counters[index(pc)], taken);
+        history = (history << 1) | (taken ? 1U : 0U);
+    }
+};
+
+// упрощённый TAGE: bimodal-основа и четыре тегированные таблицы с историей 5/12/24/48 переходов.
+// Предсказывает самая длинная совпавшая таблица; при ошибке заводится запись в более длинной
+struct TagePredictor : BranchPredictor {
+    static constexpr int TABLES = 4;
+    static constexpr uint32_t TABLE_BITS = 10;
+    static constexpr uint32_t TAG_BITS = 9;
+    static constexpr uint32_t HISTORY[TABLES] = {5, 12, 24, 48};
+
+    struct Entry {
+        uint16_t tag = 0;
+        int8_t counter = 0; // -4..3, знак — направление
+        uint8_t useful = 0;
+    };
+
+    BimodalPredictor base{12};
+    array<vector<Entry>, TABLES> tables;
+    uint64_t history = 0;
+    uint64_t updates = 0;
+    // вычисляется в predict и используется в update
+    array<uint32_t, TABLES> idx{};
+    array<uint16_t, TABLES> tag{};
+    int provider = -1;
+    bool providerPred = false;
+    bool altPred = false;
+
+    TagePredictor() {
+        for (auto &t: tables) {
+            t.resize(1U << TABLE_BITS);
+        }
+    }
+
+    string describe() const override { return "tage"; }
+
+    static uint32_t fold(uint64_t history, uint32_t length, uint32_t bits) {
+        uint64_t h = (length >= 64) ? history : (history & ((1ULL << length) - 1));
+        uint32_t folded = 0;
+        for (; h != 0; h >>= bits) {
+            folded ^= static_cast<uint32_t>(h & ((1ULL << bits) - 1));
+        }
+        return folded;
+    }
+
+    bool predict(uint32_t pc, uint32_t target) override {
+        uint32_t p = pc >> 2;
+        provider = -1;
+        int alt = -1;
+        for (int t = 0; t < TABLES; t++) {
+            idx[t] = (p ^ (p >> TABLE_BITS) ^ fold(history, HISTORY[t], TABLE_BITS)) & ((1U << TABLE_BITS) - 1);
+            tag[t] = static_cast<uint16_t>((p ^ fold(history, HISTORY[t], TAG_BITS) ^
+                                            (fold(history, HISTORY[t], TAG_BITS - 1) << 1)) &
+                                           ((1U << TAG_BITS) - 1));
+            if (tables[t][idx[t]].tag == tag[t]) {
+                alt = provider;
+                provider = t;
+            }
+        }
+        bool basePred = base.predict(pc, target);
+        altPred = (alt >= 0) ? tables[alt][idx[alt]].counter >= 0 : basePred;
+        providerPred = (provider >= 0) ? tables[provider][idx[provider]].counter >= 0 : basePred;
+        return providerPred;
+    }
+
+    void update(uint32_t pc, bool taken) override {
+        if (provider >= 0) {
+            Entry &e = tables[provider][idx[provider]];
+            if (providerPred != altPred) {
+                if (providerPred == taken && e.useful < 3) {
+                    e.useful++;
+                } else if (providerPred != taken && e.useful > 0) {
+                    e.useful--;
+                }
+            }
+            if (taken && e.counter < 3) {
+                e.counter++;
+            } else if (!taken && e.counter > -4) {
+                e.counter--;
+            }
+        } else {
+            base.update(pc, taken);
+        }
+        if (providerPred != taken && provider < TABLES - 1) {
+            bool allocated = false;
+            for (int t = provider + 1; t < TABLES && !allocated; t++) {
+                Entry &e = tables[t][idx[t]];
+                if (e.useful == 0) {
+                    e = {tag[t], static_cast<int8_t>(taken ? 0 : -1), 0};
+                    allocated = true;
+                }
+            }
+            for (int t = provider + 1; t < TABLES && !allocated; t++) {
+                Entry &e = tables[t][idx[t]];
+                e.useful--;
+            }
+        }
+        // полезность периодически стареет, чтобы таблицы не забивались навсегда
+        if (++updates % (1U << 18) == 0) {
+            for (auto &t: tables) {
+                for (Entry &e: t) {
+                    e.useful >>= 1;
+                }
+            }
+        }
+        history = (history << 1) | (taken ? 1U : 0U);
+    }
+};
+
+// "btfn", "bimodal[:bits]", "gshare[:bits]", "tage"
+unique_ptr<BranchPredictor> makePredictor(const string &spec) {
+    size_t colon = spec.find(':');
+    string name = spec.substr(0, colon);
+    uint32_t bits = (colon == string::npos) ? 12 : static_cast<uint32_t>(stoul(spec.substr(colon + 1)));
+    if (bits == 0 || bits > 24) {
+        throw invalid_argument("bad predictor size: " + spec);
+    }
+    if (name == "btfn") {
+        return make_unique<BtfnPredictor>();
+    }
+    if (name == "bimodal") {
+        return make_unique<BimodalPredictor>(bits);
+    }
+    if (name == "gshare") {
+        return make_unique<GsharePredictor>(bits);
+    }
+    if (name == "tage") {
+        return make_unique<TagePredictor>();
+    }
+    throw invalid_argument("unknown branch predictor: " + spec);
+}
+
+// цели безусловных переходов: BTB с прямым отображением для jal и косвенных jalr, RAS для возвратов
+struct TargetPredictor {
+    static constexpr uint32_t BTB_BITS = 9;
+    static constexpr size_t RAS_DEPTH = 16;
+
+    struct BtbEntry {
+        uint32_t pc = UINT32_MAX;
+        uint32_t target = 0;
+    };
+
+    vector<BtbEntry> btb = vector<BtbEntry>(1U << BTB_BITS);
+    vector<uint32_t> ras;
+    uint64_t jumps = 0, jumpMisses = 0;
+    uint64_t returns = 0, returnMisses = 0;
+    uint64_t indirect = 0, indirectMisses = 0;
+
+    bool btbHit(uint32_t pc, uint32_t target) {
+        BtbEntry &e = btb[(pc >> 2) & ((1U << BTB_BITS) - 1)];
+        bool hit = (e.pc == pc && e.target == target);
+        e = {pc, target};
+        return hit;
+    }
+
+    // по соглашению о вызовах: rd = ra — вызов, jalr x0, 0(ra) — возврат
+    void retire(Handler h, uint8_t rd, uint8_t rs1, uint32_t pc, uint32_t target) {
+        if (h == H_JALR && rd == 0 && rs1 == 1) {
+            returns++;
+            bool hit = !ras.empty() && ras.back() == target;
+            if (!ras.empty()) {
+                ras.pop_back();
+            }
+            returnMisses += hit ? 0 : 1;
+        } else if (h == H_JALR) {
+            indirect++;
+            indirectMisses += btbHit(pc, target) ? 0 : 1;
+        } else {
+            jumps++;
+            jumpMisses += btbHit(pc, target) ? 0 : 1;
+        }
+        if (rd == 1) {
+            if (ras.size() == RAS_DEPTH) {
+                ras.erase(ras.begin());
+            }
+            ras.push_back(pc + 4);
+        }
+    }
+};
+
+// все выбранные предсказатели видят один и тот же поток переходов за один прогон
+struct BranchSuite {
+    struct Site {
+        uint64_t executed = 0;
+        uint64_t taken = 0;
+        vector<uint64_t> misses;
+    };
+
+    vector<unique_ptr<BranchPredictor>> predictors;
+    vector<uint64_t> misses;
+    uint64_t branches = 0;
+    TargetPredictor targets;
+    unordered_map<uint32_t, Site> sites;
+
+    explicit BranchSuite(const string &specs) {
+        stringstream in(specs);
+        string spec;
+        while (getline(in, spec, ',')) {
+            if (spec == "all") {
+                for (const char *name: {"btfn", "bimodal", "gshare", "tage"}) {
+                    predictors.push_back(makePredictor(name));
+                }
+            } else if (!spec.empty()) {
+                predictors.push_back(makePredictor(spec));
+            }
+        }
+        if (predictors.empty()) {
+            throw invalid_argument("no branch predictors selected");
+        }
+        misses.assign(predictors.size(), 0);
+    }
+
+    void branch(uint32_t pc, uint32_t target, bool taken) {
+        branches++;
+        Site &site = sites[pc];
+        if (site.misses.empty()) {
+            site.misses.assign(predictors.size(), 0);
+        }
+        site.executed++;
+        site.taken += taken ? 1 : 0;
+        for (size_t k = 0; k < predictors.size(); k++) {
+            bool miss = predictors[k]->predict(pc, target) != taken;
+            predictors[k]->update(pc, taken);
+            misses[k] += miss ? 1 : 0;
+            site.misses[k] += miss ? 1 : 0;
+        }
+    }
+
+    void jump(Handler h, uint8_t rd, uint8_t rs1, uint32_t pc, uint32_t target) { targets.retire(h, rd, rs1, pc, target); }
+
+    void report(uint64_t instret, size_t top) const {
+        auto rate = [](uint64_t part, uint64_t all) { return (all == 0) ? 0.0 : 100.0 * part / all; };
+        cerr << left << setw(14) << "predictor" << setw(14) << "branches" << setw(14) << "mispredicts" << setw(10)
+             << "miss%"
+             << "MPKI" << endl;
+        for (size_t k = 0; k < predictors.size(); k++) {
+            cerr << left << setw(14) << predictors[k]->describe() << setw(14) << branches << setw(14) << misses[k]
+                 << fixed << setprecision(3) << setw(10) << rate(misses[k], branches)
+                 << ((instret == 0) ? 0.0 : 1000.0 * misses[k] / instret) << endl;
+        }
+        cerr << "targets: jal " << targets.jumps << " (btb miss " << fixed << setprecision(2)
+             << rate(targets.jumpMisses, targets.jumps) << "%), returns " << targets.returns << " (ras miss "
+             << rate(targets.returnMisses, targets.returns) << "%), indirect " << targets.indirect << " (btb miss "
+             << rate(targets.indirectMisses, targets.indirect) << "%)" << endl;
+
+        // самые плохо предсказываемые ветки: по наибольшему числу промахов среди предсказателей
+        vector<pair<uint64_t, uint32_t>> order;
+        for (const auto &entry: sites) {
+            order.emplace_back(*max_element(entry.second.misses.begin(), entry.second.misses.end()), entry.first);
+        }
+        sort(order.begin(), order.end(), [](const auto &a, const auto &b) {
+            return a.first != b.first ? a.first > b.first : a.second < b.second;
+        });
+        order.resize(min(order.size(), top));
+        if (order.empty()) {
+            return;
+        }
+        cerr << "top " << order.size() << " branches by mispredictions" << endl;
+        cerr << left << setw(12) << "pc" << setw(14) << "executed" << setw(10) << "taken%";
+        for (const auto &p: predictors) {
+            cerr << setw(20) << p->describe() + " miss%";
+        }
+        cerr << endl;
+        for (const auto &entry: order) {
+            const Site &site = sites.at(entry.second);
+            cerr << left << setw(12) << entry.second << setw(14) << site.executed << setprecision(2) << setw(10)
+                 << rate(site.taken, site.executed);
+            for (size_t k = 0; k < predictors.size(); k++) {
+                cerr << setw(20) << rate(site.misses[k], site.executed);
+            }
+            cerr << endl;
+        }
+    }
+};
+
+
+// готовая к исполнению программа из образа
+struct Image {
+    vector<DecodedInstruction> code;
+    vector<uint32_t> words; // исходные слова инструкций (для трассы)
+    uint32_t entry = TEXT_BASE;
+    uint32_t dataAddr = DATA_BASE;
+    vector<uint8_t> data;
+    string source;         // исходник, если образ собран из .asm
+    vector<size_t> lines;  // строка исходника для каждой инструкции (только для профиля)
+
+    // .data кладётся в память гостя до старта
+    void loadData(Memory &memory) const {
+        if (data.empty()) {
+            return;
+        }
+        memory.check(dataAddr, static_cast<uint32_t>(data.size()));
+        for (size_t i = 0; i < data.size(); i++) {
+            uint32_t addr = dataAddr + static_cast<uint32_t>(i);
+            memory.pageForWrite(addr)[addr & Memory::PAGE_MASK] = data[i];
+        }
+    }
+};
+
+// профиль исполнения: счётчики по pc и по базовым блокам, исходы ветвлений
+// и дерево вызовов по jal/jalr для свёрнутых стеков (flame graph)
+struct Profiler {
+    static constexpr size_t HOT_BLOCKS = 20;
+
+    struct Frame {
+        uint32_t entry;
+        size_t parent;
+        uint64_t self = 0;
+        unordered_map<uint32_t, size_t> children;
+    };
+
+    vector<uint64_t> counts;
+    vector<uint64_t> taken;
+    vector<uint64_t> blockEntries; // сколько раз с этого pc начинался базовый блок
+    vector<uint64_t> blockLength;  // инструкций, исполненных в блоке с этим началом
+    uint32_t blockStart = 0;
+    bool newBlock = true;
+    vector<Frame> frames;
+    size_t frame = 0;
+    uint64_t total = 0;
+
+    Profiler(size_t instructions, uint32_t entry)
+        : counts(instructions), taken(instructions), blockEntries(instructions), blockLength(instructions) {
+        frames.push_back(Frame{entry, 0, 0, {}});
+    }
+
+    void retire(const DecodedInstruction &d, uint32_t pc, uint32_t nextPc, bool branchTaken) {
+        size_t index = pc / 4;
+        total++;
+        counts[index]++;
+        if (newBlock) {
+            blockStart = pc;
+            blockEntries[index]++;
+        }
+        blockLength[blockStart / 4]++;
+        frames[frame].self++;
+
+        bool branch = d.handler >= H_BEQ && d.handler <= H_BGEU;
+        taken[index] += (branch && branchTaken) ? 1 : 0;
+        newBlock = branch || d.handler == H_JAL || d.handler == H_JALR || nextPc != pc + 4;
+        if (d.handler != H_JAL && d.handler != H_JALR) {
+            return;
+        }
+        // связь через ra или t0 — вызов, jalr x0, 0(ra|t0) — возврат; прочие переходы стек не трогают
+        bool link = (d.rd == 1 || d.rd == 5);
+        if (d.handler == H_JALR && d.rd == 0 && (d.rs1 == 1 || d.rs1 == 5)) {
+            frame = frames[frame].parent;
+        } else if (link) {
+            auto it = frames[frame].children.find(nextPc);
+            if (it == frames[frame].children.end()) {
+                frames.push_back(Frame{nextPc, frame, 0, {}});
+                it = frames[frame].children.emplace(nextPc, frames.size() - 1).first;
+            }
+            frame = it->second;
+        }
+    }
+
+    // имя функции — ближайшая метка не ниже строки её первой инструкции
+    static string frameName(uint32_t entry, const vector<string> &source, const vector<size_t> &lines) {
+        size_t index = entry / 4;
+        if (index < lines.size() && lines[index] != 0) {
+            for (size_t line = min(lines[index], source.size()); line > 0; line--) {
+                string_view text = source[line - 1];
+                size_t start = text.find_first_not_of(" \t");
+                size_t colon = text.find(':');
+                if (start != string_view::npos && colon != string_view::npos && colon > start &&
+                    text.substr(start, colon - start).find_first_of(" \t") == string_view::npos) {
+                    return string(text.substr(start, colon - start));
+                }
+            }
+        }
+        stringstream name;
+        name << "0x" << hex << entry;
+        return name.str();
+    }
+
+    static vector<string> readSource(const string &path) {
+        vector<string> source;
+        if (path.empty()) {
+            return source;
+        }
+        ifstream in(path);
+        for (string line; getline(in, line);) {
+            source.push_back(line);
+        }
+        return source;
+    }
+
+    void write(const string &prefix, const Image &image) const {
+        vector<string> source = readSource(image.source);
+        auto percent = [this](uint64_t n) { return (total == 0) ? 0.0 : 100.0 * n / total; };
+
+        ofstream listing(prefix + ".txt");
+        if (!listing) {
+            throw runtime_error("cannot write " + prefix + ".txt");
+        }
+        vector<size_t> order;
+        for (size_t i = 0; i < blockEntries.size(); i++) {
+            if (blockEntries[i] != 0) {
+                order.push_back(i);
+            }
+        }
+        sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+            return blockLength[a] != blockLength[b] ? blockLength[a] > blockLength[b] : a < b;
+        });
+        listing << "# " << total << " instructions retired, " << order.size() << " basic blocks" << endl;
+        listing << "# hot blocks: start pc, entries, instructions, % of total" << endl;
+        for (size_t k = 0; k < order.size() && k < HOT_BLOCKS; k++) {
+            size_t i = order[k];
+            listing << "# " << left << setw(12) << i * 4 << setw(14) << blockEntries[i] << setw(14) << blockLength[i]
+                    << fixed << setprecision(2) << percent(blockLength[i]) << endl;
+        }
+
+        // по строкам исходника, если он есть; иначе по pc с именем обработчика
+        listing << "#" << endl << "# count, %, branch taken/not-taken" << endl;
+        if (!source.empty() && image.lines.size() == counts.size()) {
+            vector<uint64_t> lineCounts(source.size() + 1), lineTaken(source.size() + 1),
+                    lineBranches(source.size() + 1);
+            for (size_t i = 0; i < counts.size(); i++) {
+                size_t line = min(image.lines[i], source.size());
+                bool branch = image.code[i].handler >= H_BEQ && image.code[i].handler <= H_BGEU;
+                lineCounts[line] += counts[i];
+                lineTaken[line] += taken[i];
+                lineBranches[line] += branch ? counts[i] : 0;
+            }
+            for (size_t line = 1; line <= source.size(); line++) {
+                stringstream branch;
+                if (lineBranches[line] != 0) {
+                    branch << lineTaken[line] << "/" << lineBranches[line] - lineTaken[line];
+                }
+                stringstream count;
+                if (lineCounts[line] != 0) {
+                    count << lineCounts[line];
+                }
+                listing << right << setw(12) << count.str() << setw(8) << fixed << setprecision(2);
+                if (lineCounts[line] != 0) {
+                    listing << percent(lineCounts[line]);
+                } else {
+                    listing << "";
+                }
+                listing << setw(16) << branch.str() << "  " << setw(5) << line << ": " << source[line - 1] << endl;
+            }
+        } else {
+            for (size_t i = 0; i < counts.size(); i++) {
+                Handler h = image.code[i].handler;
+                bool branch = h >= H_BEQ && h <= H_BGEU;
+                listing << right << setw(12) << counts[i] << setw(8) << fixed << setprecision(2) << percent(counts[i])
+                        << setw(16) << (branch ? to_string(taken[i]) + "/" + to_string(counts[i] - taken[i]) : "")
+                        << "  " << setw(8) << i * 4 << ": " << HANDLER_NAMES[h] << endl;
+            }
+        }
+
+        // свёрнутые стеки: "main;f;g <инструкций>", формат flamegraph.pl / speedscope
+        ofstream folded(prefix + ".folded");
+        if (!folded) {
+            throw runtime_error("cannot write " + prefix + ".folded");
+        }
+        vector<string> names(frames.size());
+        for (size_t f = 0; f < frames.size(); f++) {
+            string name = frameName(frames[f].entry, source, image.lines);
+            names[f] = (f == 0) ? name : names[frames[f].parent] + ";" + name;
+            if (frames[f].self != 0) {
+                folded << names[f] << " " << frames[f].self << endl;
+            }
+        }
+    }
+};
+
+
+void decodeWords(const MappedFile &file, size_t offset, size_t bytes, Image &image) {
+    if (bytes % 4 != 0 || offset + bytes > file.size) {
+        throw invalid_argument("text size is not a whole number of 32-bit words");
+    }
+    image.code.reserve(bytes / 4);
+    image.words.reserve(bytes / 4);
+    for (size_t pos = offset; pos < offset + bytes; pos += 4) {
+        image.words.push_back(file.get32(pos));
+        image.code.push_back(Decoder::decodeWord(file.get32(pos)));
+    }
+}
+
+Image loadElf32(const MappedFile &file) {
+    if (file.size < 52 || file.data[4] != 1 || file.data[5] != 1) {
+        throw invalid_argument("only little-endian ELF32 images are supported");
+    }
+    if (file.get16(18) != 243) {
+        throw invalid_argument("ELF image is not RISC-V");
+    }
+    Image image;
+    image.entry = file.get32(24);
+    uint32_t phoff = file.get32(28);
+    uint16_t phentsize = file.get16(42);
+    uint16_t phnum = file.get16(44);
+    bool haveText = false;
+    bool haveData = false;
+    for (uint16_t k = 0; k < phnum; k++) {
+        size_t ph = static_cast<size_t>(phoff) + static_cast<size_t>(k) * phentsize;
+        if (ph + 32 > file.size) {
+            throw invalid_argument("truncated ELF program header");
+        }
+        uint32_t type = file.get32(ph);
+        uint32_t flags = file.get32(ph + 24);
+        if (type != 1) {
+            continue; // не PT_LOAD
+        }
+        if ((flags & 1) == 0) {
+            // сегмент данных: filesz байт из файла, остаток до memsz — нули
+            uint32_t offset = file.get32(ph + 4);
+            uint32_t filesz = file.get32(ph + 16);
+            uint32_t memsz = file.get32(ph + 20);
+            if (haveData) {
+                throw invalid_argument("ELF image has more than one data segment");
+            }
+            if (static_cast<size_t>(offset) + filesz > file.size || filesz > memsz) {
+                throw invalid_argument("truncated ELF data segment");
+            }
+            image.dataAddr = file.get32(ph + 8);
+            image.data.assign(file.data + offset, file.data + offset + filesz);
+            image.data.resize(memsz, 0);
+            haveData = true;
+            continue;
+        }
+        if (haveText) {
+            throw invalid_argument("ELF image has more than one executable segment");
+        }
+        if (file.get32(ph + 8) != TEXT_BASE) {
+            throw invalid_argument("executable segment must be linked at TEXT_BASE");
+        }
+        decodeWords(file, file.get32(ph + 4), file.get32(ph + 16), image);
+        haveText = true;
+    }
+    if (!haveText) {
+        throw invalid_argument("ELF image has no executable segment");
+    }
+    return image;
+}
+
+// ELF распознаётся по сигнатуре, всё остальное считается плоским образом
+Image loadImage(const string &path) {
+    MappedFile file(path);
+    if (file.size >= 4 && file.data[0] == 0x7F && file.data[1] == 'E' && file.data[2] == 'L' && file.data[3] == 'F') {
+        return loadElf32(file);
+    }
+    Image image;
+    decodeWords(file, 0, file.size, image);
+    return image;
+}
+
+
+// сжатие блоков трассы: формат в духе LZ4 — токен (длина литералов << 4 | длина совпадения - 4),
+// литералы, смещение 2 байта; длины от 15 продолжаются байтами по 255. Последняя
+// последовательность — только литералы
+struct Lz {
+    static constexpr int HASH_BITS = 16;
+    static constexpr size_t MIN_MATCH = 4;
+    static constexpr size_t MAX_OFFSET = 65535;
+
+    static uint32_t load32(const uint8_t *p) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        return v;
+    }
+
+    static void putLength(vector<uint8_t> &out, size_t length) {
+        for (; length >= 255; length -= 255) {
+            out.push_back(255);
+        }
+        out.push_back(static_cast<uint8_t>(length));
+    }
+
+    static void putSequence(vector<uint8_t> &out, const uint8_t *literals, size_t literalCount, size_t offset,
+                            size_t match) {
+        size_t matchCode = (match == 0) ? 0 : match - MIN_MATCH;
+        out.push_back(static_cast<uint8_t>((min<size_t>(literalCount, 15) << 4) | min<size_t>(matchCode, 15)));
+        if (literalCount >= 15) {
+            putLength(out, literalCount - 15);
+        }
+        out.insert(out.end(), literals, literals + literalCount);
+        if (match == 0) {
+            return;
+        }
+        out.push_back(static_cast<uint8_t>(offset));
+        out.push_back(static_cast<uint8_t>(offset >> 8));
+        if (matchCode >= 15) {
+            putLength(out, matchCode - 15);
+        }
+    }
+
+    // table (позиция + 1, 0 — пусто) переживает вызовы: обнулять 256 КБ на каждый блок дороже,
+    // чем проверить, что кандидат лежит до текущей позиции — байты сравниваются всё равно
+    static void compress(const uint8_t *in, size_t size, vector<uint8_t> &out, vector<uint32_t> &table) {
+        table.resize(1U << HASH_BITS);
+        size_t anchor = 0;
+        size_t i = 0;
+        while (i + MIN_MATCH <= size) {
+            uint32_t v = load32(in + i);
+            uint32_t h = (v * 2654435761U) >> (32 - HASH_BITS);
+            size_t candidate = table[h];
+            table[h] = static_cast<uint32_t>(i + 1);
+            if (candidate == 0 || candidate > i || i - (candidate - 1) > MAX_OFFSET || load32(in + candidate - 1) != v) {
+                // на несжимаемых данных шаг растёт, чтобы не тратить время на поиск
+                i += 1 + ((i - anchor) >> 6);
+                continue;
+            }
+            size_t from = candidate - 1;
+            size_t length = MIN_MATCH;
+            // по 8 байт, первый несовпавший байт — по младшему различающемуся биту
+            while (i + length + 8 <= size) {
+                uint64_t a, b;
+                memcpy(&a, in + from + length, 8);
+                memcpy(&b, in + i + length, 8);
+                if (a != b) {
+                    length += static_cast<size_t>(__builtin_ctzll(a ^ b)) / 8;
+                    break;
+                }
+                length += 8;
+            }
+            if (i + length + 8 > size) {
+                while (i + length < size && in[from + length] == in[i + length]) {
+                    length++;
+                }
+            }
+            putSequence(out, in + anchor, i - anchor, i - from, length);
+            i += length;
+            anchor = i;
+        }
+        putSequence(out, in + anchor, size - anchor, 0, 0);
+    }
+
+    static void decompress(const uint8_t *in, size_t size, vector<uint8_t> &out) {
+        auto corrupt = [] { throw runtime_error("corrupt trace block"); };
+        auto length = [&](size_t &pos, size_t base) {
+            if (base != 15) {
+                return base;
+            }
+            for (uint8_t byte = 255; byte == 255; base += byte) {
+                if (pos >= size) {
+                    corrupt();
+                }
+                byte = in[pos++];
+            }
+            return base;
+        };
+        size_t pos = 0;
+        while (pos < size) {
+            uint8_t token = in[pos++];
+            size_t literals = length(pos, token >> 4);
+            if (literals > size - pos) {
+                corrupt();
+            }
+            out.insert(out.end(), in + pos, in + pos + literals);
+            pos += literals;
+            if (pos == size) {
+                break;
+            }
+            if (size - pos < 2) {
+                corrupt();
+            }
+            size_t offset = in[pos] | (in[pos + 1] << 8);
+            pos += 2;
+            size_t match = length(pos, token & 15) + MIN_MATCH;
+            if (offset == 0 || offset > out.size()) {
+                corrupt();
+            }
+            // совпадение может перекрываться с собой, поэтому побайтно
+            size_t from = out.size() - offset;
+            for (size_t k = 0; k < match; k++) {
+                out.push_back(out[from + k]);
+            }
+        }
+    }
+};
+
+// запись трассы фиксированного размера; pc хранится как отклонение от pc предыдущего шага + 4,
+// поэтому на линейном коде поле нулевое. Слово инструкции — функция pc, слова программы лежат
+// один раз в заголовке файла
+struct TraceRecord {
+    int32_t pcDelta;
+    uint32_t value; // значение rd после шага, 0 если rd = x0
+    uint32_t addr;  // адрес обращения к памяти, 0 если его нет
+};
+static_assert(sizeof(TraceRecord) == 12, "TraceRecord must be packed");
+
+constexpr char TRACE_MAGIC[8] = {'R', 'V', 'T', 'R', 'A', 'C', 'E', '2'};
+
+// блок хранится по столбцам: все pcDelta, затем все value и addr, одинаковые поля соседних шагов
+// лежат рядом. value и addr записываются разностью с прошлым значением на том же pc: счётчики
+// и шаги по массивам превращаются в повторяющиеся константы
+constexpr size_t TRACE_FIELDS = sizeof(TraceRecord) / 4;
+
+// старший бит размера блока: столбцы записаны без сжатия
+constexpr uint32_t TRACE_RAW_BLOCK = 1U << 31;
+
+struct TraceDelta {
+    uint32_t pc;
+    vector<uint32_t> lastValue;
+    vector<uint32_t> lastAddr;
+
+    TraceDelta(uint32_t entry, size_t instructions)
+        : pc(entry - 4), lastValue(instructions), lastAddr(instructions) {}
+
+    // столбцы блока: разности -> значения. Указатели в локальных переменных: столбцы того же
+    // типа, и без этого компилятор перечитывает их на каждой записи
+    void apply(uint32_t *columns, size_t count) {
+        const uint32_t *delta = columns;
+        uint32_t *value = columns + count;
+        uint32_t *addr = columns + 2 * count;
+        uint32_t *values = lastValue.data();
+        uint32_t *addrs = lastAddr.data();
+        size_t size = lastValue.size();
+        uint32_t at = pc;
+        for (size_t i = 0; i < count; i++) {
+            at += 4 + delta[i];
+            size_t index = at / 4;
+            if (index >= size) {
+                throw runtime_error("trace pc out of program");
+            }
+            value[i] = values[index] += value[i];
+            addr[i] = addrs[index] += addr[i];
+        }
+        pc = at;
+    }
+};
+
+// исполнитель складывает записи в блок, сразу разностью с прошлым шагом на том же pc; полные
+// блоки сжимает и пишет фоновый поток. Если сжатие отстаёт и очередь заполнена, очередной блок
+// пишется без сжатия, чтобы исполнитель не ждал компрессор
+struct TraceWriter {
+    static constexpr size_t BLOCK_RECORDS = 1 << 16;
+    static constexpr size_t QUEUE_BLOCKS = 8;
+
+    ofstream out;
+    string path;
+    vector<uint32_t> current; // TRACE_FIELDS столбцов по BLOCK_RECORDS
+    size_t used = 0;
+    uint32_t lastPc;
+    vector<uint32_t> lastValue; // по индексу инструкции, для разностей
+    vector<uint32_t> lastAddr;
+    mutex lock;
+    condition_variable ready;
+    condition_variable drained;
+    deque<vector<uint32_t>> queue;
+    vector<vector<uint32_t>> spare;
+    bool closing = false;
+    exception_ptr error;
+    thread compressor;
+    uint64_t records = 0;
+    uint64_t blocks = 0;
+    uint64_t rawBlocks = 0;
+    uint64_t compressedBytes = 0;
+
+    TraceWriter(const string &path, uint32_t entry, const vector<uint32_t> &words)
+        : out(path, ios::binary), path(path), current(TRACE_FIELDS * BLOCK_RECORDS), lastPc(entry - 4),
+          lastValue(words.size()), lastAddr(words.size()) {
+        if (!out) {
+            throw runtime_error("cannot write " + path);
+        }
+        vector<uint8_t> header(TRACE_MAGIC, TRACE_MAGIC + sizeof(TRACE_MAGIC));
+        put32(header, sizeof(TraceRecord));
+        put32(header, entry);
+        put32(header, static_cast<uint32_t>(words.size()));
+        for (uint32_t word: words) {
+            put32(header, word);
+        }
+        out.write(reinterpret_cast<const char *>(header.data()), static_cast<streamsize>(header.size()));
+        compressor = thread([this] { compressLoop(); });
+    }
+
+    ~TraceWriter() {
+        if (compressor.joinable()) {
+            try {
+                close();
+            } catch (const exception &) {
+                // ошибку записи уже не сообщить
+            }
+        }
+    }
+
+    TraceWriter(const TraceWriter &) = delete;
+    TraceWriter &operator=(const TraceWriter &) = delete;
+
+    void record(uint32_t pc, uint32_t value, uint32_t addr) {
+        uint32_t *column = current.data() + used++;
+        size_t index = pc / 4;
+        column[0] = pc - (lastPc + 4);
+        column[BLOCK_RECORDS] = value - lastValue[index];
+        column[2 * BLOCK_RECORDS] = addr - lastAddr[index];
+        lastValue[index] = value;
+        lastAddr[index] = addr;
+        lastPc = pc;
+        if (used == BLOCK_RECORDS) {
+            flush();
+        }
+    }
+
+    void flush() {
+        if (used == 0) {
+            return;
+        }
+        // неполный блок: столбцы сдвигаются вплотную друг к другу
+        for (size_t k = 1; k < TRACE_FIELDS; k++) {
+            memmove(current.data() + k * used, current.data() + k * BLOCK_RECORDS, used * 4);
+        }
+        current.resize(TRACE_FIELDS * used);
+        records += used;
+        used = 0;
+        unique_lock<mutex> guard(lock);
+        drained.wait(guard, [this] { return queue.size() < QUEUE_BLOCKS; });
+        queue.push_back(move(current));
+        if (spare.empty()) {
+            current = vector<uint32_t>(TRACE_FIELDS * BLOCK_RECORDS);
+        } else {
+            current = move(spare.back());
+            spare.pop_back();
+            current.resize(TRACE_FIELDS * BLOCK_RECORDS);
+        }
+        ready.notify_one();
+    }
+
+    void compressLoop() {
+        vector<uint8_t> packed;
+        vector<uint32_t> table;
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            ready.wait(guard, [this] { return !queue.empty() || closing; });
+            if (queue.empty()) {
+                return;
+            }
+            bool raw = queue.size() >= QUEUE_BLOCKS;
+            vector<uint32_t> block = move(queue.front());
+            queue.pop_front();
+            guard.unlock();
+            try {
+                size_t count = block.size() / TRACE_FIELDS;
+                packed.clear();
+                put32(packed, static_cast<uint32_t>(count));
+                if (raw) {
+                    put32(packed, static_cast<uint32_t>(block.size() * 4) | TRACE_RAW_BLOCK);
+                    out.write(reinterpret_cast<const char *>(packed.data()), 8);
+                    out.write(reinterpret_cast<const char *>(block.data()), static_cast<streamsize>(block.size() * 4));
+                    compressedBytes += 8 + block.size() * 4;
+                    rawBlocks++;
+                } else {
+                    put32(packed, 0);
+                    Lz::compress(reinterpret_cast<const uint8_t *>(block.data()), block.size() * 4, packed, table);
+                    uint32_t size = static_cast<uint32_t>(packed.size() - 8);
+                    memcpy(packed.data() + 4, &size, 4);
+                    out.write(reinterpret_cast<const char *>(packed.data()), static_cast<streamsize>(packed.size()));
+                    compressedBytes += packed.size();
+                }
+                if (!out) {
+                    throw runtime_error("cannot write " + path);
+                }
+                blocks++;
+            } catch (...) {
+                guard.lock();
+                error = current_exception();
+                queue.clear();
+                drained.notify_all();
+                // дальше блоки просто выбрасываются, ошибка всплывёт в close
+                continue;
+            }
+            guard.lock();
+            spare.push_back(move(block));
+            drained.notify_all();
+        }
+    }
+
+    void close() {
+        flush();
+        {
+            lock_guard<mutex> guard(lock);
+            closing = true;
+        }
+        ready.notify_one();
+        compressor.join();
+        out.close();
+        if (error) {
+            rethrow_exception(error);
+        }
+    }
+
+    void report() const {
+        uint64_t raw = records * sizeof(TraceRecord);
+        cerr << "trace: " << records << " records in " << blocks << " blocks (" << rawBlocks << " uncompressed), "
+             << compressedBytes << " bytes (" << fixed << setprecision(2) << ((compressedBytes == 0) ? 0.0 : static_cast<double>(raw) / compressedBytes)
+             << "x, " << ((records == 0) ? 0.0 : 8.0 * compressedBytes / records) << " bits/step)" << endl;
+    }
+};
+
+// чтение трассы: по записи в строке, pc восстанавливается из отклонений
+void dumpTrace(const string &path) {
+    MappedFile file(path);
+    size_t header = sizeof(TRACE_MAGIC) + 12;
+    if (file.size < header || memcmp(file.data, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0) {
+        throw invalid_argument(path + " is not a trace file");
+    }
+    if (file.get32(8) != sizeof(TraceRecord)) {
+        throw invalid_argument("unsupported trace record size in " + path);
+    }
+    uint32_t pc = file.get32(12) - 4;
+    uint32_t instructions = file.get32(16);
+    if ((file.size - header) / 4 < instructions) {
+        throw runtime_error("truncated trace header");
+    }
+    vector<uint32_t> words(instructions);
+    for (size_t k = 0; k < instructions; k++) {
+        words[k] = file.get32(header + 4 * k);
+    }
+    header += 4 * static_cast<size_t>(instructions);
+    TraceDelta delta(file.get32(12), instructions);
+    vector<uint8_t> columns;
+    vector<uint32_t> fields;
+    uint64_t total = 0;
+    cout << hex << setfill('0');
+    for (size_t pos = header; pos < file.size;) {
+        if (file.size - pos < 8) {
+            throw runtime_error("truncated trace block");
+        }
+        uint32_t count = file.get32(pos);
+        uint32_t size = file.get32(pos + 4);
+        bool raw = (size & TRACE_RAW_BLOCK) != 0;
+        size &= ~TRACE_RAW_BLOCK;
+        pos += 8;
+        if (size > file.size - pos) {
+            throw runtime_error("truncated trace block");
+        }
+        columns.clear();
+        if (raw) {
+            columns.assign(file.data + pos, file.data + pos + size);
+        } else {
+            Lz::decompress(file.data + pos, size, columns);
+        }
+        pos += size;
+        if (columns.size() != static_cast<size_t>(count) * sizeof(TraceRecord)) {
+            throw runtime_error("corrupt trace block");
+        }
+        fields.resize(columns.size() / 4);
+        memcpy(fields.data(), columns.data(), columns.size());
+        delta.apply(fields.data(), count);
+        for (size_t i = 0; i < count; i++) {
+            TraceRecord r{static_cast<int32_t>(fields[i]), fields[count + i], fields[2 * count + i]};
+            pc += 4 + static_cast<uint32_t>(r.pcDelta);
+            if (pc / 4 >= instructions) {
+                throw runtime_error("trace pc out of program");
+            }
+            cout << setw(8) << pc << " " << setw(8) << words[pc / 4] << " " << setw(8) << r.value << " " << setw(8)
+                 << r.addr << "\n";
+        }
+        total += count;
+    }
+    cout << dec << setfill(' ') << flush;
+    cerr << "trace: " << total << " records" << endl;
+}
+
+
+// суперинструкции, которые получаются слиянием пары соседних команд внутри блока
+constexpr uint8_t X_LI = H_COUNT;              // lui rd, hi + addi rd, rd, lo
+constexpr uint8_t X_ADDI_BRANCH = H_COUNT + 1; // addi + условный переход сразу за ним
+constexpr uint8_t X_END = H_COUNT + 2;         // конец блока без перехода: дальше по порядку
+
+struct BlockOp {
+    const void *target; // адрес обработчика, проставляется исполнителем
+    uint8_t kind;       // Handler или X_*
+    uint8_t rd;
+    uint8_t rs1;
+    uint8_t rs2;
+    int32_t imm;
+    uint32_t pc;
+    // вторая половина X_ADDI_BRANCH
+    uint8_t branch;
+    uint8_t brRs1;
+    uint8_t brRs2;
+    int32_t brImm;
+};
+
+struct Block {
+    uint32_t startPc;
+    uint32_t length; // число гостевых инструкций
+    vector<BlockOp> ops;
+    // связывание блоков: последний известный преемник
+    uint32_t nextPc = 0;
+    Block *next = nullptr;
+};
+
+struct BlockStats {
+    uint64_t lookups = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t chained = 0;
+    uint64_t blocks = 0;
+    uint64_t fusedLi = 0;
+    uint64_t fusedAddiBranch = 0;
+};
+
+struct BlockCache {
+    static constexpr size_t MAX_BLOCK = 64;
+
+    const vector<DecodedInstruction> &program;
+    vector<Block *> blockAt; // ключ — progCount / 4
+    deque<Block> storage;
+    BlockStats stats;
+
+    explicit BlockCache(const vector<DecodedInstruction> &program) : program(program) {
+        blockAt.assign(program.size(), nullptr);
+    }
+
+    static bool endsBlock(Handler h) { return (h >= H_BEQ && h <= H_BGEU) || h == H_JAL || h == H_JALR; }
+
+    static bool isBranch(Handler h) { return h >= H_BEQ && h <= H_BGEU; }
+
+    // чтение счётчика стоит в блоке одно: instret обновляется на границах блоков
+    static bool isolated(Handler h) { return h == H_CSR; }
+
+    Block *build(uint32_t pc) {
+        storage.emplace_back();
+        Block &b = storage.back();
+        b.startPc = pc;
+        b.length = 0;
+        size_t i = pc / 4;
+        while (i < program.size()) {
+            const DecodedInstruction &d = program[i];
+            if (isolated(d.handler) && !b.ops.empty()) {
+                break;
+            }
+            BlockOp op{nullptr, d.handler, d.rd, d.rs1, d.rs2, d.imm, static_cast<uint32_t>(i * 4), 0, 0, 0, 0};
+            if (i + 1 < program.size()) {
+                const DecodedInstruction &n = program[i + 1];
+                if (d.handler == H_LUI && n.handler == H_ADDI && n.rd == d.rd && n.rs1 == d.rd) {
+                    op.kind = X_LI;
+                    op.imm = static_cast<int32_t>(static_cast<uint32_t>(d.imm) + static_cast<uint32_t>(n.imm));
+                    stats.fusedLi++;
+                } else if (d.handler == H_ADDI && isBranch(n.handler)) {
+                    op.kind = X_ADDI_BRANCH;
+                    op.branch = n.handler;
+                    op.brRs1 = n.rs1;
+                    op.brRs2 = n.rs2;
+                    op.brImm = n.imm;
+                    stats.fusedAddiBranch++;
+                }
+            }
+            b.ops.push_back(op);
+            if (op.kind >= H_COUNT) {
+                b.length += 2;
+                i += 2;
+                if (op.kind == X_ADDI_BRANCH) {
+                    break;
+                }
+            } else {
+                b.length += 1;
+                i += 1;
+                if (endsBlock(d.handler)) {
+                    break;
+                }
+            }
+            if (b.ops.size() >= MAX_BLOCK || isolated(d.handler)) {
+                break;
+            }
+        }
+        const BlockOp &last = b.ops.back();
+        if (last.kind != X_ADDI_BRANCH && !(last.kind < H_COUNT && endsBlock(static_cast<Handler>(last.kind)))) {
+            BlockOp end{nullptr, X_END, 0, 0, 0, 0, pc + 4 * b.length, 0, 0, 0, 0};
+            b.ops.push_back(end);
+        }
+        stats.blocks++;
+        blockAt[pc / 4] = &b;
+        return &b;
+    }
+
+    Block *lookup(uint32_t pc) {
+        stats.lookups++;
+        Block *b = blockAt[pc / 4];
+        if (b != nullptr) {
+            stats.hits++;
+            return b;
+        }
+        stats.misses++;
+        return build(pc);
+    }
+};
+
+inline bool branchTaken(uint8_t branch, uint32_t a, uint32_t b) {
+    switch (branch) {
+        case H_BEQ:
+            return a == b;
+        case H_BNE:
+            return a != b;
+        case H_BLT:
+            return static_cast<int32_t>(a) < static_cast<int32_t>(b);
+        case H_BGE:
+            return static_cast<int32_t>(a) >= static_cast<int32_t>(b);
+        case H_BLTU:
+            return a < b;
+        default: // H_BGEU
+            return a >= b;
+    }
+}
+
+void printBlockStats(const BlockStats &s) {
+    uint64_t entries = s.lookups + s.chained;
+    double hitRate = (entries > 0) ? 100.0 * static_cast<double>(s.hits + s.chained) / static_cast<double>(entries) : 0.0;
+    cerr << "block cache: " << s.blocks << " blocks, " << entries << " entries (" << s.chained << " chained), "
+         << s.misses << " misses, hit rate " << fixed << setprecision(2) << hitRate << "%" << endl;
+    cerr << "fused: lui+addi " << s.fusedLi << ", addi+branch " << s.fusedAddiBranch << endl;
+}
+
+
+#if defined(__linux__) && defined(__x86_64__)
+#define RV_JIT_X86_64 1
+#endif
+
+bool jitDiff = false;
+uint32_t jitThreshold = 16;
+
+struct JitStats {
+    uint64_t compiled = 0;
+    uint64_t rejected = 0;   // блоки, первая инструкция которых не транслируется
+    uint64_t codeBytes = 0;
+    uint64_t jitRuns = 0;
+    uint64_t jitInstret = 0;
+    uint64_t interpInstret = 0;
+    uint64_t diffChecks = 0;
+    uint64_t arenaFull = 0;  // горячие блоки, которым не хватило места в арене кода
+};
+
+void printJitStats(const JitStats &s) {
+    uint64_t total = s.jitInstret + s.interpInstret;
+    double share = (total > 0) ? 100.0 * static_cast<double>(s.jitInstret) / static_cast<double>(total) : 0.0;
+    cerr << "jit: " << s.compiled << " blocks compiled (" << s.codeBytes << " bytes), " << s.rejected
+         << " rejected, " << s.jitRuns << " block runs, " << fixed << setprecision(2) << share
+         << "% of instructions in native code" << endl;
+    if (s.arenaFull > 0) {
+        cerr << "jit: code arena full, " << s.arenaFull << " hot blocks left to the interpreter" << endl;
+    }
+    if (jitDiff) {
+        cerr << "jit diff: " << s.diffChecks << " blocks checked against the interpreter, no divergence" << endl;
+    }
+}
+
+#ifdef RV_JIT_X86_64
+// блок в машинном коде: получает указатель на регистры гостя, возвращает следующий progCount
+using JitFn = uint32_t (*)(uint32_t *);
+
+// гостевые регистры лежат плоским массивом, rdi указывает на x0; eax, ecx, edx — рабочие
+struct X86Emitter {
+    vector<uint8_t> code;
+
+    void bytes(initializer_list<uint8_t> list) { code.insert(code.end(), list); }
+
+    void imm32(uint32_t value) {
+        for (int i = 0; i < 4; i++) {
+            code.push_back(static_cast<uint8_t>(value >> (8 * i)));
+        }
+    }
+
+    static uint8_t disp(uint8_t reg) { return static_cast<uint8_t>(reg * 4); }
+
+    void loadEax(uint8_t reg) { bytes({0x8B, 0x47, disp(reg)}); }        // mov eax, [rdi + 4*reg]
+    void loadEcx(uint8_t reg) { bytes({0x8B, 0x4F, disp(reg)}); }        // mov ecx, [rdi + 4*reg]
+    void storeEax(uint8_t reg) { bytes({0x89, 0x47, disp(reg)}); }       // mov [rdi + 4*reg], eax
+    void storeImm(uint8_t reg, uint32_t value) {                         // mov dword [rdi + 4*reg], imm32
+        bytes({0xC7, 0x47, disp(reg)});
+        imm32(value);
+    }
+    void movEax(uint32_t value) {                                        // mov eax, imm32
+        bytes({0xB8});
+        imm32(value);
+    }
+    void aluEaxImm(uint8_t opcode, uint32_t value) {                     // add/and/or/xor eax, imm32
+        bytes({opcode});
+        imm32(value);
+    }
+    void ret() { bytes({0xC3}); }
+};
+
+struct JitCompiler {
+    static constexpr size_t ARENA_SIZE = 16 << 20;
+    static constexpr size_t MAX_BLOCK = 64;
+
+    uint8_t *arena = nullptr;
+    size_t used = 0;
+    size_t pageSize = 4096;
+
+    // W^X: арена отображается без права исполнения, страницы нового блока открываются на запись
+    // только на время копирования и затем становятся RX
+    JitCompiler() {
+        void *mem = mmap(nullptr, ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        arena = (mem == MAP_FAILED) ? nullptr : static_cast<uint8_t *>(mem);
+        long page = sysconf(_SC_PAGESIZE);
+        if (page > 0) {
+            pageSize = static_cast<size_t>(page);
+        }
+    }
+
+    ~JitCompiler() {
+        if (arena != nullptr) {
+            munmap(arena, ARENA_SIZE);
+        }
+    }
+
+    JitCompiler(const JitCompiler &) = delete;
+    JitCompiler &operator=(const JitCompiler &) = delete;
+
+    static bool isBranch(Handler h) { return h >= H_BEQ && h <= H_BGEU; }
+
+    static bool translatable(Handler h) {
+        switch (h) {
+            case H_NOP:
+            case H_ADDI:
+            case H_SLTI:
+            case H_SLTIU:
+            case H_XORI:
+            case H_ORI:
+            case H_ANDI:
+            case H_SLLI:
+            case H_SRLI:
+            case H_SRAI:
+            case H_ADD:
+            case H_SUB:
+            case H_SLL:
+            case H_SLT:
+            case H_SLTU:
+            case H_XOR:
+            case H_SRL:
+            case H_SRA:
+            case H_OR:
+            case H_AND:
+            case H_MUL:
+            case H_LUI:
+            case H_AUIPC:
+            case H_BEQ:
+            case H_BNE:
+            case H_BLT:
+            case H_BGE:
+            case H_BLTU:
+            case H_BGEU:
+            case H_JAL:
+            case H_JALR:
+                return true;
+            default:
+                // деление, mulh*, обращения к памяти и системные остаются интерпретатору
+                return false;
+        }
+    }
+
+    static void emitOne(X86Emitter &e, const DecodedInstruction &d, uint32_t pc) {
+        switch (d.handler) {
+            case H_NOP:
+                break;
+            case H_ADDI:
+                e.loadEax(d.rs1);
+                e.aluEaxImm(0x05, static_cast<uint32_t>(d.imm));
+                e.storeEax(d.rd);
+                break;
+            case H_XORI:
+                e.loadEax(d.rs1);
+                e.aluEaxImm(0x35, static_cast<uint32_t>(d.imm));
+                e.storeEax(d.rd);
+                break;
+            case H_ORI:
+                e.loadEax(d.rs1);
+                e.aluEaxImm(0x0D, static_cast<uint32_t>(d.imm));
+                e.storeEax(d.rd);
+                break;
+            case H_ANDI:
+                e.loadEax(d.rs1);
+                e.aluEaxImm(0x25, static_cast<uint32_t>(d.imm));
+                e.storeEax(d.rd);
+                break;
+            case H_SLTI:
+            case H_SLTIU:
+                e.loadEax(d.rs1);
+                e.aluEaxImm(0x3D, static_cast<uint32_t>(d.imm)); // cmp eax, imm32
+                e.bytes({0x0F, static_cast<uint8_t>(d.handler == H_SLTI ? 0x9C : 0x92), 0xC0}); // setl/setb al
+                e.bytes({0x0F, 0xB6, 0xC0}); // movzx eax, al
+                e.storeEax(d.rd);
+                break;
+            case H_SLLI:
+            case H_SRLI:
+            case H_SRAI: {
+                static const uint8_t modrm[3] = {0xE0, 0xE8, 0xF8}; // shl, shr, sar
+                e.loadEax(d.rs1);
+                e.bytes({0xC1, modrm[d.handler - H_SLLI], static_cast<uint8_t>(d.imm)});
+                e.storeEax(d.rd);
+                break;
+            }
+            case H_ADD:
+            case H_SUB:
+            case H_XOR:
+            case H_OR:
+            case H_AND: {
+                uint8_t opcode = (d.handler == H_ADD) ? 0x01 : (d.handler == H_SUB) ? 0x29
+                               : (d.handler == H_XOR) ? 0x31 : (d.handler == H_OR) ? 0x09 : 0x21;
+                e.loadEax(d.rs1);
+                e.loadEcx(d.rs2);
+                e.bytes({opcode, 0xC8}); // op eax, ecx
+                e.storeEax(d.rd);
+                break;
+            }
+            case H_SLL:
+            case H_SRL:
+            case H_SRA: {
+                uint8_t modrm = (d.handler == H_SLL) ? 0xE0 : (d.handler == H_SRL) ? 0xE8 : 0xF8;
+                e.loadEax(d.rs1);
+                e.loadEcx(d.rs2);
+                e.bytes({0xD3, modrm}); // shift eax, cl (аппаратно берётся cl & 31)
+                e.storeEax(d.rd);
+                break;
+            }
+            case H_SLT:
+            case H_SLTU:
+                e.loadEax(d.rs1);
+                e.loadEcx(d.rs2);
+                e.bytes({0x39, 0xC8}); // cmp eax, ecx
+                e.bytes({0x0F, static_cast<uint8_t>(d.handler == H_SLT ? 0x9C : 0x92), 0xC0});
+                e.bytes({0x0F, 0xB6, 0xC0});
+                e.storeEax(d.rd);
+                break;
+            case H_MUL:
+                e.loadEax(d.rs1);
+                e.loadEcx(d.rs2);
+                e.bytes({0x0F, 0xAF, 0xC1}); // imul eax, ecx
+                e.storeEax(d.rd);
+                break;
+            case H_LUI:
+                e.storeImm(d.rd, static_cast<uint32_t>(d.imm));
+                break;
+            case H_AUIPC:
+                e.storeImm(d.rd, pc + static_cast<uint32_t>(d.imm));
+                break;
+            case H_BEQ:
+            case H_BNE:
+            case H_BLT:
+            case H_BGE:
+            case H_BLTU:
+            case H_BGEU: {
+                static const uint8_t cmov[6] = {0x44, 0x45, 0x4C, 0x4D, 0x42, 0x43}; // e, ne, l, ge, b, ae
+                e.loadEax(d.rs1);
+                e.bytes({0x3B, 0x47, X86Emitter::disp(d.rs2)}); // cmp eax, [rdi + 4*rs2]
+                e.movEax(pc + 4);                               // mov не трогает флаги
+                e.bytes({0xBA});                                 // mov edx, taken
+                e.imm32(pc + static_cast<uint32_t>(d.imm));
+                e.bytes({0x0F, cmov[d.handler - H_BEQ], 0xC2}); // cmovcc eax, edx
+                e.ret();
+                break;
+            }
+            case H_JAL:
+                if (d.rd != 0) {
+                    e.storeImm(d.rd, pc + 4);
+                }
+                e.movEax(pc + static_cast<uint32_t>(d.imm));
+                e.ret();
+                break;
+            case H_JALR:
+                e.loadEax(d.rs1);
+                e.aluEaxImm(0x05, static_cast<uint32_t>(d.imm));
+                e.aluEaxImm(0x25, 4294967294U);
+                if (d.rd != 0) {
+                    e.storeImm(d.rd, pc + 4);
+                }
+                e.ret();
+                break;
+            default:;
+        }
+    }
+
+    // транслирует блок с адреса pc; length — число покрытых гостевых инструкций
+    JitFn compile(const vector<DecodedInstruction> &program, uint32_t pc, uint32_t &length, JitStats &stats) {
+        length = 0;
+        if (arena == nullptr) {
+            return nullptr;
+        }
+        X86Emitter e;
+        size_t i = pc / 4;
+        bool terminated = false;
+        while (i < program.size() && length < MAX_BLOCK) {
+            const DecodedInstruction &d = program[i];
+            if (!translatable(d.handler)) {
+                break;
+            }
+            emitOne(e, d, static_cast<uint32_t>(i * 4));
+            length++;
+            i++;
+            if (isBranch(d.handler) || d.handler == H_JAL || d.handler == H_JALR) {
+                terminated = true;
+                break;
+            }
+        }
+        if (length == 0) {
+            stats.rejected++;
+            return nullptr;
+        }
+        if (!terminated) {
+            // выход на первую нетранслируемую инструкцию или просто дальше по порядку
+            e.movEax(pc + 4 * length);
+            e.ret();
+        }
+        if (used + e.code.size() > ARENA_SIZE) {
+            stats.arenaFull++;
+            return nullptr;
+        }
+        uint8_t *dst = arena + used;
+        // страницы блока; первая может быть общей с хвостом предыдущего блока
+        uint8_t *first = arena + used / pageSize * pageSize;
+        size_t span = (used + e.code.size() + pageSize - 1) / pageSize * pageSize - used / pageSize * pageSize;
+        if (mprotect(first, span, PROT_READ | PROT_WRITE) != 0) {
+            throw runtime_error("jit: cannot make code arena writable");
+        }
+        copy(e.code.begin(), e.code.end(), dst);
+        if (mprotect(first, span, PROT_READ | PROT_EXEC) != 0) {
+            throw runtime_error("jit: cannot make code arena executable");
+        }
+        used += e.code.size();
+        stats.compiled++;
+        stats.codeBytes += e.code.size();
+        return reinterpret_cast<JitFn>(dst);
+    }
+};
+#endif
+
+
+struct CPU {
+    uint32_t progCount = 0;
+    uint64_t instret = 0;
+    uint64_t stepLimit = UINT64_MAX; // run() возвращается на первой границе блока после instret >= stepLimit
+    // резервирование lr.w: sc.w удаётся, если в гранулу с тех пор никто не писал (см. Memory::granule),
+    // включая сам этот харт; прочитанное значение сверяется ещё раз при самой записи
+    bool reserved = false;
+    uint32_t reservedAddr = 0;
+    uint32_t reservedValue = 0;
+    uint32_t reservedWrites = 0;
+    array<uint32_t, 32> registers{};
+    shared_ptr<Memory> memory;
+    CacheHierarchy *caches = nullptr;
+    PipelineModel *pipeline = nullptr;
+    BranchSuite *branches = nullptr;
+    Profiler *profiler = nullptr;
+    TraceWriter *trace = nullptr;
+    BlockStats blockStats;
+    JitStats jitStats;
+
+
+    explicit CPU(shared_ptr<Memory> memory = nullptr) : memory(memory ? memory : make_shared<Memory>()) {
+        registers.fill(0);
+        registers[2] = memoryLayout.stackTop;
+    }
+
+    // счётчик гранулы читается до самого слова: запись между ними sc.w уже заметит
+    void reserve(uint32_t addr) {
+        if (!reserved) {
+            memory->reservations++;
+            reserved = true;
+        }
+        reservedAddr = addr;
+        reservedWrites = memory->granule(addr).load();
+    }
+
+    void dropReservation() {
+        if (reserved) {
+            memory->reservations--;
+            reserved = false;
+        }
+    }
+
+    // вернуть ядро в начальное состояние, сохранив уже выделенную память
+    void reset() {
+        progCount = 0;
+        instret = 0;
+        stepLimit = UINT64_MAX;
+        dropReservation();
+        registers.fill(0);
+        registers[2] = memoryLayout.stackTop;
+        memory->clear();
+        blockStats = BlockStats();
+        jitStats = JitStats();
+    }
+
+
+    // instret — инструкции, завершённые до текущей: движки обновляют его до исполнения CSR.
+    // Такты берутся из модели конвейера, без неё — по такту на инструкцию; time идёт с частотой ядра
+    uint32_t readCounter(uint16_t csr) const {
+        uint64_t cycles = (pipeline != nullptr) ? pipeline->cycles : instret;
+        switch (csr) {
+            case CSR_CYCLE:
+            case CSR_TIME:
+                return static_cast<uint32_t>(cycles);
+            case CSR_CYCLEH:
+            case CSR_TIMEH:
+                return static_cast<uint32_t>(cycles >> 32);
+            case CSR_INSTRET:
+                return static_cast<uint32_t>(instret);
+            default:
+                return static_cast<uint32_t>(instret >> 32);
+        }
+    }
+
+    // rd == 0 у чисто арифметических инструкций отсекается при декодировании (H_NOP)
+    void runCommand(const DecodedInstruction &d) {
+        uint32_t *R = registers.data();
+
+        switch (d.handler) {
+            case H_LB:
+            case H_LH:
+            case H_LW:
+            case H_LBU:
+            case H_LHU: {
+                uint32_t addr = R[d.rs1] + static_cast<uint32_t>(d.imm);
+                uint32_t value;
+                if (caches != nullptr) {
+                    static const uint8_t bytes[H_LHU + 1] = {0, 1, 2, 4, 1, 2};
+                    caches->data(addr, bytes[d.handler]);
+                }
+                switch (d.handler) {
+                    case H_LB:
+                        value = memory->lb(addr);
+                        break;
+                    case H_LH:
+                        value = memory->lh(addr);
+                        break;
+                    case H_LW:
+                        value = memory->lw(addr);
+                        break;
+                    case H_LBU:
+                        value = memory->lbu(addr);
+                        break;
+                    default:
+                        value = memory->lhu(addr);
+                }
+                if (d.rd != 0) {
+                    R[d.rd] = value;
+                }
+                progCount += 4;
+                break;
+            }
+
+            case H_SB:
+                if (caches != nullptr) {
+                    caches->data(R[d.rs1] + static_cast<uint32_t>(d.imm), 1);
+                }
+                memory->sb(R[d.rs1] + static_cast<uint32_t>(d.imm), R[d.rs2]);
+                progCount += 4;
+                break;
+            case H_SH:
+                if (caches != nullptr) {
+                    caches->data(R[d.rs1] + static_cast<uint32_t>(d.imm), 2);
+                }
+                memory->sh(R[d.rs1] + static_cast<uint32_t>(d.imm), R[d.rs2]);
+                progCount += 4;
+                break;
+            case H_SW:
+                if (caches != nullptr) {
+                    caches->data(R[d.rs1] + static_cast<uint32_t>(d.imm), 4);
+                }
+                memory->sw(R[d.rs1] + static_cast<uint32_t>(d.imm), R[d.rs2]);
+                progCount += 4;
+                break;
+
+            case H_LR_W: {
+                uint32_t addr = R[d.rs1];
+                if (caches != nullptr) {
+                    caches->data(addr, 4);
+                }
+                reserve(addr);
+                uint32_t value = memory->atomicLoad(addr);
+                reservedValue = value;
+                if (d.rd != 0) {
+                    R[d.rd] = value;
+                }
+                progCount += 4;
+                break;
+            }
+            case H_SC_W: {
+                uint32_t addr = R[d.rs1];
+                if (caches != nullptr) {
+                    caches->data(addr, 4);
+                }
+                uint32_t seen = reservedWrites;
+                bool stored = reserved && reservedAddr == addr &&
+                              memory->granule(addr).compare_exchange_strong(seen, seen + 1) &&
+                              memory->compareExchange(addr, reservedValue, R[d.rs2]);
+                dropReservation();
+                if (d.rd != 0) {
+                    R[d.rd] = stored ? 0 : 1;
+                }
+                progCount += 4;
+                break;
+            }
+            case H_AMOSWAP_W:
+            case H_AMOADD_W:
+            case H_AMOXOR_W:
+            case H_AMOAND_W:
+            case H_AMOOR_W:
+            case H_AMOMIN_W:
+            case H_AMOMAX_W:
+            case H_AMOMINU_W:
+            case H_AMOMAXU_W: {
+                uint32_t addr = R[d.rs1];
+                uint32_t src = R[d.rs2];
+                if (caches != nullptr) {
+                    caches->data(addr, 4);
+                }
+                Handler h = d.handler;
+                uint32_t old = memory->atomicUpdate(addr, [h, src](uint32_t value) {
+                    switch (h) {
+                        case H_AMOSWAP_W:
+                            return src;
+                        case H_AMOADD_W:
+                            return value + src;
+                        case H_AMOXOR_W:
+                            return value ^ src;
+                        case H_AMOAND_W:
+                            return value & src;
+                        case H_AMOOR_W:
+                            return value | src;
+                        case H_AMOMIN_W:
+                            return (static_cast<int32_t>(value) < static_cast<int32_t>(src)) ? value : src;
+                        case H_AMOMAX_W:
+                            return (static_cast<int32_t>(value) > static_cast<int32_t>(src)) ? value : src;
+                        case H_AMOMINU_W:
+                            return min(value, src);
+                        default:
+                            return max(value, src);
+                    }
+                });
+                if (d.rd != 0) {
+                    R[d.rd] = old;
+                }
+                progCount += 4;
+                break;
+            }
+            case H_FENCE:
+                // упорядочивает обычные обращения к памяти этого харта относительно остальных
+                atomic_thread_fence(memory_order_seq_cst);
+                progCount += 4;
+                break;
+            case H_CSR:
+                R[d.rd] = readCounter(static_cast<uint16_t>(d.imm));
+                progCount += 4;
+                break;
+
+            case H_ADDI:
+                R[d.rd] = R[d.rs1] + static_cast<uint32_t>(d.imm);
+                progCount += 4;
+                break;
+            case H_SLTI:
+                R[d.rd] = (static_cast<int32_t>(R[d.rs1]) < d.imm) ? 1U : 0U;
+                progCount += 4;
+                break;
+            case H_SLTIU:
+                R[d.rd] = (R[d.rs1] < static_cast<uint32_t>(d.imm)) ? 1U : 0U;
+                progCount += 4;
+                break;
+            case H_XORI:
+                R[d.rd] = R[d.rs1] ^ static_cast<uint32_t>(d.imm);
+                progCount += 4;
+                break;
+            case H_ORI:
+                R[d.rd] = R[d.rs1] | static_cast<uint32_t>(d.imm);
+                progCount += 4;
+                break;
+            case H_ANDI:
+                R[d.rd] = R[d.rs1] & static_cast<uint32_t>(d.imm);
+                progCount += 4;
+                break;
+            case H_SLLI:
+                R[d.rd] = R[d.rs1] << d.imm;
+                progCount += 4;
+                break;
+            case H_SRLI:
+                R[d.rd] = R[d.rs1] >> d.imm;
+                progCount += 4;
+                break;
+            case H_SRAI:
+                R[d.rd] = static_cast<uint32_t>(static_cast<int32_t>(R[d.rs1]) >> d.imm);
+                progCount += 4;
+                break;
+
+            case H_ADD:
+                R[d.rd] = R[d.rs1] + R[d.rs2];
+                progCount += 4;
+                break;
+            case H_SUB:
+                R[d.rd] = R[d.rs1] - R[d.rs2];
+                progCount += 4;
+                break;
+            case H_SLL:
+                R[d.rd] = R[d.rs1] << (R[d.rs2] & 31);
+                progCount += 4;
+                break;
+            case H_SLT:
+                R[d.rd] = (static_cast<int32_t>(R[d.rs1]) < static_cast<int32_t>(R[d.rs2])) ? 1U : 0U;
+                progCount += 4;
+                break;
+            case H_SLTU:
+                R[d.rd] = (R[d.rs1] < R[d.rs2]) ? 1U : 0U;
+                progCount += 4;
+                break;
+            case H_XOR:
+                R[d.rd] = R[d.rs1] ^ R[d.rs2];
+                progCount += 4;
+                break;
+            case H_SRL:
+                R[d.rd] = R[d.rs1] >> (R[d.rs2] & 31);
+                progCount += 4;
+                break;
+            case H_SRA:
+                R[d.rd] = static_cast<uint32_t>(static_cast<int32_t>(R[d.rs1]) >> (R[d.rs2] & 31));
+                progCount += 4;
+                break;
+            case H_OR:
+                R[d.rd] = R[d.rs1] | R[d.rs2];
+                progCount += 4;
+                break;
+            case H_AND:
+                R[d.rd] = R[d.rs1] & R[d.rs2];
+                progCount += 4;
+                break;
+
+            case H_MUL:
+                R[d.rd] = R[d.rs1] * R[d.rs2];
+                progCount += 4;
+                break;
+            case H_MULH: {
+                int64_t prod = static_cast<int64_t>(static_cast<int32_t>(R[d.rs1])) *
+                               static_cast<int64_t>(static_cast<int32_t>(R[d.rs2]));
+                R[d.rd] = static_cast<uint32_t>(static_cast<uint64_t>(prod) >> 32);
+                progCount += 4;
+                break;
+            }
+            case H_MULHSU: {
+                int64_t prod = static_cast<int64_t>(static_cast<int32_t>(R[d.rs1])) * static_cast<int64_t>(R[d.rs2]);
+                R[d.rd] = static_cast<uint32_t>(static_cast<uint64_t>(prod) >> 32);
+                progCount += 4;
+                break;
+            }
+            case H_MULHU: {
+                uint64_t prod = static_cast<uint64_t>(R[d.rs1]) * static_cast<uint64_t>(R[d.rs2]);
+                R[d.rd] = static_cast<uint32_t>(prod >> 32);
+                progCount += 4;
+                break;
+            }
+            case H_DIV: {
+                int32_t a = static_cast<int32_t>(R[d.rs1]);
+                int32_t b = static_cast<int32_t>(R[d.rs2]);
+                if (b == 0) {
+                    R[d.rd] = 4294967295U;
+                } else if (a == INT32_MIN && b == -1) {
+                    R[d.rd] = static_cast<uint32_t>(a);
+                } else {
+                    R[d.rd] = static_cast<uint32_t>(a / b);
+                }
+                progCount += 4;
+                break;
+            }
+            case H_DIVU:
+                R[d.rd] = (R[d.rs2] != 0) ? R[d.rs1] / R[d.rs2] : 4294967295U;
+                progCount += 4;
+                break;
+            case H_REM: {
+                int32_t a = static_cast<int32_t>(R[d.rs1]);
+                int32_t b = static_cast<int32_t>(R[d.rs2]);
+                if (b == 0) {
+                    R[d.rd] = static_cast<uint32_t>(a);
+                } else if (a == INT32_MIN && b == -1) {
+                    R[d.rd] = 0;
+                } else {
+                    R[d.rd] = static_cast<uint32_t>(a % b);
+                }
+                progCount += 4;
+                break;
+            }
+            case H_REMU:
+                R[d.rd] = (R[d.rs2] != 0) ? R[d.rs1] % R[d.rs2] : R[d.rs1];
+                progCount += 4;
+                break;
+
+            case H_LUI:
+                R[d.rd] = static_cast<uint32_t>(d.imm);
+                progCount += 4;
+                break;
+            case H_AUIPC:
+                R[d.rd] = progCount + static_cast<uint32_t>(d.imm);
+                progCount += 4;
+                break;
+
+            case H_BEQ:
+                progCount += (R[d.rs1] == R[d.rs2]) ? static_cast<uint32_t>(d.imm) : 4;
+                break;
+            case H_BNE:
+                progCount += (R[d.rs1] != R[d.rs2]) ? static_cast<uint32_t>(d.imm) : 4;
+                break;
+            case H_BLT:
+                progCount += (static_cast<int32_t>(R[d.rs1]) < static_cast<int32_t>(R[d.rs2]))
+                                     ? static_cast<uint32_t>(d.imm)
+                                     : 4;
+                break;
+            case H_BGE:
+                progCount += (static_cast<int32_t>(R[d.rs1]) >= static_cast<int32_t>(R[d.rs2]))
+                                     ? static_cast<uint32_t>(d.imm)
+                                     : 4;
+                break;
+            case H_BLTU:
+                progCount += (R[d.rs1] < R[d.rs2]) ? static_cast<uint32_t>(d.imm) : 4;
+                break;
+            case H_BGEU:
+                progCount += (R[d.rs1] >= R[d.rs2]) ? static_cast<uint32_t>(d.imm) : 4;
+                break;
+
+            case H_JAL:
+                if (d.rd != 0) {
+                    R[d.rd] = progCount + 4;
+                }
+                progCount += static_cast<uint32_t>(d.imm);
+                break;
+            case H_JALR: {
+                uint32_t target = (R[d.rs1] + static_cast<uint32_t>(d.imm)) & 4294967294U;
+                if (d.rd != 0) {
+                    R[d.rd] = progCount + 4;
+                }
+                progCount = target;
+                break;
+            }
+
+            default: // H_NOP
+                progCount += 4;
+        }
+    }
+
+    void runSwitch(const vector<DecodedInstruction> &program) {
+        const DecodedInstruction *code = program.data();
+        size_t count = program.size();
+        while (progCount / 4 < count && instret < stepLimit) {
+            runCommand(code[progCount / 4]);
+            instret++;
+        }
+    }
+
+    // прямой шитый код: у каждой инструкции заранее записан адрес её обработчика
+    struct ThreadedOp {
+        const void *target;
+        DecodedInstruction d;
+    };
+
+    // TRACED: трасса без других моделей, запись добавляется к каждому шагу прямо в NEXT и JUMP
+    template <bool TRACED = false>
+    void runThreaded(const vector<DecodedInstruction> &program) {
+#if defined(__GNUC__)
+        const void *table[H_COUNT];
+        for (const void *&t: table) {
+            t = &&op_slow;
+        }
+        table[H_NOP] = &&op_nop;
+        table[H_ADDI] = &&op_addi;
+        table[H_SLTI] = &&op_slti;
+        table[H_SLTIU] = &&op_sltiu;
+        table[H_XORI] = &&op_xori;
+        table[H_ORI] = &&op_ori;
+        table[H_ANDI] = &&op_andi;
+        table[H_SLLI] = &&op_slli;
+        table[H_SRLI] = &&op_srli;
+        table[H_SRAI] = &&op_srai;
+        table[H_ADD] = &&op_add;
+        table[H_SUB] = &&op_sub;
+        table[H_SLL] = &&op_sll;
+        table[H_SLT] = &&op_slt;
+        table[H_SLTU] = &&op_sltu;
+        table[H_XOR] = &&op_xor;
+        table[H_SRL] = &&op_srl;
+        table[H_SRA] = &&op_sra;
+        table[H_OR] = &&op_or;
+        table[H_AND] = &&op_and;
+        table[H_MUL] = &&op_mul;
+        table[H_LW] = &&op_lw;
+        table[H_SW] = &&op_sw;
+        table[H_LUI] = &&op_lui;
+        table[H_AUIPC] = &&op_auipc;
+        table[H_BEQ] = &&op_beq;
+        table[H_BNE] = &&op_bne;
+        table[H_BLT] = &&op_blt;
+        table[H_BGE] = &&op_bge;
+        table[H_BLTU] = &&op_bltu;
+        table[H_BGEU] = &&op_bgeu;
+        table[H_JAL] = &&op_jal;
+        table[H_JALR] = &&op_jalr;
+
+        size_t count = program.size();
+        vector<ThreadedOp> code(count + 1);
+        for (size_t i = 0; i < count; i++) {
+            code[i] = {table[program[i].handler], program[i]};
+        }
+        code[count] = {&&op_halt, Decoder::make(H_NOP, 0, 0, 0, 0)};
+
+        uint32_t *R = registers.data();
+        Memory &mem = *memory;
+        uint32_t pc = progCount;
+        uint64_t retired = instret;
+        uint64_t limit = stepLimit;
+        const ThreadedOp *base = code.data();
+        const ThreadedOp *ip = base + count;
+
+        // курсор блока трассы и прошлые значения по pc — в локальных переменных: они того же типа,
+        // что регистры и память, и через поля writer компилятор перечитывал бы их на каждом шаге
+        constexpr size_t BLOCK = TraceWriter::BLOCK_RECORDS;
+        TraceWriter *writer = trace;
+        uint32_t *column = TRACED ? writer->current.data() : nullptr;
+        size_t used = TRACED ? writer->used : 0;
+        uint32_t lastPc = TRACED ? writer->lastPc : 0;
+        uint32_t *lastValue = TRACED ? writer->lastValue.data() : nullptr;
+        uint32_t *lastAddr = TRACED ? writer->lastAddr.data() : nullptr;
+        uint32_t addr = 0; // адрес обращения к памяти текущей инструкции
+        // перед вызовами, которые могут бросить исключение, и в конце: уже записанные шаги
+        // должны попасть в файл и при ошибке исполнения
+        auto saveTrace = [&] {
+            if constexpr (TRACED) {
+                writer->used = used;
+                writer->lastPc = lastPc;
+            }
+        };
+
+#define D (ip->d)
+#define RECORD()                                                                                                       \
+    do {                                                                                                               \
+        if constexpr (TRACED) {                                                                                        \
+            uint32_t index = pc / 4;                                                                                   \
+            uint32_t value = R[D.rd];                                                                                  \
+            column[used] = pc - (lastPc + 4);                                                                          \
+            column[BLOCK + used] = value - lastValue[index];                                                           \
+            column[2 * BLOCK + used] = addr - lastAddr[index];                                                         \
+            lastValue[index] = value;                                                                                  \
+            lastAddr[index] = addr;                                                                                    \
+            lastPc = pc;                                                                                               \
+            addr = 0;                                                                                                  \
+            if (++used == BLOCK) {                                                                                     \
+                saveTrace();                                                                                           \
+                writer->flush();                                                                                       \
+                column = writer->current.data();                                                                       \
+                used = 0;                                                                                              \
+            }                                                                                                          \
+        }                                                                                                              \
+    } while (0)
+#define NEXT()                                                                                                         \
+    do {                                                                                                               \
+        RECORD();                                                                                                      \
+        pc += 4;                                                                                                       \
+        retired++;                                                                                                     \
+        ip++;                                                                                                          \
+        goto *ip->target;                                                                                              \
+    } while (0)
+#define JUMP(target_pc)                                                                                                \
+    do {                                                                                                               \
+        uint32_t next = (target_pc);                                                                                   \
+        RECORD();                                                                                                      \
+        pc = next;                                                                                                     \
+        retired++;                                                                                                     \
+        if (pc / 4 >= count || retired >= limit) {                                                                     \
+            goto done;                                                                                                 \
+        }                                                                                                              \
+        ip = base + pc / 4;                                                                                            \
+        goto *ip->target;                                                                                              \
+    } while (0)
+
+        if (pc / 4 >= count) {
+            goto done;
+        }
+        ip = base + pc / 4;
+        goto *ip->target;
+
+    op_nop:
+        NEXT();
+    op_addi:
+        R[D.rd] = R[D.rs1] + static_cast<uint32_t>(D.imm);
+        NEXT();
+    op_slti:
+        R[D.rd] = (static_cast<int32_t>(R[D.rs1]) < D.imm) ? 1U : 0U;
+        NEXT();
+    op_sltiu:
+        R[D.rd] = (R[D.rs1] < static_cast<uint32_t>(D.imm)) ? 1U : 0U;
+        NEXT();
+    op_xori:
+        R[D.rd] = R[D.rs1] ^ static_cast<uint32_t>(D.imm);
+        NEXT();
+    op_ori:
+        R[D.rd] = R[D.rs1] | static_cast<uint32_t>(D.imm);
+        NEXT();
+    op_andi:
+        R[D.rd] = R[D.rs1] & static_cast<uint32_t>(D.imm);
+        NEXT();
+    op_slli:
+        R[D.rd] = R[D.rs1] << D.imm;
+        NEXT();
+    op_srli:
+        R[D.rd] = R[D.rs1] >> D.imm;
+        NEXT();
+    op_srai:
+        R[D.rd] = static_cast<uint32_t>(static_cast<int32_t>(R[D.rs1]) >> D.imm);
+        NEXT();
+    op_add:
+        R[D.rd] = R[D.rs1] + R[D.rs2];
+        NEXT();
+    op_sub:
+        R[D.rd] = R[D.rs1] - R[D.rs2];
+        NEXT();
+    op_sll:
+        R[D.rd] = R[D.rs1] << (R[D.rs2] & 31);
+        NEXT();
+    op_slt:
+        R[D.rd] = (static_cast<int32_t>(R[D.rs1]) < static_cast<int32_t>(R[D.rs2])) ? 1U : 0U;
+        NEXT();
+    op_sltu:
+        R[D.rd] = (R[D.rs1] < R[D.rs2]) ? 1U : 0U;
+        NEXT();
+    op_xor:
+        R[D.rd] = R[D.rs1] ^ R[D.rs2];
+        NEXT();
+    op_srl:
+        R[D.rd] = R[D.rs1] >> (R[D.rs2] & 31);
+        NEXT();
+    op_sra:
+        R[D.rd] = static_cast<uint32_t>(static_cast<int32_t>(R[D.rs1]) >> (R[D.rs2] & 31));
+        NEXT();
+    op_or:
+        R[D.rd] = R[D.rs1] | R[D.rs2];
+        NEXT();
+    op_and:
+        R[D.rd] = R[D.rs1] & R[D.rs2];
+        NEXT();
+    op_mul:
+        R[D.rd] = R[D.rs1] * R[D.rs2];
+        NEXT();
+    op_lw: {
+        addr = R[D.rs1] + static_cast<uint32_t>(D.imm);
+        saveTrace();
+        uint32_t value = mem.lw(addr);
+        if (D.rd != 0) {
+            R[D.rd] = value;
+        }
+        NEXT();
+    }
+    op_sw:
+        addr = R[D.rs1] + static_cast<uint32_t>(D.imm);
+        saveTrace();
+        mem.sw(addr, R[D.rs2]);
+        NEXT();
+    op_lui:
+        R[D.rd] = static_cast<uint32_t>(D.imm);
+        NEXT();
+    op_auipc:
+        R[D.rd] = pc + static_cast<uint32_t>(D.imm);
+        NEXT();
+    op_beq:
+        if (R[D.rs1] == R[D.rs2]) {
+            JUMP(pc + static_cast<uint32_t>(D.imm));
+        }
+        NEXT();
+    op_bne:
+        if (R[D.rs1] != R[D.rs2]) {
+            JUMP(pc + static_cast<uint32_t>(D.imm));
+        }
+        NEXT();
+    op_blt:
+        if (static_cast<int32_t>(R[D.rs1]) < static_cast<int32_t>(R[D.rs2])) {
+            JUMP(pc + static_cast<uint32_t>(D.imm));
+        }
+        NEXT();
+    op_bge:
+        if (static_cast<int32_t>(R[D.rs1]) >= static_cast<int32_t>(R[D.rs2])) {
+            JUMP(pc + static_cast<uint32_t>(D.imm));
+        }
+        NEXT();
+    op_bltu:
+        if (R[D.rs1] < R[D.rs2]) {
+            JUMP(pc + static_cast<uint32_t>(D.imm));
+        }
+        NEXT();
+    op_bgeu:
+        if (R[D.rs1] >= R[D.rs2]) {
+            JUMP(pc + static_cast<uint32_t>(D.imm));
+        }
+        NEXT();
+    op_jal:
+        if (D.rd != 0) {
+            R[D.rd] = pc + 4;
+        }
+        JUMP(pc + static_cast<uint32_t>(D.imm));
+    op_jalr: {
+        uint32_t target = (R[D.rs1] + static_cast<uint32_t>(D.imm)) & 4294967294U;
+        if (D.rd != 0) {
+            R[D.rd] = pc + 4;
+        }
+        JUMP(target);
+    }
+    op_slow:
+        // редкие инструкции исполняются эталонным runCommand; счётчик нужен CSR
+        progCount = pc;
+        instret = retired;
+        if constexpr (TRACED) {
+            addr = memoryAddress(D, R);
+        }
+        saveTrace();
+        runCommand(D);
+        JUMP(progCount);
+    op_halt:
+    done:
+        progCount = pc;
+        instret = retired;
+        saveTrace();
+#undef JUMP
+#undef NEXT
+#undef RECORD
+#undef D
+#else
+        if constexpr (TRACED) {
+            runInstrumented(program);
+        } else {
+            runSwitch(program);
+        }
+#endif
+    }
+
+    BlockStats runBlocks(const vector<DecodedInstruction> &program) {
+        BlockCache cache(program);
+#if defined(__GNUC__)
+        const void *table[X_END + 1];
+        for (const void *&t: table) {
+            t = &&op_slow;
+        }
+        table[H_NOP] = &&op_nop;
+        table[H_ADDI] = &&op_addi;
+        table[H_ANDI] = &&op_andi;
+        table[H_ORI] = &&op_ori;
+        table[H_XORI] = &&op_xori;
+        table[H_SLLI] = &&op_slli;
+        table[H_SRLI] = &&op_srli;
+        table[H_SRAI] = &&op_srai;
+        table[H_ADD] = &&op_add;
+        table[H_SUB] = &&op_sub;
+        table[H_XOR] = &&op_xor;
+        table[H_OR] = &&op_or;
+        table[H_AND] = &&op_and;
+        table[H_SLT] = &&op_slt;
+        table[H_SLTU] = &&op_sltu;
+        table[H_MUL] = &&op_mul;
+        table[H_LW] = &&op_lw;
+        table[H_SW] = &&op_sw;
+        table[H_LUI] = &&op_li;
+        table[X_LI] = &&op_li;
+        table[H_BEQ] = &&op_branch;
+        table[H_BNE] = &&op_branch;
+        table[H_BLT] = &&op_branch;
+        table[H_BGE] = &&op_branch;
+        table[H_BLTU] = &&op_branch;
+        table[H_BGEU] = &&op_branch;
+        table[X_ADDI_BRANCH] = &&op_addi_branch;
+        table[H_JAL] = &&op_jal;
+        table[H_JALR] = &&op_jalr;
+        table[X_END] = &&op_end;
+
+        uint32_t *R = registers.data();
+        Memory &mem = *memory;
+        size_t count = program.size();
+        uint32_t pc = progCount;
+        Block *block = nullptr;
+        const BlockOp *op = nullptr;
+
+#define ENTER_NEXT_BLOCK()                                                                                             \
+    do {                                                                                                               \
+        instret += block->length;                                                                                      \
+        if (instret >= stepLimit) {                                                                                    \
+            goto done;                                                                                                 \
+        }                                                                                                              \
+        if (block->nextPc == pc && block->next != nullptr) {                                                           \
+            block = block->next;                                                                                       \
+            cache.stats.chained++;                                                                                     \
+            op = block->ops.data();                                                                                    \
+            goto *op->target;                                                                                          \
+        }                                                                                                              \
+        goto dispatch_block;                                                                                           \
+    } while (0)
+
+    dispatch_block:
+        if (pc / 4 >= count) {
+            goto done;
+        }
+        if (pc % 4 != 0) {
+            // невыровненный адрес: блоки ключуются по выровненному progCount
+            progCount = pc;
+            runCommand(program[pc / 4]);
+            instret++;
+            pc = progCount;
+            block = nullptr;
+            goto dispatch_block;
+        }
+        {
+            Block *nextBlock = cache.lookup(pc);
+            if (nextBlock->ops.back().target == nullptr) {
+                for (BlockOp &o: nextBlock->ops) {
+                    o.target = table[o.kind];
+                }
+            }
+            if (block != nullptr) {
+                block->nextPc = pc;
+                block->next = nextBlock;
+            }
+            block = nextBlock;
+        }
+        op = block->ops.data();
+        goto *op->target;
+
+#define NEXT_OP()                                                                                                      \
+    do {                                                                                                               \
+        op++;                                                                                                          \
+        goto *op->target;                                                                                              \
+    } while (0)
+
+    op_nop:
+        NEXT_OP();
+    op_addi:
+        R[op->rd] = R[op->rs1] + static_cast<uint32_t>(op->imm);
+        NEXT_OP();
+    op_andi:
+        R[op->rd] = R[op->rs1] & static_cast<uint32_t>(op->imm);
+        NEXT_OP();
+    op_ori:
+        R[op->rd] = R[op->rs1] | static_cast<uint32_t>(op->imm);
+        NEXT_OP();
+    op_xori:
+        R[op->rd] = R[op->rs1] ^ static_cast<uint32_t>(op->imm);
+        NEXT_OP();
+    op_slli:
+        R[op->rd] = R[op->rs1] << op->imm;
+        NEXT_OP();
+    op_srli:
+        R[op->rd] = R[op->rs1] >> op->imm;
+        NEXT_OP();
+    op_srai:
+        R[op->rd] = static_cast<uint32_t>(static_cast<int32_t>(R[op->rs1]) >> op->imm);
+        NEXT_OP();
+    op_add:
+        R[op->rd] = R[op->rs1] + R[op->rs2];
+        NEXT_OP();
+    op_sub:
+        R[op->rd] = R[op->rs1] - R[op->rs2];
+        NEXT_OP();
+    op_xor:
+        R[op->rd] = R[op->rs1] ^ R[op->rs2];
+        NEXT_OP();
+    op_or:
+        R[op->rd] = R[op->rs1] | R[op->rs2];
+        NEXT_OP();
+    op_and:
+        R[op->rd] = R[op->rs1] & R[op->rs2];
+        NEXT_OP();
+    op_slt:
+        R[op->rd] = (static_cast<int32_t>(R[op->rs1]) < static_cast<int32_t>(R[op->rs2])) ? 1U : 0U;
+        NEXT_OP();
+    op_sltu:
+        R[op->rd] = (R[op->rs1] < R[op->rs2]) ? 1U : 0U;
+        NEXT_OP();
+    op_mul:
+        R[op->rd] = R[op->rs1] * R[op->rs2];
+        NEXT_OP();
+    op_lw: {
+        uint32_t value = mem.lw(R[op->rs1] + static_cast<uint32_t>(op->imm));
+        if (op->rd != 0) {
+            R[op->rd] = value;
+        }
+        NEXT_OP();
+    }
+    op_sw:
+        mem.sw(R[op->rs1] + static_cast<uint32_t>(op->imm), R[op->rs2]);
+        NEXT_OP();
+    op_li:
+        R[op->rd] = static_cast<uint32_t>(op->imm);
+        NEXT_OP();
+    op_branch:
+        pc = op->pc + (branchTaken(op->kind, R[op->rs1], R[op->rs2]) ? static_cast<uint32_t>(op->imm) : 4);
+        ENTER_NEXT_BLOCK();
+    op_addi_branch:
+        R[op->rd] = R[op->rs1] + static_cast<uint32_t>(op->imm);
+        pc = op->pc + 4 +
+             (branchTaken(op->branch, R[op->brRs1], R[op->brRs2]) ? static_cast<uint32_t>(op->brImm) : 4);
+        ENTER_NEXT_BLOCK();
+    op_jal:
+        if (op->rd != 0) {
+            R[op->rd] = op->pc + 4;
+        }
+        pc = op->pc + static_cast<uint32_t>(op->imm);
+        ENTER_NEXT_BLOCK();
+    op_jalr: {
+        uint32_t target = (R[op->rs1] + static_cast<uint32_t>(op->imm)) & 4294967294U;
+        if (op->rd != 0) {
+            R[op->rd] = op->pc + 4;
+        }
+        pc = target;
+        ENTER_NEXT_BLOCK();
+    }
+    op_end:
+        pc = block->startPc + 4 * block->length;
+        ENTER_NEXT_BLOCK();
+    op_slow: {
+        // редкие инструкции исполняются эталонным runCommand
+        progCount = op->pc;
+        DecodedInstruction d{static_cast<Handler>(op->kind), op->rd, op->rs1, op->rs2, op->imm};
+        runCommand(d);
+        NEXT_OP();
+    }
+    done:
+        progCount = pc;
+#undef NEXT_OP
+#undef ENTER_NEXT_BLOCK
+#else
+        runSwitch(program);
+#endif
+        return cache.stats;
+    }
+
+    // горячие блоки исполняются нативным кодом, всё остальное — через runCommand
+    JitStats runJit(const vector<DecodedInstruction> &program) {
+        JitStats stats;
+#ifdef RV_JIT_X86_64
+        struct Entry {
+            uint32_t heat = 0;
+            uint32_t length = 0;
+            bool tried = false;
+            JitFn fn = nullptr;
+        };
+        JitCompiler compiler;
+        vector<Entry> entries(program.size());
+        size_t count = program.size();
+        bool blockStart = true;
+
+        while (progCount / 4 < count && (instret < stepLimit || !blockStart)) {
+            if (blockStart && progCount % 4 == 0) {
+                Entry &entry = entries[progCount / 4];
+                if (entry.fn == nullptr && !entry.tried && ++entry.heat >= jitThreshold) {
+                    entry.tried = true;
+                    entry.fn = compiler.compile(program, progCount, entry.length, stats);
+                }
+                if (entry.fn != nullptr) {
+                    if (jitDiff) {
+                        // блок меняет только регистры и pc, поэтому сначала его исполняет интерпретатор
+                        // на этом же ядре, затем регистры откатываются и исполняется машинный код
+                        uint32_t pc = progCount;
+                        array<uint32_t, 32> before = registers;
+                        for (uint32_t k = 0; k < entry.length; k++) {
+                            const DecodedInstruction &d = program[progCount / 4];
+                            if (!JitCompiler::translatable(d.handler)) {
+                                throw logic_error("jit diff: block at pc " + to_string(pc) +
+                                                  " contains an instruction with memory or system side effects");
                             }
-                            case F1_7: // MULH
-                            {
-                                if (r.rd != 0) {
-                                    int64_t prod = static_cast<int64_t>(srs1) * static_cast<int64_t>(srs2);
-                                    registers[r.rd] = static_cast<uint32_t>((prod >> 32));
+                            runCommand(d);
+                        }
+                        array<uint32_t, 32> expected = registers;
+                        uint32_t expectedPc = progCount;
+                        registers = before;
+                        progCount = entry.fn(registers.data());
+                        stats.diffChecks++;
+                        if (expectedPc != progCount || expected != registers) {
+                            cerr << "jit diff: block at pc " << pc << " diverged" << endl;
+                            for (int r = 0; r < 32; r++) {
+                                if (expected[r] != registers[r]) {
+                                    cerr << "  x" << r << ": interpreter " << expected[r] << ", jit "
+                                         << registers[r] << endl;
                                 }
-                                break;
                             }
+                            cerr << "  pc: interpreter " << expectedPc << ", jit " << progCount << endl;
+                            throw runtime_error("jit diverged from interpreter");
                         }
-                        break;
+                    } else {
+                        progCount = entry.fn(registers.data());
+                    }
+                    instret += entry.length;
+                    stats.jitRuns++;
+                    stats.jitInstret += entry.length;
+                    // блок заканчивается переходом или перед нетранслируемой инструкцией
+                    blockStart = true;
+                    continue;
+                }
+            }
+            const DecodedInstruction &d = program[progCount / 4];
+            runCommand(d);
+            instret++;
+            stats.interpInstret++;
+            blockStart = BlockCache::endsBlock(d.handler) || !JitCompiler::translatable(d.handler);
+        }
+#else
+        runSwitch(program);
+        stats.interpInstret = instret;
+#endif
+        return stats;
+    }
 
-                    case F2: {
-                        switch (r.funct7) {
-                            case F0_7: // SLT
-                            {
-                                if (r.rd != 0) {
-                                    registers[r.rd] = (srs1 < srs2) ? 1U : 0U;
-                                }
-                                break;
-                            }
+    // пошаговый прогон с моделями вокруг ядра; быстрые движки их не вызывают
+    // адрес обращения к памяти, 0 — если инструкция в память не ходит. Считается до исполнения:
+    // rd может совпасть с rs1
+    static uint32_t memoryAddress(const DecodedInstruction &d, const uint32_t *R) {
+        if (d.handler >= H_LB && d.handler <= H_SW) {
+            return R[d.rs1] + static_cast<uint32_t>(d.imm);
+        }
+        if (d.handler >= H_LR_W && d.handler <= H_AMOMAXU_W) {
+            return R[d.rs1];
+        }
+        return 0;
+    }
+
+    void runInstrumented(const vector<DecodedInstruction> &program) {
+        const DecodedInstruction *code = program.data();
+        size_t count = program.size();
+        while (progCount / 4 < count && instret < stepLimit) {
+            uint32_t pc = progCount;
+            if (caches != nullptr) {
+                caches->fetch(pc);
+            }
+            const DecodedInstruction &d = code[pc / 4];
+            uint32_t addr = (trace != nullptr) ? memoryAddress(d, registers.data()) : 0;
+            runCommand(d);
+            if (trace != nullptr) {
+                trace->record(pc, registers[d.rd], addr);
+            }
+            if (pipeline != nullptr) {
+                pipeline->retire(d, pc, progCount);
+            }
+            // регистры переход не меняет, исход можно вычислить после исполнения
+            bool isBranch = d.handler >= H_BEQ && d.handler <= H_BGEU;
+            bool taken = isBranch && branchTaken(d.handler, registers[d.rs1], registers[d.rs2]);
+            if (branches != nullptr) {
+                if (isBranch) {
+                    branches->branch(pc, pc + static_cast<uint32_t>(d.imm), taken);
+                } else if (d.handler == H_JAL || d.handler == H_JALR) {
+                    branches->jump(d.handler, d.rd, d.rs1, pc, progCount);
+                }
+            }
+            if (profiler != nullptr) {
+                profiler->retire(d, pc, progCount, taken);
+            }
+            instret++;
+        }
+    }
+
+    bool instrumented() const {
+        return caches != nullptr || pipeline != nullptr || branches != nullptr || profiler != nullptr ||
+               trace != nullptr;
+    }
+
+    void run(const vector<DecodedInstruction> &program) {
+        if (trace != nullptr && caches == nullptr && pipeline == nullptr && branches == nullptr && profiler == nullptr) {
+            runThreaded<true>(program);
+        } else if (instrumented()) {
+            runInstrumented(program);
+        } else if (currentEngine == "jit") {
+            jitStats = runJit(program);
+        } else if (currentEngine == "threaded") {
+            runThreaded(program);
+        } else if (currentEngine == "block") {
+            blockStats = runBlocks(program);
+        } else {
+            runSwitch(program);
+        }
+    }
+
+    array<uint32_t, 32> totalRun(const vector<DecodedInstruction> &program) {
+        if (progCount / 4 < program.size()) {
+            run(program); // после прогона с контрольными точками программа уже завершена
+        }
+        cout << progCount << endl;
+        return registers;
+    }
+};
+
+
+struct EngineStats {
+    string engine;
+    uint64_t instret;
+    double seconds;
+
+    double mips() const { return (seconds > 0) ? static_cast<double>(instret) / seconds / 1e6 : 0.0; }
+};
+
+EngineStats timedRun(CPU &cpu, const vector<DecodedInstruction> &program) {
+    auto start = chrono::steady_clock::now();
+    cpu.run(program);
+    auto finish = chrono::steady_clock::now();
+    return {currentEngine, cpu.instret, chrono::duration<double>(finish - start).count()};
+}
+
+void printEngineStats(const vector<EngineStats> &stats) {
+    cerr << left << setw(10) << "engine" << setw(14) << "instret" << setw(12) << "time_ms"
+         << "MIPS" << endl;
+    for (const EngineStats &s: stats) {
+        cerr << left << setw(10) << s.engine << setw(14) << s.instret << setw(12) << fixed << setprecision(3)
+             << s.seconds * 1e3 << setprecision(1) << s.mips() << endl;
+    }
+}
+
+// аппаратные счётчики хоста вокруг прогона эмулятора (perf_event_open): сколько тактов,
+// инструкций, промахов предсказания и промахов L1 тратит хост на инструкцию гостя.
+// Если perf недоступен (perf_event_paranoid, контейнер, не Linux), остаётся только rdtsc
+struct HostCounters {
+    struct Event {
+        const char *name;
+        uint32_t type;
+        uint64_t config;
+        int fd = -1;
+        double value = 0;
+        bool valid = false;
+    };
+
+    vector<Event> events;
+    bool perf = false;
+    uint64_t tscStart = 0;
+    uint64_t tsc = 0;
+    chrono::steady_clock::time_point timeStart;
+    double seconds = 0;
+
+    static uint64_t readTsc() {
+#ifdef RV_TSC
+        return __rdtsc();
+#else
+        return static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+    }
+
+    static const char *tscName() {
+#ifdef RV_TSC
+        return "tsc";
+#else
+        return "ns";
+#endif
+    }
+
+    HostCounters() {
+#ifdef RV_PERF
+        auto cacheMiss = [](uint64_t cache) {
+            return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        };
+        events = {{"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+                  {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+                  {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+                  {"L1I-misses", PERF_TYPE_HW_CACHE, cacheMiss(PERF_COUNT_HW_CACHE_L1I)},
+                  {"L1D-misses", PERF_TYPE_HW_CACHE, cacheMiss(PERF_COUNT_HW_CACHE_L1D)}};
+        for (Event &event: events) {
+            perf_event_attr attr{};
+            attr.size = sizeof(attr);
+            attr.type = event.type;
+            attr.config = event.config;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            // событий больше, чем свободных счётчиков: ядро их мультиплексирует, значения масштабируются
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            event.fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+            perf = perf || event.fd >= 0;
+        }
+#endif
+    }
+
+    ~HostCounters() {
+#ifdef RV_PERF
+        for (Event &event: events) {
+            if (event.fd >= 0) {
+                close(event.fd);
+            }
+        }
+#endif
+    }
+
+    HostCounters(const HostCounters &) = delete;
+    HostCounters &operator=(const HostCounters &) = delete;
+
+    void start() {
+#ifdef RV_PERF
+        for (Event &event: events) {
+            if (event.fd >= 0) {
+                ioctl(event.fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(event.fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+#endif
+        timeStart = chrono::steady_clock::now();
+        tscStart = readTsc();
+    }
+
+    // значения копятся между start() и stop(), так что можно измерить несколько прогонов
+    void stop() {
+        uint64_t tscStop = readTsc();
+        seconds += chrono::duration<double>(chrono::steady_clock::now() - timeStart).count();
+        tsc += tscStop - tscStart;
+#ifdef RV_PERF
+        for (Event &event: events) {
+            if (event.fd < 0) {
+                continue;
+            }
+            ioctl(event.fd, PERF_EVENT_IOC_DISABLE, 0);
+            uint64_t values[3] = {0, 0, 0}; // значение, время включения, время на счётчике
+            if (read(event.fd, values, sizeof(values)) == static_cast<ssize_t>(sizeof(values)) && values[2] != 0) {
+                event.value += static_cast<double>(values[0]) * static_cast<double>(values[1]) /
+                               static_cast<double>(values[2]);
+                event.valid = true;
+            }
+        }
+#endif
+    }
+
+    void reset() {
+        for (Event &event: events) {
+            event.value = 0;
+            event.valid = false;
+        }
+        tsc = 0;
+        seconds = 0;
+    }
+
+    double value(const string &name) const {
+        for (const Event &event: events) {
+            if (name == event.name && event.valid) {
+                return event.value;
+            }
+        }
+        return -1;
+    }
+
+    void report(ostream &out, uint64_t guestInstructions) const {
+        double perMillion = (guestInstructions > 0) ? 1e6 / static_cast<double>(guestInstructions) : 0.0;
+        out << "host counters per 1M guest instructions" << (perf ? "" : " (perf_event_open unavailable, rdtsc only)")
+            << ":" << endl;
+        out << "  " << left << setw(16) << tscName() << fixed << setprecision(0)
+            << static_cast<double>(tsc) * perMillion << endl;
+        for (const Event &event: events) {
+            out << "  " << left << setw(16) << event.name;
+            if (event.valid) {
+                out << fixed << setprecision(0) << event.value * perMillion << endl;
+            } else {
+                out << "n/a" << endl;
+            }
+        }
+        double cycles = value("cycles");
+        double instructions = value("instructions");
+        if (cycles > 0 && instructions >= 0) {
+            out << "  host IPC " << fixed << setprecision(2) << instructions / cycles << ", "
+                << instructions * perMillion / 1e6 << " host instructions per guest instruction" << endl;
+        }
+    }
+};
+
+
+// контрольная точка: состояние ядра и все выделенные страницы памяти гостя. Заголовок дополняется
+// до границы страницы, страницы лежат в файле выровненными, поэтому восстановление отображает
+// файл через mmap (MAP_PRIVATE: запись гостя копирует страницу) без чтения и копирования.
+// Снимок пишет дочерний процесс после fork(): ядро ОС даёт ему копию памяти при записи,
+// и исполнение не останавливается на время записи
+struct Checkpoint {
+    static constexpr char MAGIC[8] = {'R', 'V', 'C', 'K', 'P', 'T', '0', '1'};
+    static constexpr size_t FIXED_BYTES = 8 + 8 + 8 + 4 * 4 + 32 * 4 + 4;
+
+    // снимок годится только для той же программы: сверяется хеш декодированного кода (FNV-1a)
+    static uint64_t programHash(const vector<DecodedInstruction> &program) {
+        uint64_t hash = 14695981039346656037ULL;
+        auto mix = [&hash](uint32_t value) {
+            for (int i = 0; i < 4; i++) {
+                hash = (hash ^ ((value >> (8 * i)) & 0xFF)) * 1099511628211ULL;
+            }
+        };
+        for (const DecodedInstruction &d: program) {
+            mix(d.handler | (d.rd << 8) | (d.rs1 << 16) | (d.rs2 << 24));
+            mix(static_cast<uint32_t>(d.imm));
+        }
+        return hash;
+    }
+
+    static void put64(vector<uint8_t> &out, uint64_t value) {
+        put32(out, static_cast<uint32_t>(value));
+        put32(out, static_cast<uint32_t>(value >> 32));
+    }
+
+    // заголовок с номерами страниц; сами страницы — в pages в том же порядке
+    static vector<uint8_t> header(const CPU &cpu, uint64_t hash, vector<const uint8_t *> &pages) {
+        vector<uint32_t> numbers;
+        cpu.memory->forEachPage([&](uint32_t addr, const uint8_t *page) {
+            numbers.push_back(addr >> Memory::PAGE_BITS);
+            pages.push_back(page);
+        });
+        vector<uint8_t> out(MAGIC, MAGIC + sizeof(MAGIC));
+        put64(out, hash);
+        put64(out, cpu.instret);
+        put32(out, cpu.progCount);
+        put32(out, cpu.reserved ? 1 : 0);
+        put32(out, cpu.reservedAddr);
+        put32(out, cpu.reservedValue);
+        for (uint32_t r: cpu.registers) {
+            put32(out, r);
+        }
+        put32(out, static_cast<uint32_t>(numbers.size()));
+        for (uint32_t n: numbers) {
+            put32(out, n);
+        }
+        out.resize((out.size() + Memory::PAGE_SIZE - 1) / Memory::PAGE_SIZE * Memory::PAGE_SIZE, 0);
+        return out;
+    }
+
+#ifdef RV_POSIX
+    // только системные вызовы: после fork() в дочернем процессе нельзя трогать аллокатор
+    static bool writeAll(int fd, const uint8_t *data, size_t size) {
+        while (size > 0) {
+            ssize_t n = ::write(fd, data, size);
+            if (n <= 0) {
+                return false;
+            }
+            data += n;
+            size -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    static bool writeFileRaw(const string &tmp, const string &path, const vector<uint8_t> &head,
+                             const vector<const uint8_t *> &pages) {
+        int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        bool ok = writeAll(fd, head.data(), head.size());
+        for (size_t k = 0; ok && k < pages.size(); k++) {
+            ok = writeAll(fd, pages[k], Memory::PAGE_SIZE);
+        }
+        ok = (close(fd) == 0) && ok;
+        return ok && rename(tmp.c_str(), path.c_str()) == 0;
+    }
+#endif
+
+    // запись в фоне: возвращает pid писателя, 0 — если уже записано синхронно
+    static long save(const CPU &cpu, uint64_t hash, const string &path, bool background) {
+        vector<const uint8_t *> pages;
+        vector<uint8_t> head = header(cpu, hash, pages);
+        string tmp = path + ".tmp";
+#ifdef RV_POSIX
+        if (background) {
+            cout.flush();
+            cerr.flush();
+            pid_t pid = fork();
+            if (pid == 0) {
+                _exit(writeFileRaw(tmp, path, head, pages) ? 0 : 1);
+            }
+            if (pid > 0) {
+                return pid;
+            }
+            // fork не удался — пишем сами
+        }
+        if (!writeFileRaw(tmp, path, head, pages)) {
+            throw runtime_error("cannot write checkpoint " + path);
+        }
+#else
+        ofstream out(path, ios::binary);
+        out.write(reinterpret_cast<const char *>(head.data()), static_cast<streamsize>(head.size()));
+        for (const uint8_t *page: pages) {
+            out.write(reinterpret_cast<const char *>(page), Memory::PAGE_SIZE);
+        }
+        if (!out) {
+            throw runtime_error("cannot write checkpoint " + path);
+        }
+#endif
+        return 0;
+    }
+
+    static void wait(long pid, const string &path) {
+#ifdef RV_POSIX
+        int status = 0;
+        if (pid > 0 && (waitpid(static_cast<pid_t>(pid), &status, 0) < 0 || !WIFEXITED(status) ||
+                        WEXITSTATUS(status) != 0)) {
+            throw runtime_error("cannot write checkpoint " + path);
+        }
+#endif
+    }
+
+    static void restore(CPU &cpu, uint64_t hash, const string &path) {
+        MappedFile file(path);
+        if (file.size < FIXED_BYTES || memcmp(file.data, MAGIC, sizeof(MAGIC)) != 0) {
+            throw invalid_argument(path + " is not a checkpoint");
+        }
+        auto get64 = [&file](size_t offset) {
+            return file.get32(offset) | (static_cast<uint64_t>(file.get32(offset + 4)) << 32);
+        };
+        if (get64(8) != hash) {
+            throw invalid_argument("checkpoint " + path + " was taken from a different program");
+        }
+        cpu.instret = get64(16);
+        cpu.progCount = file.get32(24);
+        cpu.dropReservation();
+        if (file.get32(28) != 0) {
+            cpu.reserve(file.get32(32));
+        }
+        cpu.reservedValue = file.get32(36);
+        for (size_t r = 0; r < 32; r++) {
+            cpu.registers[r] = file.get32(40 + 4 * r);
+        }
+        uint32_t pageCount = file.get32(FIXED_BYTES - 4);
+        size_t headBytes = FIXED_BYTES + 4 * static_cast<size_t>(pageCount);
+        size_t dataOffset = (headBytes + Memory::PAGE_SIZE - 1) / Memory::PAGE_SIZE * Memory::PAGE_SIZE;
+        if (headBytes > file.size || dataOffset + static_cast<size_t>(pageCount) * Memory::PAGE_SIZE > file.size) {
+            throw invalid_argument("truncated checkpoint " + path);
+        }
+        Memory &memory = *cpu.memory;
+        memory.clear();
+        uint8_t *pages = nullptr;
+#ifdef RV_POSIX
+        if (pageCount > 0 && memory.mapped == nullptr) {
+            int fd = open(path.c_str(), O_RDONLY);
+            void *mapping = (fd < 0) ? MAP_FAILED
+                                     : mmap(nullptr, file.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if (fd >= 0) {
+                close(fd);
+            }
+            if (mapping != MAP_FAILED) {
+                memory.mapped = static_cast<uint8_t *>(mapping);
+                memory.mappedSize = file.size;
+                pages = memory.mapped + dataOffset;
+            }
+        }
+#endif
+        for (uint32_t k = 0; k < pageCount; k++) {
+            uint32_t addr = file.get32(FIXED_BYTES + 4 * static_cast<size_t>(k)) << Memory::PAGE_BITS;
+            const uint8_t *source = file.data + dataOffset + static_cast<size_t>(k) * Memory::PAGE_SIZE;
+            if (pages != nullptr) {
+                memory.installPage(addr, pages + static_cast<size_t>(k) * Memory::PAGE_SIZE);
+            } else {
+                memcpy(memory.pageForWrite(addr), source, Memory::PAGE_SIZE);
+            }
+        }
+    }
+};
+
+// прогон с контрольными точками каждые every шагов (на ближайшей границе блока после кратного)
+void runCheckpointed(CPU &cpu, const vector<DecodedInstruction> &program, uint64_t every, const string &prefix) {
+    uint64_t hash = Checkpoint::programHash(program);
+    long writer = 0;
+    string writing;
+    while (true) {
+        cpu.stepLimit = (cpu.instret / every + 1) * every;
+        cpu.run(program);
+        if (cpu.progCount / 4 >= program.size()) {
+            break;
+        }
+        // не больше одного писателя: предыдущий снимок должен успеть записаться
+        Checkpoint::wait(writer, writing);
+        writing = prefix + "." + to_string(cpu.instret) + ".ckpt";
+        writer = Checkpoint::save(cpu, hash, writing, true);
+        cerr << "checkpoint " << writing << endl;
+    }
+    cpu.stepLimit = UINT64_MAX;
+    Checkpoint::wait(writer, writing);
+}
+
+
+// пакетный режим: манифест программ, пул потоков с переиспользуемыми CPU и общий файл результатов
+struct BatchJob {
+    string path;
+    vector<pair<uint8_t, uint32_t>> init; // начальные значения регистров
+};
+
+struct BatchResult {
+    string error; // пусто — программа отработала
+    uint32_t progCount = 0;
+    uint64_t instret = 0;
+    array<uint32_t, 32> registers{};
+};
+
+// строка манифеста: путь [регистр=значение ...], '#' — комментарий
+vector<BatchJob> readManifest(const string &path) {
+    MappedFile file(path);
+    string_view text(reinterpret_cast<const char *>(file.data), file.size);
+    string_view tokens[Parser::MAX_TOKENS];
+    vector<BatchJob> jobs;
+    size_t lineNumber = 0;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t end = text.find('\n', pos);
+        if (end == string_view::npos) {
+            end = text.size();
+        }
+        string_view line = text.substr(pos, end - pos);
+        pos = end + 1;
+        lineNumber++;
+        try {
+            size_t count = Parser::tokenize(line, tokens);
+            if (count == 0) {
+                continue;
+            }
+            BatchJob job;
+            job.path = string(tokens[0]);
+            for (size_t k = 1; k < count; k++) {
+                size_t eq = tokens[k].find('=');
+                if (eq == string_view::npos) {
+                    throw invalid_argument("expected reg=value, got '" + string(tokens[k]) + "'");
+                }
+                job.init.emplace_back(static_cast<uint8_t>(Parser::get_register(tokens[k].substr(0, eq))),
+                                      static_cast<uint32_t>(Parser::parse_imm(tokens[k].substr(eq + 1))));
+            }
+            jobs.push_back(move(job));
+        } catch (const invalid_argument &e) {
+            throw Parser::located(path, lineNumber, e.what());
+        }
+    }
+    return jobs;
+}
+
+// .asm собирается, всё остальное грузится как готовый образ
+Image buildImage(const string &path, bool peephole) {
+    if (path.size() < 4 || path.compare(path.size() - 4, 4, ".asm") != 0) {
+        return loadImage(path);
+    }
+    Assembly assembly = Parser(path).parse();
+    if (peephole) {
+        Peephole::run(assembly);
+    }
+    Image image;
+    image.code = Decoder::lower(assembly.text);
+    image.data = move(assembly.data);
+    return image;
+}
+
+// дек Chase–Lev: владелец кладёт и берёт снизу, остальные потоки крадут сверху без блокировок.
+// Задача лежит не больше чем в одном деке, поэтому ёмкости на все задачи хватает без роста
+struct WorkDeque {
+    atomic<int64_t> top{0};
+    atomic<int64_t> bottom{0};
+    unique_ptr<atomic<size_t>[]> buffer;
+    int64_t mask;
+
+    explicit WorkDeque(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        buffer = make_unique<atomic<size_t>[]>(size);
+        mask = static_cast<int64_t>(size) - 1;
+    }
+
+    void push(size_t task) {
+        int64_t b = bottom.load(memory_order_relaxed);
+        buffer[b & mask].store(task, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        bottom.store(b + 1, memory_order_relaxed);
+    }
+
+    bool pop(size_t &task) {
+        int64_t b = bottom.load(memory_order_relaxed) - 1;
+        bottom.store(b, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        int64_t t = top.load(memory_order_relaxed);
+        if (t > b) {
+            bottom.store(b + 1, memory_order_relaxed);
+            return false;
+        }
+        task = buffer[b & mask].load(memory_order_relaxed);
+        if (t == b) {
+            // последний элемент: соревнуемся с ворами
+            bool won = top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed);
+            bottom.store(b + 1, memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+
+    bool steal(size_t &task) {
+        int64_t t = top.load(memory_order_acquire);
+        atomic_thread_fence(memory_order_seq_cst);
+        int64_t b = bottom.load(memory_order_acquire);
+        if (t >= b) {
+            return false;
+        }
+        task = buffer[t & mask].load(memory_order_relaxed);
+        return top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed);
+    }
+};
+
+uint64_t batchSlice = 1 << 20; // шагов за один квант до вытеснения
+uint64_t batchMaxSteps = 0;    // 0 — без ограничения
+
+// программы раздаются по декам рабочих потоков; свободный поток крадёт чужие задачи.
+// Программа исполняется квантами по batchSlice шагов и вытесняется на границе блока;
+// вытесненные ждут, пока не кончатся новые задачи, так что зациклившиеся гости не задерживают очередь
+int runBatch(const string &manifest, const string &output, bool peephole) {
+    auto start = chrono::steady_clock::now();
+    vector<BatchJob> jobs = readManifest(manifest);
+    vector<BatchResult> results(jobs.size());
+    unsigned workers = (parseJobs != 0) ? parseJobs : max(1U, thread::hardware_concurrency());
+    workers = static_cast<unsigned>(min<size_t>(workers, max<size_t>(jobs.size(), 1)));
+
+    struct Task {
+        unique_ptr<CPU> cpu; // держится, пока программа не завершится
+        Image image;
+    };
+    vector<Task> tasks(jobs.size());
+    vector<unique_ptr<WorkDeque>> deques;
+    for (unsigned w = 0; w < workers; w++) {
+        deques.push_back(make_unique<WorkDeque>(jobs.size()));
+    }
+    for (size_t k = 0; k < jobs.size(); k++) {
+        deques[k % workers]->push(k);
+    }
+    atomic<size_t> remaining{jobs.size()};
+    atomic<uint64_t> steals{0};
+    atomic<uint64_t> preemptions{0};
+    atomic<size_t> overBudget{0};
+    // свободные потоки спят, пока в деки не вернут задачи или пока всё не кончится;
+    // счётчик пробуждений читается до обхода деков, так что возврат во время обхода не теряется
+    mutex idleLock;
+    condition_variable idleWake;
+    atomic<uint64_t> wakeups{0};
+    auto wake = [&] {
+        {
+            lock_guard<mutex> guard(idleLock);
+            wakeups.fetch_add(1, memory_order_relaxed);
+        }
+        idleWake.notify_all();
+    };
+
+    auto worker = [&](unsigned self) {
+        vector<unique_ptr<CPU>> freeCpus; // CPU и страницы памяти переиспользуются между программами
+        vector<size_t> parked;            // вытесненные задачи этого потока
+        uint32_t seed = self * 2654435761U + 1;
+        while (remaining.load(memory_order_acquire) != 0) {
+            uint64_t seen = wakeups.load(memory_order_acquire);
+            size_t k = 0;
+            bool found = deques[self]->pop(k);
+            for (unsigned n = 1; !found && n < workers; n++) {
+                seed ^= seed << 13;
+                seed ^= seed >> 17;
+                seed ^= seed << 5;
+                found = deques[(self + seed) % workers]->steal(k);
+                if (found) {
+                    steals++;
+                }
+            }
+            if (!found) {
+                if (parked.empty()) {
+                    unique_lock<mutex> guard(idleLock);
+                    idleWake.wait(guard, [&] {
+                        return wakeups.load(memory_order_relaxed) != seen || remaining.load(memory_order_acquire) == 0;
+                    });
+                    continue;
+                }
+                // новых задач нет: вытесненные возвращаются в дек, где их могут украсть
+                for (size_t p: parked) {
+                    deques[self]->push(p);
+                }
+                parked.clear();
+                wake();
+                continue;
+            }
+
+            Task &task = tasks[k];
+            BatchResult &result = results[k];
+            bool finished = true;
+            try {
+                if (!task.cpu) {
+                    task.image = buildImage(jobs[k].path, peephole);
+                    if (freeCpus.empty()) {
+                        task.cpu = make_unique<CPU>();
+                    } else {
+                        task.cpu = move(freeCpus.back());
+                        freeCpus.pop_back();
+                        task.cpu->reset();
+                    }
+                    for (const auto &reg: jobs[k].init) {
+                        task.cpu->registers[reg.first] = reg.second;
+                    }
+                    task.cpu->registers[0] = 0;
+                    task.cpu->progCount = task.image.entry;
+                    task.image.loadData(*task.cpu->memory);
+                }
+                CPU &cpu = *task.cpu;
+                uint64_t limit = cpu.instret + batchSlice;
+                if (batchMaxSteps != 0) {
+                    limit = min(limit, batchMaxSteps);
+                }
+                cpu.stepLimit = limit;
+                cpu.run(task.image.code);
+                result.progCount = cpu.progCount;
+                result.instret = cpu.instret;
+                result.registers = cpu.registers;
+                if (cpu.progCount / 4 < task.image.code.size()) {
+                    if (batchMaxSteps != 0 && cpu.instret >= batchMaxSteps) {
+                        overBudget++;
+                        result.error = "step budget of " + to_string(batchMaxSteps) + " exhausted at pc " +
+                                       to_string(cpu.progCount);
+                    } else {
+                        finished = false;
+                    }
+                }
+            } catch (const exception &e) {
+                result.error = e.what();
+            }
+            if (!finished) {
+                preemptions++;
+                parked.push_back(k);
+                continue;
+            }
+            if (task.cpu) {
+                freeCpus.push_back(move(task.cpu));
+            }
+            task.image = Image();
+            if (remaining.fetch_sub(1, memory_order_acq_rel) == 1) {
+                wake();
+            }
+        }
+    };
+    vector<thread> pool;
+    for (unsigned t = 1; t < workers; t++) {
+        pool.emplace_back(worker, t);
+    }
+    worker(0);
+    for (thread &t: pool) {
+        t.join();
+    }
+
+    // одна строка на программу в порядке манифеста: путь pc instret x0..x31 или путь error: сообщение
+    string text;
+    size_t failed = 0;
+    uint64_t instret = 0;
+    for (size_t k = 0; k < jobs.size(); k++) {
+        const BatchResult &result = results[k];
+        instret += result.instret;
+        text += jobs[k].path;
+        if (!result.error.empty()) {
+            failed++;
+            text += " error: " + result.error + "\n";
+            continue;
+        }
+        text += " " + to_string(result.progCount) + " " + to_string(result.instret);
+        for (uint32_t value: result.registers) {
+            text += " " + to_string(value);
+        }
+        text += "\n";
+    }
+    if (output.empty()) {
+        cout << text;
+    } else {
+        writeFile(output, vector<uint8_t>(text.begin(), text.end()));
+    }
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cerr << "batch: " << jobs.size() << " programs (" << failed << " failed, " << overBudget
+         << " over step budget) on " << workers << " threads in " << fixed << setprecision(3) << seconds * 1e3
+         << " ms" << endl;
+    cerr << "throughput: " << setprecision(1) << static_cast<double>(jobs.size()) / seconds << " programs/s, "
+         << static_cast<double>(instret) / seconds << " instructions/s (" << static_cast<double>(instret) / seconds / 1e6
+         << " MIPS)" << endl;
+    cerr << "scheduler: " << steals << " steals, " << preemptions << " preemptions, slice " << batchSlice << " steps"
+         << endl;
+    return (failed == 0) ? 0 : 1;
+}
+
+
+// несколько хартов над общей памятью: каждый на своём потоке хоста или все на одном по очереди квантами.
+// Харт h стартует с a0 = h, a1 = число хартов и собственным стеком ниже stackTop
+uint32_t hartStackSize = 64 * 1024;
+
+int runHarts(const Image &image, unsigned harts, uint64_t slice) {
+    shared_ptr<Memory> memory = make_shared<Memory>();
+    image.loadData(*memory);
+    vector<CPU> cpus;
+    cpus.reserve(harts);
+    for (unsigned h = 0; h < harts; h++) {
+        cpus.emplace_back(memory);
+        CPU &cpu = cpus.back();
+        cpu.progCount = image.entry;
+        cpu.registers[10] = h;
+        cpu.registers[11] = harts;
+        if (memoryLayout.stackTop != 0) {
+            cpu.registers[2] = memoryLayout.stackTop - h * hartStackSize;
+        }
+    }
+    const vector<DecodedInstruction> &program = image.code;
+    vector<double> seconds(harts, 0.0);
+    auto start = chrono::steady_clock::now();
+    if (slice == 0) {
+        vector<exception_ptr> errors(harts);
+        vector<thread> pool;
+        for (unsigned h = 0; h < harts; h++) {
+            pool.emplace_back([&, h] {
+                try {
+                    seconds[h] = timedRun(cpus[h], program).seconds;
+                } catch (...) {
+                    errors[h] = current_exception();
+                }
+            });
+        }
+        for (thread &t: pool) {
+            t.join();
+        }
+        for (const exception_ptr &e: errors) {
+            if (e) {
+                rethrow_exception(e);
+            }
+        }
+    } else {
+        // детерминированный режим: кванты по slice шагов, вытеснение на границе блока
+        bool running = true;
+        while (running) {
+            running = false;
+            for (unsigned h = 0; h < harts; h++) {
+                CPU &cpu = cpus[h];
+                if (cpu.progCount / 4 >= program.size()) {
+                    continue;
+                }
+                cpu.stepLimit = cpu.instret + slice;
+                seconds[h] += timedRun(cpu, program).seconds;
+                running = true;
+            }
+        }
+    }
+    double wall = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout << cpus[0].progCount << endl;
+    for (uint32_t value: cpus[0].registers) {
+        cout << value << " ";
+    }
+    cout << endl;
+    cerr << "hart  pc          instret       time_ms     MIPS" << endl;
+    uint64_t total = 0;
+    for (unsigned h = 0; h < harts; h++) {
+        const CPU &cpu = cpus[h];
+        total += cpu.instret;
+        cerr << left << setw(6) << h << setw(12) << cpu.progCount << setw(14) << cpu.instret << setw(12) << fixed
+             << setprecision(3) << seconds[h] * 1e3 << setprecision(1)
+             << ((seconds[h] > 0) ? static_cast<double>(cpu.instret) / seconds[h] / 1e6 : 0.0) << endl;
+    }
+    cerr << harts << " harts (" << ((slice == 0) ? "threads" : "time-sliced") << "): " << total << " instructions in "
+         << setprecision(3) << wall * 1e3 << " ms, " << setprecision(1) << static_cast<double>(total) / wall / 1e6
+         << " MIPS aggregate" << endl;
+    return 0;
+}
+
+
+// случайная программа RV32IM для дифференциального прогона: только общее для обоих эмуляторов
+// подмножество — x-регистры, числовые смещения, без меток, директив и .data. Переходы только
+// вперёд, циклы считаются в x30, поэтому программа всегда завершается
+struct ProgramGenerator {
+    static constexpr int LINK = 28;    // auipc перед jalr
+    static constexpr int BASE = 29;    // начало окна памяти для загрузок и записей
+    static constexpr int COUNTER = 30; // счётчик цикла
+
+    uint64_t state;
+    vector<string> lines;
 
-                            case F1_7: // MULHSU
-                            {
-                                if (r.rd != 0) {
-                                    uint64_t big = static_cast<int64_t>(srs1) * static_cast<uint64_t>(registers[r.rs2]);
-                                    uint64_t write = static_cast<uint64_t>(big >> 32);
-                                    registers[r.rd] = static_cast<uint32_t>(write);
-                                }
-                                break;
-                            }
-                        }
-                        break;
-                    }
+    explicit ProgramGenerator(uint64_t seed) : state(seed * 0x9E3779B97F4A7C15ULL + 1) {}
 
-                    case F3: {
-                        switch (r.funct7) {
-                            case F0_7: // SLTU
-                            {
-                                if (r.rd != 0) {
-                                    registers[r.rd] = (static_cast<uint32_t>(registers[r.rs1]) <
-                                                       static_cast<uint32_t>(registers[r.rs2]))
-                                                              ? 1U
-                                                              : 0U;
-                                }
-                                break;
-                            }
+    // xorshift64, как у RandomPolicy: одна и та же программа на любой платформе
+    int pick(int lo, int hi) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return lo + static_cast<int>(state % static_cast<uint64_t>(hi - lo + 1));
+    }
 
-                            case F1_7: // MULHU
-                            {
-                                if (r.rd != 0) {
-                                    uint64_t big =
-                                            static_cast<uint64_t>(srs1) * static_cast<uint64_t>(registers[r.rs2]);
-                                    /// вообще может не влезть!!!
-                                    uint64_t write = static_cast<uint64_t>(big >> 32);
-                                    registers[r.rd] = static_cast<uint32_t>(write);
-                                }
-                                break;
-                            }
-                        }
+    // служебные регистры не пишутся, но читаться могут
+    string dest() { return "x" + to_string(pick(1, LINK - 1)); }
 
-                        break;
-                    }
+    string source() { return "x" + to_string(pick(0, 31)); }
 
-                    case F4: {
-                        switch (r.funct7) {
-                            case F0_7: // XOR
-                            {
-                                if (r.rd != 0) {
-                                    registers[r.rd] = registers[r.rs1] ^ registers[r.rs2];
-                                }
+    string straight() {
+        static const char *ops[] = {"add",  "sub",  "sll",    "slt",   "sltu", "xor",  "srl", "sra",  "or",
+                                    "and",  "mul",  "mulh",   "mulhsu", "mulhu", "div", "divu", "rem", "remu"};
+        static const char *imms[] = {"addi", "slti", "sltiu", "xori", "ori", "andi"};
+        static const char *shifts[] = {"slli", "srli", "srai"};
+        static const char *loads[] = {"lb", "lh", "lw", "lbu", "lhu"};
+        static const int loadBytes[] = {1, 2, 4, 1, 2};
+        static const char *stores[] = {"sb", "sh", "sw"};
+        static const int storeBytes[] = {1, 2, 4};
+        switch (pick(0, 9)) {
+            case 0:
+            case 1:
+            case 2: {
+                const char *op = ops[pick(0, 17)];
+                return string(op) + " " + dest() + ", " + source() + ", " + source();
+            }
+            case 3:
+            case 4:
+                return string(imms[pick(0, 5)]) + " " + dest() + ", " + source() + ", " + to_string(pick(-2048, 2047));
+            case 5:
+                return string(shifts[pick(0, 2)]) + " " + dest() + ", " + source() + ", " + to_string(pick(0, 31));
+            case 6:
+                return string(pick(0, 1) ? "lui " : "auipc ") + dest() + ", " + to_string(pick(0, 0xFFFFF));
+            case 7:
+            case 8: {
+                int k = pick(0, 4);
+                return string(loads[k]) + " " + dest() + ", " + to_string(pick(0, 63) * loadBytes[k]) + "(x" +
+                       to_string(BASE) + ")";
+            }
+            default: {
+                int k = pick(0, 2);
+                return string(stores[k]) + " " + source() + ", " + to_string(pick(0, 63) * storeBytes[k]) + "(x" +
+                       to_string(BASE) + ")";
+            }
+        }
+    }
 
-                                break;
-                            }
-                            case F1_7: // DIV
-                            {
-                                if (r.rd != 0) {
-                                    if (registers[r.rs2] != 0) {
-                                        registers[r.rd] = static_cast<uint32_t>((srs1 / srs2));
-                                    } else {
-                                        registers[r.rd] = 4294967295U;
-                                    }
-                                }
-                                break;
-                            }
-                        }
-                        break;
-                    }
+    void generate(size_t length) {
+        static const char *branches[] = {"beq", "bne", "blt", "bge", "bltu", "bgeu"};
+        lines.push_back("lui x" + to_string(BASE) + ", 16");
+        while (lines.size() < length) {
+            int kind = pick(0, 19);
+            if (kind < 14) {
+                lines.push_back(straight());
+                continue;
+            }
+            int skip = pick(1, 6);
+            if (kind < 16) {
+                lines.push_back(string(branches[pick(0, 5)]) + " " + source() + ", " + source() + ", " +
+                                to_string(4 * (skip + 1)));
+            } else if (kind < 17) {
+                lines.push_back("jal " + (pick(0, 1) ? dest() : string("x0")) + ", " + to_string(4 * (skip + 1)));
+            } else if (kind < 18) {
+                lines.push_back("auipc x" + to_string(LINK) + ", 0");
+                lines.push_back("jalr " + dest() + ", x" + to_string(LINK) + ", " + to_string(4 * (skip + 2)));
+            } else {
+                // тело цикла без переходов, выход — когда счётчик дошёл до нуля
+                int body = pick(1, 8);
+                lines.push_back("addi x" + to_string(COUNTER) + ", x0, " + to_string(pick(1, 20)));
+                for (int k = 0; k < body; k++) {
+                    lines.push_back(straight());
+                }
+                lines.push_back("addi x" + to_string(COUNTER) + ", x" + to_string(COUNTER) + ", -1");
+                lines.push_back("bne x" + to_string(COUNTER) + ", x0, " + to_string(-4 * (body + 1)));
+                continue;
+            }
+            for (int k = 0; k < skip; k++) {
+                lines.push_back(straight());
+            }
+        }
+    }
 
-                    case F5: {
-                        switch (r.funct7) {
-                            case F0_7: // SRL
-                            {
-                                if (r.rd != 0) {
-                                    uint32_t shift = registers[r.rs2] & 31;
-                                    registers[r.rd] = registers[r.rs1] >> shift;
-                                }
-                                break;
-                            }
+    void write(const string &path) const {
+        ofstream out(path);
+        for (const string &line: lines) {
+            out << line << "\n";
+        }
+        if (!out) {
+            throw runtime_error("cannot write " + path);
+        }
+    }
+};
 
-                            case F1_7: // DIVU
-                            {
-                                if (r.rd != 0) {
-                                    if (registers[r.rs2] != 0) {
-                                        registers[r.rd] = registers[r.rs1] / registers[r.rs2];
-                                    } else {
-                                        registers[r.rd] = 4294967295U; // If rs2 == 0
-                                    }
-                                }
-                                break;
-                            }
+// состояние после шага в формате трассы эталона: "pc x0 ... x31", по строке на шаг
+void printStepState(string &out, uint32_t pc, const array<uint32_t, 32> &registers) {
+    out += to_string(pc);
+    for (uint32_t r: registers) {
+        out += ' ';
+        out += to_string(r);
+    }
+    out += '\n';
+}
 
-                            case F32_7: // SRA
-                            {
-                                if (r.rd != 0) {
-                                    uint32_t shift = registers[r.rs2] & 31;
-                                    registers[r.rd] = static_cast<uint32_t>((srs1 >> static_cast<int32_t>(shift)));
-                                }
-                                break;
-                            }
-                        }
-                        break;
-                    }
+// пошаговая трасса своим интерпретатором: эталон того же формата для проверки самой обвязки
+void stepTrace(const Image &image) {
+    CPU cpu{};
+    cpu.progCount = image.entry;
+    image.loadData(*cpu.memory);
+    string out;
+    while (cpu.progCount / 4 < image.code.size() && (batchMaxSteps == 0 || cpu.instret < batchMaxSteps)) {
+        cpu.runCommand(image.code[cpu.progCount / 4]);
+        cpu.instret++;
+        printStepState(out, cpu.progCount, cpu.registers);
+        if (out.size() > (1 << 16)) {
+            cout << out;
+            out.clear();
+        }
+    }
+    cout << out << flush;
+}
 
-                    case F6: {
-                        switch (r.funct7) {
-                            case F0_7: // OR
-                            {
-                                if (r.rd != 0) {
-                                    registers[r.rd] = registers[r.rs1] | registers[r.rs2];
-                                }
+// дифференциальный прогон: эталон (--ref-cmd) печатает состояние
+// после каждого шага, проверяемый движок идёт кусками по every шагов до границы блока
+// (every = 1 — каждый блок) или пошагово и сверяется с эталоном в конце каждого куска
+int cosimulate(const string &path, const string &refCmd, uint64_t every, bool stepwise) {
+#ifdef RV_POSIX
+    Parser parser(path);
+    Assembly assembly = parser.parse();
+    vector<size_t> lines;
+    for (const Instruction &instr: assembly.text) {
+        lines.push_back(instr.line);
+    }
+    vector<DecodedInstruction> program = Decoder::lower(assembly.text);
+    vector<string> source = Profiler::readSource(path);
+    auto where = [&](uint32_t pc) {
+        size_t index = pc / 4;
+        if (index >= lines.size() || lines[index] == 0 || lines[index] > source.size()) {
+            return "pc " + to_string(pc);
+        }
+        return "pc " + to_string(pc) + ", line " + to_string(lines[index]) + ": " + source[lines[index] - 1];
+    };
 
-                                break;
-                            }
-                            case F1_7: // REM
-                            {
-                                if (r.rd != 0) {
-                                    if (registers[r.rs2] != 0) {
-                                        registers[r.rd] = static_cast<uint32_t>((srs1 % srs2));
-                                    } else {
-                                        registers[r.rd] = registers[r.rs1];
-                                    }
-                                }
+    CPU cpu{};
+    Image image;
+    image.data = move(assembly.data);
+    image.loadData(*cpu.memory);
 
-                                break;
-                            }
-                        }
-                        break;
-                    }
+    string command = refCmd + " " + path;
+    unique_ptr<FILE, int (*)(FILE *)> ref(popen(command.c_str(), "r"), pclose);
+    if (!ref) {
+        throw runtime_error("cannot run " + command);
+    }
+    uint32_t refPc = 0;
+    array<uint32_t, 32> refRegs{};
+    char buffer[1024];
+    auto readRef = [&]() {
+        if (fgets(buffer, sizeof(buffer), ref.get()) == nullptr) {
+            return false;
+        }
+        char *pos = buffer;
+        char *end = nullptr;
+        refPc = static_cast<uint32_t>(strtoul(pos, &end, 10));
+        for (size_t r = 0; r < 32 && end != pos; r++) {
+            pos = end;
+            refRegs[r] = static_cast<uint32_t>(strtoul(pos, &end, 10));
+        }
+        if (end == pos) {
+            throw runtime_error("malformed reference trace line: " + string(buffer));
+        }
+        return true;
+    };
 
-                    case F7: {
-                        switch (r.funct7) {
-                            case F0_7: // AND
-                            {
-                                if (r.rd != 0) {
-                                    registers[r.rd] = registers[r.rs1] & registers[r.rs2];
-                                }
-                                break;
-                            }
-                            case F1_7: // REMU
-                            {
-                                if (r.rd != 0) {
-                                    if (registers[r.rs2] != 0) {
-                                        registers[r.rd] = registers[r.rs1] % registers[r.rs2];
-                                    } else {
-                                        registers[r.rd] = registers[r.rs1];
-                                    }
-                                }
-                                break;
-                            }
-                        }
-                        break;
-                    }
+    uint64_t checks = 0;
+    while (cpu.progCount / 4 < program.size() && (batchMaxSteps == 0 || cpu.instret < batchMaxSteps)) {
+        uint32_t fromPc = cpu.progCount;
+        uint64_t before = cpu.instret;
+        if (stepwise) {
+            cpu.runCommand(program[cpu.progCount / 4]);
+            cpu.instret++;
+        } else {
+            cpu.stepLimit = cpu.instret + every;
+            cpu.run(program);
+        }
+        for (uint64_t k = before; k < cpu.instret; k++) {
+            if (!readRef()) {
+                cerr << "reference stopped after " << k << " steps, engine ran on from " << where(fromPc) << endl;
+                return 1;
+            }
+        }
+        checks++;
+        if (refPc != cpu.progCount || refRegs != cpu.registers) {
+            cerr << "divergence after step " << cpu.instret << " (steps " << before + 1 << ".." << cpu.instret
+                 << " from " << where(fromPc) << ")" << endl;
+            if (refPc != cpu.progCount) {
+                cerr << "  pc: " << currentEngine << " " << cpu.progCount << ", reference " << refPc << endl;
+            }
+            for (size_t r = 0; r < 32; r++) {
+                if (refRegs[r] != cpu.registers[r]) {
+                    cerr << "  x" << r << ": " << currentEngine << " " << cpu.registers[r] << ", reference "
+                         << refRegs[r] << endl;
                 }
-                progCount = static_cast<int32_t>(static_cast<int32_t>(progCount) + 4);
-                break;
             }
+            if (!stepwise) {
+                cerr << "  rerun with --cosim-step to find the exact instruction" << endl;
+            }
+            return 1;
+        }
+    }
+    if (readRef()) {
+        cerr << "reference runs on after step " << cpu.instret << " (pc " << refPc << ")" << endl;
+        return 1;
+    }
+    cerr << "cosim: " << path << ": " << cpu.instret << " steps, " << checks << " comparisons, no divergence"
+         << endl;
+    return 0;
+#else
+    (void)path, (void)refCmd, (void)every, (void)stepwise;
+    throw runtime_error("co-simulation needs popen()");
+#endif
+}
 
-            case OPC_55: // LUI
-            {
-                U_Type u = get<U_Type>(type);
+// фаззинг: count случайных программ подряд; программа с расхождением остаётся на диске
+int runFuzz(uint64_t count, uint64_t seed, size_t length, const string &refCmd, uint64_t every, bool stepwise) {
+    for (uint64_t k = 0; k < count; k++) {
+        string path = "fuzz-" + to_string(seed + k) + ".asm";
+        ProgramGenerator generator(seed + k);
+        generator.generate(length);
+        generator.write(path);
+        if (cosimulate(path, refCmd, every, stepwise) != 0) {
+            cerr << "diverging program kept in " << path << endl;
+            return 1;
+        }
+        remove(path.c_str());
+    }
+    cerr << "fuzz: " << count << " programs, no divergence" << endl;
+    return 0;
+}
 
-                if (u.rd != 0) {
-                    registers[u.rd] = (static_cast<uint32_t>(u.imm)) << 12;
-                }
-                progCount = static_cast<int32_t>(static_cast<int32_t>(progCount) + 4);
-                break;
+// набор микробенчмарков: манифест в формате --batch (путь и начальные регистры, обычно a0 — число
+// итераций). Для каждого ядра — время разбора и исполнения (медиана повторов после прогрева),
+// MIPS и нс на инструкцию; результаты пишутся в JSON и сравниваются с прошлым прогоном
+struct BenchResult {
+    string name;
+    uint64_t instructions = 0;
+    double parseMs = 0;
+    double runMs = 0;
+    vector<pair<string, double>> host; // счётчики хоста на миллион инструкций гостя
+
+    double mips() const { return (runMs > 0) ? static_cast<double>(instructions) / runMs / 1e3 : 0.0; }
+
+    double nsPerInstruction() const { return (instructions > 0) ? runMs * 1e6 / static_cast<double>(instructions) : 0.0; }
+};
+
+double median(vector<double> values) {
+    if (values.empty()) {
+        return 0.0;
+    }
+    sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+template <typename F>
+double timeMs(F f) {
+    auto start = chrono::steady_clock::now();
+    f();
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+// медиана reps замеров после warmup прогревочных вызовов
+template <typename F>
+double medianMs(unsigned warmup, unsigned reps, F f) {
+    vector<double> times;
+    for (unsigned k = 0; k < warmup + reps; k++) {
+        double ms = timeMs(f);
+        if (k >= warmup) {
+            times.push_back(ms);
+        }
+    }
+    return median(times);
+}
+
+// число после "key": в строке JSON; 0, если ключа нет
+double jsonNumber(const string &line, const string &key) {
+    size_t pos = line.find("\"" + key + "\":");
+    return (pos == string::npos) ? 0.0 : strtod(line.c_str() + pos + key.size() + 3, nullptr);
+}
+
+string jsonString(const string &line, const string &key) {
+    size_t pos = line.find("\"" + key + "\": \"");
+    if (pos == string::npos) {
+        return "";
+    }
+    pos += key.size() + 5;
+    return line.substr(pos, line.find('"', pos) - pos);
+}
+
+// прошлые результаты: по ядру на строку, как их пишет runBench
+map<string, BenchResult> readBenchJson(const string &path) {
+    ifstream in(path);
+    if (!in) {
+        throw runtime_error("cannot open " + path);
+    }
+    map<string, BenchResult> results;
+    for (string line; getline(in, line);) {
+        string name = jsonString(line, "name");
+        if (name.empty()) {
+            continue;
+        }
+        BenchResult &r = results[name];
+        r.name = name;
+        r.instructions = static_cast<uint64_t>(jsonNumber(line, "instructions"));
+        r.parseMs = jsonNumber(line, "parse_ms");
+        r.runMs = jsonNumber(line, "run_ms");
+    }
+    return results;
+}
+
+int runBench(const string &manifest, const string &jsonOut, const string &baseline, unsigned reps, unsigned warmup,
+             double threshold, bool hostCounters) {
+    vector<BatchJob> jobs = readManifest(manifest);
+    vector<BenchResult> results;
+    reps = max(1U, reps);
+    for (const BatchJob &job: jobs) {
+        BenchResult result;
+        result.name = job.path;
+        Image image;
+        result.parseMs = medianMs(warmup, reps, [&] { image = buildImage(job.path, false); });
+
+        CPU cpu{};
+        vector<double> runTimes;
+        unique_ptr<HostCounters> counters;
+        if (hostCounters) {
+            counters = make_unique<HostCounters>();
+        }
+        for (unsigned k = 0; k < warmup + reps; k++) {
+            cpu.reset();
+            cpu.progCount = image.entry;
+            image.loadData(*cpu.memory);
+            for (const auto &init: job.init) {
+                cpu.registers[init.first] = init.second;
+            }
+            if (counters && k >= warmup) {
+                counters->start();
+            }
+            double ms = timeMs([&] { cpu.run(image.code); });
+            if (counters && k >= warmup) {
+                counters->stop();
+            }
+            if (k >= warmup) {
+                runTimes.push_back(ms);
             }
+        }
+        result.instructions = cpu.instret;
+        result.runMs = median(runTimes);
+        if (counters && cpu.instret != 0) {
+            double perMillion = 1e6 / (static_cast<double>(cpu.instret) * reps);
+            result.host.emplace_back(HostCounters::tscName(), static_cast<double>(counters->tsc) * perMillion);
+            for (const HostCounters::Event &event: counters->events) {
+                result.host.emplace_back(event.name, event.valid ? event.value * perMillion : -1);
+            }
+        }
+        results.push_back(result);
+    }
 
-            case OPC_99: {
-                B_Type b = get<B_Type>(type);
-                bool chahge_counter = false;
+    // разбор большого исходника: случайная программа из генератора, разбирается из памяти
+    {
+        ProgramGenerator generator(1);
+        generator.generate(200000);
+        string text;
+        for (const string &line: generator.lines) {
+            text += line;
+            text += '\n';
+        }
+        BenchResult result;
+        result.name = "parse:200k-lines";
+        result.parseMs = medianMs(warmup, reps, [&] {
+            vector<AsmChunk> chunks(1);
+            Parser::parseBuffer(text, result.name, 0, chunks[0]);
+            Parser::link(chunks, result.name);
+        });
+        results.push_back(result);
+    }
 
-                switch (b.funct3) {
-                    case F0: // BEQ
-                        chahge_counter = (registers[b.rs1] == registers[b.rs2]);
-                        break;
-                    case F1: // BNE
-                        chahge_counter = (registers[b.rs1] != registers[b.rs2]);
-                        break;
-                    case F4: // BLT
-                        chahge_counter =
-                                (static_cast<int32_t>(registers[b.rs1]) < static_cast<int32_t>(registers[b.rs2]));
-                        break;
-                    case F5: // BGE
-                        chahge_counter =
-                                (static_cast<int32_t>(registers[b.rs1]) >= static_cast<int32_t>(registers[b.rs2]));
-                        break;
-                    case F6: // BLTU
-                        chahge_counter = (registers[b.rs1] < registers[b.rs2]);
-                        break;
-                    case F7: // BGEU
-                        chahge_counter = (registers[b.rs1] >= registers[b.rs2]);
-                        break;
+    map<string, BenchResult> previous;
+    if (!baseline.empty()) {
+        previous = readBenchJson(baseline);
+    }
+    size_t regressions = 0;
+    cerr << left << setw(22) << "kernel" << setw(12) << "instret" << setw(11) << "parse_ms" << setw(11) << "run_ms"
+         << setw(10) << "MIPS" << setw(10) << "ns/instr" << (previous.empty() ? "" : "vs baseline") << endl;
+    for (const BenchResult &r: results) {
+        cerr << left << setw(22) << r.name << setw(12) << r.instructions << fixed << setprecision(3) << setw(11)
+             << r.parseMs << setw(11) << r.runMs << setprecision(1) << setw(10) << r.mips() << setprecision(3)
+             << setw(10) << r.nsPerInstruction();
+        auto it = previous.find(r.name);
+        if (it != previous.end()) {
+            // исполнение сравнивается по MIPS, разбор — по времени; разбор короче миллисекунды — шум
+            const BenchResult &old = it->second;
+            bool slower = false;
+            if (r.instructions != 0 && old.mips() > 0) {
+                double change = r.mips() / old.mips() - 1.0;
+                slower = change < -threshold;
+                cerr << "run " << showpos << setprecision(1) << change * 100 << "%" << noshowpos << " ";
+            }
+            if (old.parseMs >= 1.0) {
+                double change = r.parseMs / old.parseMs - 1.0;
+                slower = slower || change > threshold;
+                cerr << "parse " << showpos << setprecision(1) << change * 100 << "%" << noshowpos;
+            }
+            if (slower) {
+                regressions++;
+                cerr << "  REGRESSION";
+            }
+        }
+        cerr << endl;
+    }
+
+    if (hostCounters) {
+        cerr << endl << "host counters per 1M guest instructions" << endl << left << setw(22) << "kernel";
+        for (const BenchResult &r: results) {
+            if (!r.host.empty()) {
+                for (const auto &counter: r.host) {
+                    cerr << setw(15) << counter.first;
                 }
-                if (chahge_counter) {
-                    progCount = static_cast<uint32_t>(static_cast<int32_t>(progCount) + b.imm);
+                break;
+            }
+        }
+        cerr << endl;
+        for (const BenchResult &r: results) {
+            if (r.host.empty()) {
+                continue;
+            }
+            cerr << left << setw(22) << r.name;
+            for (const auto &counter: r.host) {
+                if (counter.second < 0) {
+                    cerr << setw(15) << "n/a";
                 } else {
-                    progCount = static_cast<int32_t>(static_cast<int32_t>(progCount) + 4);
+                    cerr << setw(15) << fixed << setprecision(0) << counter.second;
                 }
-                break;
             }
+            cerr << endl;
+        }
+    }
 
-            case OPC_103: // JALR
-            {
-                I_Type i = get<I_Type>(type);
-                if (i.rd != 0) {
-                    registers[i.rd] = progCount + 4;
+    if (!jsonOut.empty()) {
+        ostringstream json;
+        json << "{\n  \"engine\": \"" << currentEngine << "\",\n  \"repetitions\": " << reps
+             << ",\n  \"warmup\": " << warmup << ",\n  \"kernels\": [\n";
+        for (size_t k = 0; k < results.size(); k++) {
+            const BenchResult &r = results[k];
+            json << "    {\"name\": \"" << r.name << "\", \"instructions\": " << r.instructions << ", \"parse_ms\": "
+                 << fixed << setprecision(4) << r.parseMs << ", \"run_ms\": " << r.runMs << ", \"mips\": "
+                 << setprecision(2) << r.mips() << ", \"ns_per_instruction\": " << setprecision(4)
+                 << r.nsPerInstruction();
+            for (const auto &counter: r.host) {
+                if (counter.second >= 0) {
+                    json << ", \"host_" << counter.first << "_per_1m\": " << setprecision(0) << counter.second;
                 }
-                progCount = static_cast<uint32_t>(static_cast<int32_t>(registers[i.rs1]) + i.imm) & 4294967294U;
-                break;
             }
+            json << "}" << (k + 1 < results.size() ? "," : "") << "\n";
+        }
+        json << "  ]\n}\n";
+        string text = json.str();
+        writeFile(jsonOut, vector<uint8_t>(text.begin(), text.end()));
+    }
+    if (regressions != 0) {
+        cerr << regressions << " regression(s) beyond " << threshold * 100 << "%" << endl;
+        return 1;
+    }
+    return 0;
+}
 
-            case OPC_111: // JAL
-            {
-                J_Type u = get<J_Type>(type);
-                if (u.rd != 0) {
-                    registers[u.rd] = progCount + 4;
-                }
-                progCount = static_cast<uint32_t>((static_cast<int32_t>(progCount) + u.imm));
+struct Options {
+    string asm_filename = "no_file";
+    bool stats = false;
+    bool peephole = false;
+    bool compareEngines = false;
+    bool defaultCaches = false;
+    vector<string> icaches;
+    vector<string> dcaches;
+    string policies;
+    uint32_t stackDistanceLine = 0;
+    string emitBin;
+    string emitElf;
+    string image;
+    string batch;
+    string batchOut;
+    bool pipeline = false;
+    string latencies;
+    string predictors;
+    size_t branchTop = 10;
+    string profile;
+    string trace;
+    string traceDump;
+    uint64_t checkpointEvery = 0;
+    string checkpoint = "checkpoint";
+    string restore;
+    bool cosim = false;
+    bool cosimStep = false;
+    uint64_t cosimEvery = 1;
+    string refCmd; // эталона по умолчанию нет: riscv_emulator.clj ещё ни разу не запускался
+    uint64_t fuzz = 0;
+    uint64_t seed = 1;
+    size_t genLength = 200;
+    string genProgram;
+    bool stepTrace = false;
+    string bench;
+    string benchJson;
+    string benchBaseline;
+    unsigned benchReps = 5;
+    unsigned benchWarmup = 1;
+    double benchThreshold = 0.05;
+    bool hostCounters = false;
+    unsigned harts = 1;
+    uint64_t hartSlice = 0;
+};
 
-                break;
+// каждая спецификация без явной политики размножается по списку --policies
+void addCaches(vector<unique_ptr<Cache>> &caches, const string &name, const vector<string> &specs,
+               const string &policies) {
+    vector<string> names;
+    stringstream in(policies);
+    string policy;
+    while (getline(in, policy, ',')) {
+        if (policy == "all") {
+            names.insert(names.end(), {"LRU", "PLRU", "FIFO", "RANDOM"});
+        } else if (!policy.empty()) {
+            names.push_back(policy);
+        }
+    }
+    for (const string &spec: specs) {
+        CacheConfig cfg = CacheConfig::parse(spec);
+        bool explicitPolicy = count(spec.begin(), spec.end(), ':') == 3;
+        if (explicitPolicy || names.empty()) {
+            caches.push_back(make_unique<Cache>(name, cfg));
+            continue;
+        }
+        for (const string &p: names) {
+            cfg.policy = p;
+            caches.push_back(make_unique<Cache>(name, cfg));
+        }
+    }
+}
+
+Options parseOptions(int argc, char *argv[]) {
+    Options opts;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = (i + 1 < argc);
+        if (arg == "--asm") {
+            if (hasValue) {
+                opts.asm_filename = argv[++i];
             }
-            default:;
-                // OPC_15 и OPC_115 не нужны
+        } else if (arg == "--bin" || arg == "--elf") {
+            if (hasValue) {
+                opts.image = argv[++i];
+            }
+        } else if (arg == "--batch") {
+            if (hasValue) {
+                opts.batch = argv[++i];
+            }
+        } else if (arg == "--batch-out") {
+            if (hasValue) {
+                opts.batchOut = argv[++i];
+            }
+        } else if (arg == "--pipeline") {
+            opts.pipeline = true;
+        } else if (arg == "--latency") {
+            if (hasValue) {
+                opts.pipeline = true;
+                opts.latencies = argv[++i];
+            }
+        } else if (arg == "--bpred") {
+            if (hasValue) {
+                opts.predictors = argv[++i];
+            }
+        } else if (arg == "--bpred-top") {
+            if (hasValue) {
+                opts.branchTop = stoul(argv[++i]);
+            }
+        } else if (arg == "--profile") {
+            if (hasValue) {
+                opts.profile = argv[++i];
+            }
+        } else if (arg == "--trace") {
+            if (hasValue) {
+                opts.trace = argv[++i];
+            }
+        } else if (arg == "--trace-dump") {
+            if (hasValue) {
+                opts.traceDump = argv[++i];
+            }
+        } else if (arg == "--checkpoint-every") {
+            if (hasValue) {
+                opts.checkpointEvery = stoull(argv[++i]);
+            }
+        } else if (arg == "--checkpoint") {
+            if (hasValue) {
+                opts.checkpoint = argv[++i];
+            }
+        } else if (arg == "--restore") {
+            if (hasValue) {
+                opts.restore = argv[++i];
+            }
+        } else if (arg == "--cosim") {
+            opts.cosim = true;
+        } else if (arg == "--cosim-step") {
+            opts.cosim = true;
+            opts.cosimStep = true;
+        } else if (arg == "--cosim-every") {
+            if (hasValue) {
+                opts.cosim = true;
+                opts.cosimEvery = max<uint64_t>(1, stoull(argv[++i]));
+            }
+        } else if (arg == "--ref-cmd") {
+            if (hasValue) {
+                opts.refCmd = argv[++i];
+            }
+        } else if (arg == "--fuzz") {
+            if (hasValue) {
+                opts.fuzz = stoull(argv[++i]);
+            }
+        } else if (arg == "--seed") {
+            if (hasValue) {
+                opts.seed = stoull(argv[++i]);
+            }
+        } else if (arg == "--gen-length") {
+            if (hasValue) {
+                opts.genLength = stoul(argv[++i]);
+            }
+        } else if (arg == "--gen-program") {
+            if (hasValue) {
+                opts.genProgram = argv[++i];
+            }
+        } else if (arg == "--step-trace") {
+            opts.stepTrace = true;
+        } else if (arg == "--host-counters") {
+            opts.hostCounters = true;
+        } else if (arg == "--bench") {
+            if (hasValue) {
+                opts.bench = argv[++i];
+            }
+        } else if (arg == "--bench-json") {
+            if (hasValue) {
+                opts.benchJson = argv[++i];
+            }
+        } else if (arg == "--bench-baseline") {
+            if (hasValue) {
+                opts.benchBaseline = argv[++i];
+            }
+        } else if (arg == "--bench-reps") {
+            if (hasValue) {
+                opts.benchReps = static_cast<unsigned>(stoul(argv[++i]));
+            }
+        } else if (arg == "--bench-warmup") {
+            if (hasValue) {
+                opts.benchWarmup = static_cast<unsigned>(stoul(argv[++i]));
+            }
+        } else if (arg == "--bench-threshold") {
+            if (hasValue) {
+                opts.benchThreshold = stod(argv[++i]) / 100;
+            }
+        } else if (arg == "--harts") {
+            if (hasValue) {
+                opts.harts = max(1U, static_cast<unsigned>(stoul(argv[++i])));
+            }
+        } else if (arg == "--hart-slice") {
+            if (hasValue) {
+                opts.hartSlice = stoull(argv[++i]);
+            }
+        } else if (arg == "--hart-stack") {
+            if (hasValue) {
+                hartStackSize = static_cast<uint32_t>(parse_size(argv[++i]));
+            }
+        } else if (arg == "--slice") {
+            if (hasValue) {
+                batchSlice = max<uint64_t>(1, stoull(argv[++i]));
+            }
+        } else if (arg == "--max-steps") {
+            if (hasValue) {
+                batchMaxSteps = stoull(argv[++i]);
+            }
+        } else if (arg == "--jobs") {
+            if (hasValue) {
+                parseJobs = static_cast<unsigned>(stoul(argv[++i]));
+            }
+        } else if (arg == "--engine") {
+            if (hasValue) {
+                currentEngine = argv[++i];
+                if (find(begin(ENGINES), end(ENGINES), currentEngine) == end(ENGINES)) {
+                    throw invalid_argument("unknown engine '" + currentEngine + "', expected switch, threaded, block or jit");
+                }
+            }
+        } else if (arg == "--jit-diff") {
+            jitDiff = true;
+        } else if (arg == "--jit-threshold") {
+            if (hasValue) {
+                jitThreshold = static_cast<uint32_t>(stoul(argv[++i]));
+            }
+        } else if (arg == "--mem-base") {
+            if (hasValue) {
+                memoryLayout.base = static_cast<uint32_t>(parse_size(argv[++i]));
+            }
+        } else if (arg == "--mem-size") {
+            if (hasValue) {
+                memoryLayout.size = parse_size(argv[++i]);
+            }
+        } else if (arg == "--stack-top") {
+            if (hasValue) {
+                memoryLayout.stackTop = static_cast<uint32_t>(parse_size(argv[++i]));
+            }
+        } else if (arg == "--policy") {
+            if (hasValue) {
+                currentPolicy = argv[++i];
+            }
+        } else if (arg == "--policies") {
+            if (hasValue) {
+                opts.policies = argv[++i];
+            }
+        } else if (arg == "--cache") {
+            opts.defaultCaches = true;
+        } else if (arg == "--icache") {
+            if (hasValue) {
+                opts.icaches.push_back(argv[++i]);
+            }
+        } else if (arg == "--dcache") {
+            if (hasValue) {
+                opts.dcaches.push_back(argv[++i]);
+            }
+        } else if (arg == "--stack-distance") {
+            if (hasValue) {
+                opts.stackDistanceLine = static_cast<uint32_t>(parse_size(argv[++i]));
+            }
+        } else if (arg == "--emit-bin") {
+            if (hasValue) {
+                opts.emitBin = argv[++i];
+            }
+        } else if (arg == "--emit-elf") {
+            if (hasValue) {
+                opts.emitElf = argv[++i];
+            }
+        } else if (arg == "--peephole") {
+            opts.peephole = true;
+        } else if (arg == "--stats") {
+            opts.stats = true;
+        } else if (arg == "--compare-engines") {
+            opts.compareEngines = true;
         }
     }
+    return opts;
+}
 
-    deque<uint32_t> totalRun(deque<Instruction> instructions) {
-        while (true) {
-            if (progCount / 4 >= instructions.size()) {
-                break;
+int runMain(const Options &opts) {
+    if (!opts.batch.empty()) {
+        return runBatch(opts.batch, opts.batchOut, opts.peephole);
+    }
+    if (!opts.traceDump.empty()) {
+        dumpTrace(opts.traceDump);
+        return 0;
+    }
+    if (!opts.bench.empty()) {
+        return runBench(opts.bench, opts.benchJson, opts.benchBaseline, opts.benchReps, opts.benchWarmup,
+                        opts.benchThreshold, opts.hostCounters);
+    }
+    if (!opts.genProgram.empty()) {
+        ProgramGenerator generator(opts.seed);
+        generator.generate(opts.genLength);
+        generator.write(opts.genProgram);
+        return 0;
+    }
+    if ((opts.fuzz != 0 || opts.cosim) && opts.refCmd.empty()) {
+        throw invalid_argument("--cosim and --fuzz need --ref-cmd, e.g. --ref-cmd \"./parser --step-trace --asm\"");
+    }
+    if (opts.fuzz != 0) {
+        return runFuzz(opts.fuzz, opts.seed, opts.genLength, opts.refCmd, opts.cosimEvery, opts.cosimStep);
+    }
+    if (opts.cosim) {
+        return cosimulate(opts.asm_filename, opts.refCmd, opts.cosimEvery, opts.cosimStep);
+    }
+    auto loadStart = chrono::steady_clock::now();
+    Image image;
+    PeepholeStats peepholeStats;
+    if (!opts.image.empty()) {
+        image = loadImage(opts.image);
+    } else {
+        Parser parser(opts.asm_filename);
+        Assembly assembly = parser.parse();
+        if (opts.peephole) {
+            peepholeStats = Peephole::run(assembly);
+        }
+
+        if (!opts.emitBin.empty() || !opts.emitElf.empty()) {
+            // режим ассемблера: записать образы и выйти
+            vector<uint32_t> words = Encoder::encode(assembly.text);
+            if (!opts.emitBin.empty()) {
+                if (!assembly.data.empty()) {
+                    throw invalid_argument("flat image cannot hold .data, use --emit-elf");
+                }
+                writeFlatBinary(opts.emitBin, words);
+            }
+            if (!opts.emitElf.empty()) {
+                writeElf32(opts.emitElf, words, assembly.data);
+            }
+            return 0;
+        }
+        image.code = Decoder::lower(assembly.text);
+        image.data = move(assembly.data);
+        image.source = opts.asm_filename;
+        if (!opts.trace.empty()) {
+            image.words = Encoder::encode(assembly.text);
+        }
+        if (!opts.profile.empty()) {
+            image.lines.reserve(assembly.text.size());
+            for (const Instruction &instr: assembly.text) {
+                image.lines.push_back(instr.line);
             }
-            runCommand(instructions[progCount / 4]);
         }
-        cout << progCount << endl;
-        return registers;
     }
-};
+    double loadSeconds = chrono::duration<double>(chrono::steady_clock::now() - loadStart).count();
+    const vector<DecodedInstruction> &program = image.code;
 
+    if (opts.harts > 1) {
+        // модели и снимки рассчитаны на одно ядро: вместе с хартами они молча не работали бы
+        vector<pair<bool, const char *>> single = {
+                {opts.defaultCaches || !opts.icaches.empty() || !opts.dcaches.empty() || opts.stackDistanceLine != 0,
+                 "--cache/--icache/--dcache/--stack-distance"},
+                {opts.pipeline, "--pipeline/--latency"},
+                {!opts.predictors.empty(), "--bpred"},
+                {!opts.profile.empty(), "--profile"},
+                {!opts.trace.empty(), "--trace"},
+                {opts.checkpointEvery != 0, "--checkpoint-every"},
+                {!opts.restore.empty(), "--restore"},
+                {opts.hostCounters, "--host-counters"},
+                {opts.stepTrace, "--step-trace"},
+                {opts.compareEngines, "--compare-engines"}};
+        for (const auto &option: single) {
+            if (option.first) {
+                throw invalid_argument(string(option.second) + " cannot be combined with --harts");
+            }
+        }
+        return runHarts(image, opts.harts, opts.hartSlice);
+    }
 
-int main(int argc, char *argv[]) {
-    string asm_filename = "no_file";
+    if (opts.stepTrace) {
+        stepTrace(image);
+        return 0;
+    }
 
-    for (int i = 1; i < argc; i++) {
-        if (static_cast<string>(argv[i]) == "--asm") {
-            if (i + 1 < argc) {
-                asm_filename = argv[++i];
+    if (opts.compareEngines) {
+        // прогоняем программу на каждом движке и сверяем архитектурное состояние
+        vector<EngineStats> results;
+        CPU reference{};
+        for (const char *engine: ENGINES) {
+            currentEngine = engine;
+            CPU cpu{};
+            cpu.progCount = image.entry;
+            image.loadData(*cpu.memory);
+            results.push_back(timedRun(cpu, program));
+            if (results.size() == 1) {
+                reference = cpu;
+            } else if (cpu.progCount != reference.progCount || cpu.registers != reference.registers ||
+                       cpu.instret != reference.instret) {
+                cerr << "engine " << engine << " diverged from " << results[0].engine << endl;
+                return 1;
             }
         }
+        printEngineStats(results);
+        return 0;
     }
 
-    Parser parser(asm_filename);
-    deque<Instruction> instructions = parser.parse();
     CPU CPU_LRU{};
-    auto lru = CPU_LRU.totalRun(instructions);
+    CPU_LRU.progCount = image.entry;
+    if (!opts.restore.empty()) {
+        Checkpoint::restore(CPU_LRU, Checkpoint::programHash(program), opts.restore);
+    } else {
+        image.loadData(*CPU_LRU.memory);
+    }
+    CacheHierarchy caches;
+    bool defaults = opts.defaultCaches && opts.icaches.empty() && opts.dcaches.empty();
+    addCaches(caches.icaches, "icache", defaults ? vector<string>{"32K:64:8"} : opts.icaches, opts.policies);
+    addCaches(caches.dcaches, "dcache", defaults ? vector<string>{"32K:64:8"} : opts.dcaches, opts.policies);
+    if (opts.stackDistanceLine != 0) {
+        caches.istack = make_unique<StackDistance>(opts.stackDistanceLine);
+        caches.dstack = make_unique<StackDistance>(opts.stackDistanceLine);
+    }
+    if (!caches.empty()) {
+        CPU_LRU.caches = &caches;
+    }
+    unique_ptr<PipelineModel> pipeline;
+    if (opts.pipeline) {
+        pipeline = make_unique<PipelineModel>(PipelineConfig::parse(opts.latencies));
+        CPU_LRU.pipeline = pipeline.get();
+    }
+    unique_ptr<BranchSuite> branches;
+    if (!opts.predictors.empty()) {
+        branches = make_unique<BranchSuite>(opts.predictors);
+        CPU_LRU.branches = branches.get();
+    }
+    unique_ptr<Profiler> profiler;
+    if (!opts.profile.empty()) {
+        profiler = make_unique<Profiler>(program.size(), image.entry);
+        CPU_LRU.profiler = profiler.get();
+    }
+    unique_ptr<TraceWriter> trace;
+    if (!opts.trace.empty()) {
+        trace = make_unique<TraceWriter>(opts.trace, image.entry, image.words);
+        CPU_LRU.trace = trace.get();
+    }
+    unique_ptr<HostCounters> counters;
+    uint64_t instretBefore = CPU_LRU.instret;
+    if (opts.hostCounters) {
+        counters = make_unique<HostCounters>();
+        counters->start();
+    }
+    auto start = chrono::steady_clock::now();
+    if (opts.checkpointEvery != 0) {
+        runCheckpointed(CPU_LRU, program, opts.checkpointEvery, opts.checkpoint);
+    }
+    auto lru = CPU_LRU.totalRun(program);
+    if (counters) {
+        counters->stop();
+    }
     for (int i = 0; i < lru.size(); i++) {
         cout << lru[i] << " ";
     }
+    if (CPU_LRU.caches != nullptr) {
+        cout << endl;
+        caches.report();
+    }
+    if (pipeline) {
+        cout << endl;
+        pipeline->report();
+    }
+    if (branches) {
+        cout << endl;
+        branches->report(CPU_LRU.instret, opts.branchTop);
+    }
+    if (profiler) {
+        profiler->write(opts.profile, image);
+    }
+    if (trace) {
+        trace->close();
+        cout << endl;
+        trace->report();
+    }
+    if (counters) {
+        cout << endl;
+        counters->report(cerr, CPU_LRU.instret - instretBefore);
+    }
+    if (!CPU_LRU.instrumented() && currentEngine == "block") {
+        cout << endl;
+        printBlockStats(CPU_LRU.blockStats);
+    }
+    if (!CPU_LRU.instrumented() && currentEngine == "jit") {
+        cout << endl;
+        printJitStats(CPU_LRU.jitStats);
+    }
+    if (opts.stats) {
+        cout << endl;
+        printEngineStats({{currentEngine, CPU_LRU.instret,
+                           chrono::duration<double>(chrono::steady_clock::now() - start).count()}});
+        cerr << "startup: " << fixed << setprecision(3) << loadSeconds * 1e3 << " ms for " << program.size()
+             << " instructions" << endl;
+        if (opts.peephole) {
+            printPeepholeStats(peepholeStats);
+        }
+        uint64_t pages = CPU_LRU.memory->pagesTouched.load();
+        cerr << "memory: " << pages << " pages touched (" << pages * Memory::PAGE_SIZE / 1024 << " KiB)" << endl;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    try {
+        return runMain(parseOptions(argc, argv));
+    } catch (const exception &e) {
+        cout << endl;
+        cerr << "error: " << e.what() << endl;
+        return 1;
+    }
 }
@@ -87,9 +87,13 @@
      :data {:rd rd :funct3 f3 :rs1 rs1 :rs2 rs2 :funct7 f7}}))
 
 (defn make-i-type [command args]
-  (let [rd (get-register (first args))
-        rs1 (get-register (second args))
-        imm (parse-imm (nth args 2))
+  (let [load? (#{"lb" "lh" "lw" "lbu" "lhu"} command)
+        rd (get-register (first args))
+        ;; loads are written as lw rd, imm(rs1)
+        rs1 (get-register (if load? (nth args 2) (second args)))
+        imm (parse-imm (if load? (second args) (nth args 2)))
+        ;; srai is srli with bit 10 of the immediate set, as in parser.cpp
+        imm (if (= command "srai") (bit-or imm 0x400) imm)
         f3 (case command
              "addi" (:F0 funct3)
              "slti" (:F2 funct3)
@@ -99,14 +103,13 @@
              "andi" (:F7 funct3)
              "slli" (:F1 funct3)
              "srli" (:F5 funct3)
-             "srai" (do (when (>= imm 1024) (set! imm (- imm 1024))) (:F5 funct3)
+             "srai" (:F5 funct3)
              "lb" (:F0 funct3)
              "lh" (:F1 funct3)
              "lw" (:F2 funct3)
              "lbu" (:F4 funct3)
              "lhu" (:F5 funct3))]
-    {:name command :opcode (if (#{"lb" "lh" "lw" "lbu" "lhu"} command) 
-                   (:OPC_3 opcodes) (:OPC_19 opcodes))
+    {:name command :opcode (if load? (:OPC_3 opcodes) (:OPC_19 opcodes))
      :type :I-type
      :data {:rd rd :funct3 f3 :rs1 rs1 :imm imm}}))
 
@@ -195,14 +198,18 @@
     (make-fence command args)
     
     (#{"ecall" "ebreak" "pause" "fence.tso" "nop"} command)
-    (make-system command)))
+    (make-system command)
+
+    ;; an unknown mnemonic must stop the reference, not turn into a silent no-op
+    :else
+    (throw (ex-info (str "unknown instruction '" command "'") {:command command :args args}))))
 
 (defn parse-file [filename]
   (with-open [rdr (io/reader filename)]
     (->> (line-seq rdr)
          (filter #(not (str/blank? %)))
          (map (fn [line]
-                (let [tokens (->> (str/split line #"[,\\s]+")
+                (let [tokens (->> (str/split line #"[,()\s]+")
                                   (map trim)
                                   (remove str/blank?))
                       command (first tokens)
@@ -211,36 +218,73 @@
          (vec))))
 
 ;; ===================== CPU =====================
+;; case needs literal test constants: funct3/funct7 are matched as numbers
+;; and the opcode dispatch uses condp over the opcodes map
+
+(defn load-mem [mem addr bytes signed?]
+  (let [value (reduce (fn [acc i]
+                        (bit-or acc (bit-shift-left (get mem (to-uint32 (+ addr i)) 0) (* 8 i))))
+                      0 (range bytes))
+        bits (* 8 bytes)]
+    (if (and signed? (bit-test value (dec bits)))
+      (to-uint32 (- value (bit-shift-left 1 bits)))
+      value)))
+
+(defn store-mem [mem addr bytes value]
+  (reduce (fn [m i]
+            (assoc m (to-uint32 (+ addr i)) (bit-and (bit-shift-right value (* 8 i)) 0xFF)))
+          mem (range bytes)))
+
+(defn write-rd [state rd value]
+  (if (zero? rd)
+    state
+    (assoc-in state [:regs rd] (to-uint32 value))))
+
 (defn execute [state inst]
   (let [pc (:pc state)
         regs (:regs state)
         opcode (:opcode inst)
-        type (:type inst)
-        data (:data inst)]
-    (case opcode
+        data (:data inst)
+        advanced (assoc state :pc (+ pc 4))]
+    (condp = opcode
       ;; I-type (OPC_3: LOAD)
       (:OPC_3 opcodes)
-      (assoc state :pc (+ pc 4))
-      
+      (let [{:keys [rd funct3 rs1 imm]} data
+            addr (to-uint32 (+ (get regs rs1) imm))
+            mem (:mem state)
+            value (case funct3
+                    0 (load-mem mem addr 1 true)    ; LB
+                    1 (load-mem mem addr 2 true)    ; LH
+                    2 (load-mem mem addr 4 false)   ; LW
+                    4 (load-mem mem addr 1 false)   ; LBU
+                    5 (load-mem mem addr 2 false))] ; LHU
+        (write-rd advanced rd value))
+
+      ;; S-type (OPC_35: STORE)
+      (:OPC_35 opcodes)
+      (let [{:keys [funct3 rs1 rs2 imm]} data
+            addr (to-uint32 (+ (get regs rs1) imm))
+            bytes (case funct3 0 1 1 2 2 4)]
+        (assoc advanced :mem (store-mem (:mem state) addr bytes (get regs rs2))))
+
       ;; I-type (OPC_19: OP-IMM)
       (:OPC_19 opcodes)
       (let [{:keys [rd funct3 rs1 imm]} data
             rs1-val (get regs rs1)
+            shamt (bit-and imm 0x1F)
             result (case funct3
-                     (:F0 funct3) (to-uint32 (+ (to-sint32 rs1-val) imm)) ; ADDI
-                     (:F2 funct3) (if (< (to-sint32 rs1-val) imm) 1 0)    ; SLTI
-                     (:F3 funct3) (if (< rs1-val (to-uint32 imm)) 1 0)    ; SLTIU
-                     (:F4 funct3) (bit-xor rs1-val (to-uint32 imm))       ; XORI
-                     (:F6 funct3) (bit-or rs1-val (to-uint32 imm))        ; ORI
-                     (:F7 funct3) (bit-and rs1-val (to-uint32 imm))       ; ANDI
-                     (:F1 funct3) (bit-shift-left rs1-val (bit-and imm 0x1F)) ; SLLI
-                     (:F5 funct3) (if (zero? (bit-and imm 0x400))
-                                     (bit-shift-right rs1-val (bit-and imm 0x1F)) ; SRLI
-                                     (bit-shift-right (to-sint32 rs1-val) (bit-and imm 0x1F)))] ; SRAI
-        (-> state
-            (assoc :pc (+ pc 4))
-            (assoc-in [:regs rd] (if (zero? rd) (get regs rd) result))))
-      
+                     0 (+ (to-sint32 rs1-val) imm)          ; ADDI
+                     2 (if (< (to-sint32 rs1-val) imm) 1 0) ; SLTI
+                     3 (if (< rs1-val (to-uint32 imm)) 1 0) ; SLTIU
+                     4 (bit-xor rs1-val (to-uint32 imm))    ; XORI
+                     6 (bit-or rs1-val (to-uint32 imm))     ; ORI
+                     7 (bit-and rs1-val (to-uint32 imm))    ; ANDI
+                     1 (bit-shift-left rs1-val shamt)       ; SLLI
+                     5 (if (zero? (bit-and imm 0x400))
+                         (bit-shift-right rs1-val shamt)                ; SRLI
+                         (bit-shift-right (to-sint32 rs1-val) shamt)))] ; SRAI
+        (write-rd advanced rd result))
+
       ;; R-type (OPC_51: OP)
       (:OPC_51 opcodes)
       (let [{:keys [rd funct3 rs1 rs2 funct7]} data
@@ -248,96 +292,100 @@
             rs2-val (get regs rs2)
             srs1 (to-sint32 rs1-val)
             srs2 (to-sint32 rs2-val)
+            shamt (bit-and rs2-val 0x1F)
             result (case [funct3 funct7]
-                     [(:F0 funct3) (:F0_7 funct7)] (to-uint32 (+ srs1 srs2)) ; ADD
-                     [(:F0 funct3) (:F32_7 funct7)] (to-uint32 (- srs1 srs2)) ; SUB
-                     [(:F0 funct3) (:F1_7 funct7)] (to-uint32 (* srs1 srs2)) ; MUL
-                     [(:F1 funct3) (:F0_7 funct7)] (bit-shift-left rs1-val (bit-and rs2-val 0x1F)) ; SLL
-                     [(:F1 funct3) (:F1_7 funct7)] (to-uint32 (bit-shift-right (* srs1 srs2) 32)) ; MULH
-                     [(:F2 funct3) (:F0_7 funct7)] (if (< srs1 srs2) 1 0) ; SLT
-                     [(:F2 funct3) (:F1_7 funct7)] (to-uint32 (bit-shift-right (* srs1 (to-sint32 (bit-and rs2-val 0xFFFFFFFF))) 32)) ; MULHSU
-                     [(:F3 funct3) (:F0_7 funct7)] (if (< rs1-val rs2-val) 1 0) ; SLTU
-                     [(:F3 funct3) (:F1_7 funct7)] (to-uint32 (bit-shift-right (* rs1-val rs2-val) 32)) ; MULHU
-                     [(:F4 funct3) (:F0_7 funct7)] (bit-xor rs1-val rs2-val) ; XOR
-                     [(:F4 funct3) (:F1_7 funct7)] (if (zero? rs2-val) 
-                                                     (to-uint32 -1) 
-                                                     (to-uint32 (quot srs1 srs2))) ; DIV
-                     [(:F5 funct3) (:F0_7 funct7)] (bit-shift-right rs1-val (bit-and rs2-val 0x1F)) ; SRL
-                     [(:F5 funct3) (:F32_7 funct7)] (to-uint32 (bit-shift-right srs1 (bit-and rs2-val 0x1F))) ; SRA
-                     [(:F5 funct3) (:F1_7 funct7)] (if (zero? rs2-val) 
-                                                     (to-uint32 -1) 
-                                                     (quot rs1-val rs2-val)) ; DIVU
-                     [(:F6 funct3) (:F0_7 funct7)] (bit-or rs1-val rs2-val) ; OR
-                     [(:F6 funct3) (:F1_7 funct7)] (if (zero? rs2-val) 
-                                                     rs1-val 
-                                                     (to-uint32 (rem srs1 srs2))) ; REM
-                     [(:F7 funct3) (:F0_7 funct7)] (bit-and rs1-val rs2-val) ; AND
-                     [(:F7 funct3) (:F1_7 funct7)] (if (zero? rs2-val) 
-                                                     rs1-val 
-                                                     (rem rs1-val rs2-val)))] ; REMU
-        (-> state
-            (assoc :pc (+ pc 4))
-            (assoc-in [:regs rd] (if (zero? rd) (get regs rd) result))))
-      
-      ;; U-type (LUI, AUIPC)
-      (if (#{(:OPC_55 opcodes) (:OPC_23 opcodes)} opcode)
-        (let [{:keys [rd imm]} data
-              result (if (= opcode (:OPC_55 opcodes))
-                       (bit-shift-left (to-uint32 imm) 12) ; LUI
-                       (to-uint32 (+ pc (bit-shift-left (to-uint32 imm) 12))))] ; AUIPC
-          (-> state
-              (assoc :pc (+ pc 4))
-              (assoc-in [:regs rd] (if (zero? rd) (get regs rd) result))))
-      
+                     [0 0]  (+ srs1 srs2)                         ; ADD
+                     [0 32] (- srs1 srs2)                         ; SUB
+                     [0 1]  (* srs1 srs2)                         ; MUL
+                     [1 0]  (bit-shift-left rs1-val shamt)        ; SLL
+                     [1 1]  (bit-shift-right (* srs1 srs2) 32)    ; MULH
+                     [2 0]  (if (< srs1 srs2) 1 0)                ; SLT
+                     [2 1]  (bit-shift-right (* srs1 rs2-val) 32) ; MULHSU
+                     [3 0]  (if (< rs1-val rs2-val) 1 0)          ; SLTU
+                     ;; the 64-bit unsigned product does not fit a long, take its high half bitwise
+                     [3 1]  (unsigned-bit-shift-right (unchecked-multiply rs1-val rs2-val) 32) ; MULHU
+                     [4 0]  (bit-xor rs1-val rs2-val)                         ; XOR
+                     [4 1]  (if (zero? rs2-val) -1 (quot srs1 srs2))          ; DIV
+                     [5 0]  (bit-shift-right rs1-val shamt)                   ; SRL
+                     [5 32] (bit-shift-right srs1 shamt)                      ; SRA
+                     [5 1]  (if (zero? rs2-val) -1 (quot rs1-val rs2-val))    ; DIVU
+                     [6 0]  (bit-or rs1-val rs2-val)                          ; OR
+                     [6 1]  (if (zero? rs2-val) rs1-val (rem srs1 srs2))      ; REM
+                     [7 0]  (bit-and rs1-val rs2-val)                         ; AND
+                     [7 1]  (if (zero? rs2-val) rs1-val (rem rs1-val rs2-val)))] ; REMU
+        (write-rd advanced rd result))
+
+      ;; U-type (LUI)
+      (:OPC_55 opcodes)
+      (write-rd advanced (:rd data) (bit-shift-left (:imm data) 12))
+
+      ;; U-type (AUIPC)
+      (:OPC_23 opcodes)
+      (write-rd advanced (:rd data) (+ pc (bit-shift-left (:imm data) 12)))
+
       ;; B-type
       (:OPC_99 opcodes)
       (let [{:keys [funct3 rs1 rs2 imm]} data
             rs1-val (get regs rs1)
             rs2-val (get regs rs2)
             jump? (case funct3
-                    (:F0 funct3) (= rs1-val rs2-val) ; BEQ
-                    (:F1 funct3) (not= rs1-val rs2-val) ; BNE
-                    (:F4 funct3) (< (to-sint32 rs1-val) (to-sint32 rs2-val)) ; BLT
-                    (:F5 funct3) (>= (to-sint32 rs1-val) (to-sint32 rs2-val)) ; BGE
-                    (:F6 funct3) (< rs1-val rs2-val) ; BLTU
-                    (:F7 funct3) (>= rs1-val rs2-val))] ; BGEU
-        (assoc state :pc (if jump? 
-                           (to-uint32 (+ pc imm)) 
+                    0 (= rs1-val rs2-val)                          ; BEQ
+                    1 (not= rs1-val rs2-val)                       ; BNE
+                    4 (< (to-sint32 rs1-val) (to-sint32 rs2-val))  ; BLT
+                    5 (>= (to-sint32 rs1-val) (to-sint32 rs2-val)) ; BGE
+                    6 (< rs1-val rs2-val)                          ; BLTU
+                    7 (>= rs1-val rs2-val))]                       ; BGEU
+        (assoc state :pc (if jump?
+                           (to-uint32 (+ pc imm))
                            (+ pc 4))))
-      
+
       ;; J-type (JAL)
       (:OPC_111 opcodes)
       (let [{:keys [rd imm]} data]
-        (-> state
-            (assoc :pc (to-uint32 (+ pc imm)))
-            (assoc-in [:regs rd] (if (zero? rd) (get regs rd) (+ pc 4)))))
-      
+        (write-rd (assoc state :pc (to-uint32 (+ pc imm))) rd (+ pc 4)))
+
       ;; I-type (JALR)
       (:OPC_103 opcodes)
       (let [{:keys [rd rs1 imm]} data
-            base (get regs rs1)
-            target (to-uint32 (+ (to-sint32 base) imm))]
-        (-> state
-            (assoc :pc (bit-and target 0xFFFFFFFE))
-            (assoc-in [:regs rd] (if (zero? rd) (get regs rd) (+ pc 4)))))
-      
-      (assoc state :pc (+ pc 4)))))
-
-(defn run-cpu [instructions]
-  (loop [state {:pc 0 :regs (vec (repeat 32 0))}]
-    (let [idx (quot (:pc state) 4)]
-      (if (>= idx (count instructions))
-        state
-        (recur (execute state (nth instructions idx))))))
+            target (to-uint32 (+ (get regs rs1) imm))]
+        (write-rd (assoc state :pc (bit-and target 0xFFFFFFFE)) rd (+ pc 4)))
+
+      ;; FENCE and SYSTEM (ecall, ebreak, pause, fence.tso, nop) only advance pc
+      (:OPC_15 opcodes) advanced
+      (:OPC_115 opcodes) advanced
+
+      (throw (ex-info (str "unknown opcode " opcode) {:inst inst})))))
+
+(defn run-cpu
+  ([instructions] (run-cpu instructions (fn [_])))
+  ([instructions on-step]
+   (loop [state {:pc 0 :regs (vec (repeat 32 0)) :mem {}}]
+     (let [idx (quot (:pc state) 4)]
+       (if (>= idx (count instructions))
+         state
+         (let [next-state (execute state (nth instructions idx))]
+           (on-step next-state)
+           (recur next-state)))))))
 
 ;; ===================== Main =====================
+;; --trace prints "pc x0 ... x31" after every step; parser.cpp --cosim reads this format
+(defn print-state [state]
+  (println (str/join " " (cons (:pc state) (:regs state)))))
+
 (defn -main [& args]
   (let [asm-file (second (drop-while #(not= "--asm" %) args))
+        trace? (some #{"--trace"} args)
         instructions (parse-file asm-file)
-        result-state (run-cpu instructions)]
-    (println "Final PC:" (:pc result-state))
-    (println "Registers:")
-    (doseq [[i val] (map-indexed vector (:regs result-state))]
-      (println (str "x" i ":\t" val)))))
+        result-state (run-cpu instructions (if trace? print-state (fn [_])))]
+    (when-not trace?
+      (println "Final PC:" (:pc result-state))
+      (println "Registers:")
+      (doseq [[i val] (map-indexed vector (:regs result-state))]
+        (println (str "x" i ":\t" val))))
+    (flush)))
+
+;; run as a script: clojure -M riscv_emulator.clj --asm code.asm [--trace]
+(when (str/ends-with? (str *file*) "riscv_emulator.clj")
+  (apply -main *command-line-args*))
 
 